@@ -225,6 +225,20 @@ static inline void list_move_tail(ll_t *entry, ll_t *new_head)
 	list_add_tail(entry, new_head);
 }
 
+/* list_splice_init
+ * 	join list onto the front of head and reinitialize list
+ */
+static inline void list_splice_init(ll_t *list, ll_t *head)
+{
+	if(list->next == list)
+		return;
+	list->next->prev = head;
+	list->prev->next = head->next;
+	head->next->prev = list->prev;
+	head->next = list->next;
+	INIT_LIST_HEAD(list);
+}
+
 
 /* TESTS */
 
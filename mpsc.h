@@ -0,0 +1,132 @@
+/*
+ * mpsc.h - Lock-free Multiple Producer Single Consumer Queue.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+/* DESCRIPTION: An intrusive FIFO in the style of ll.h, after Dmitry Vyukov's
+ * non-intrusive MPSC node based queue. Any number of threads may push at
+ * once, with a single atomic exchange and no locks. Only one thread may
+ * pop. Embed an mpsc_node_t in your structure and get back to it with
+ * mpsc_entry().
+ *
+ * mpsc_pop can return NULL while a push is half done. The pushed node shows
+ * up on a later pop.
+ */
+
+#include <stddef.h>
+#include "ll.h"
+
+#ifndef I__MPSC_H__
+	#define I__MPSC_H__
+
+typedef struct mpsc_node {
+	struct mpsc_node *next;
+} mpsc_node_t;
+
+typedef struct mpsc_queue {
+	mpsc_node_t *head; /* last pushed. producers */
+	mpsc_node_t *tail; /* next to pop. consumer */
+	mpsc_node_t stub;
+} mpsc_t;
+
+/* mpsc_entry - get the struct for this node
+ * ptr:		the mpsc_node_t pointer
+ * type:	the type of structure this is embedded in
+ * member:	the name of the node within the struct
+ */
+#define mpsc_entry(ptr, type, member)	container_of(ptr, type, member)
+
+
+/* INIT */
+
+static inline void mpsc_init(mpsc_t *q)
+{
+	q->stub.next = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+
+/* PUSH */
+
+/* mpsc_push
+ * 	add a node to the end. safe from any thread
+ */
+static inline void mpsc_push(mpsc_t *q, mpsc_node_t *n)
+{
+	mpsc_node_t *prev;
+
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&q->head, n, __ATOMIC_ACQ_REL);
+	/* the queue is broken between here and the store */
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+
+/* POP */
+
+/* mpsc_pop
+ * 	take the node at the front, or NULL. consumer thread only
+ */
+static inline mpsc_node_t *mpsc_pop(mpsc_t *q)
+{
+	mpsc_node_t *tail = q->tail;
+	mpsc_node_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	/* skip the stub */
+	if(tail == &q->stub) {
+		if(next == NULL)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+	}
+	if(next) {
+		q->tail = next;
+		return tail;
+	}
+	/* a push is in progress */
+	if(tail != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	/* tail is the last node. put the stub behind it so it can go */
+	mpsc_push(q, &q->stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if(next) {
+		q->tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+
+/* TESTS */
+
+/* mpsc_empty
+ * 	consumer thread only
+ */
+static inline int mpsc_empty(mpsc_t *q)
+{
+	return q->tail == &q->stub &&
+		__atomic_load_n(&q->stub.next, __ATOMIC_ACQUIRE) == NULL;
+}
+
+#endif /* I__MPSC_H__ */
@@ -0,0 +1,425 @@
+/*
+ * packit_rpc.c - Pipelined request/response calls over a TCPC client.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "packit_rpc.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+/* local helper functions */
+static uint64_t _now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* sends go into the message being built, or straight onto the queue when
+ * the session answers the peer by itself. either way nothing waits on the
+ * socket, so the client thread never waits on a sender
+ */
+static ssize_t _packit_rpc_tx(const void *buf, size_t len, void *arg)
+{
+	struct packit_rpc *rpc = (struct packit_rpc *)arg;
+
+	if(rpc->_txmsg)
+		return tcpc_txmsg_append(buf, len, rpc->_txmsg);
+	if(tcpc_client_queue(rpc->_client, buf, len,
+			TCPC_TX_CLASS_DEFAULT) < 0)
+		return -1;
+	return (ssize_t)len;
+}
+
+/* sends p, or the format offer when p is NULL, as one queued message.
+ * must be called with _tx_mutex held
+ */
+static int _packit_rpc_send(struct packit_rpc *rpc, struct packit *p)
+{
+	int ret;
+
+	if((rpc->_txmsg = tcpc_txmsg_alloc(0)) == NULL)
+		return -1;
+	ret = p ? packit_session_send(&rpc->_session, p) :
+		packit_session_offer(&rpc->_session);
+	if(ret == 0)
+		ret = tcpc_client_queue_msg(rpc->_client, rpc->_txmsg,
+				TCPC_TX_CLASS_DEFAULT);
+	else
+		tcpc_txmsg_free(rpc->_txmsg);
+	rpc->_txmsg = NULL;
+
+	return ret;
+}
+
+static int _packit_rpc_get_id(const struct packit *p, uint32_t *id)
+{
+	struct packit_record *r;
+	char *e;
+
+	if((r = packit_get_header_hash(p, PACKITS_ID_KEY, PACKITS_ID_HASH))
+			== NULL)
+		return -1;
+	if(r->type == PACKITS_REC_UINT) {
+		*id = r->num.u;
+		return 0;
+	}
+	*id = (uint32_t)strtoul(r->val, &e, 10);
+	return (*e == '\0' && e != r->val) ? 0 : -1;
+}
+
+/* the following must be called with _mutex held */
+static struct packit_rpc_call *_packit_rpc_find(struct packit_rpc *rpc,
+		uint32_t id)
+{
+	struct packit_rpc_call *call;
+	hl_node_t *n;
+
+	hlist_for_each_entry(call, n,
+			&rpc->_hash_head[id % PACKIT_RPC_HASH_SIZE], hash_list) {
+		if(call->id == id)
+			return call;
+	}
+
+	return NULL;
+}
+
+/* moves a pending call to the completion list */
+static void _packit_rpc_finish(struct packit_rpc *rpc,
+		struct packit_rpc_call *call, int status, struct packit *resp)
+{
+	hlist_del(&call->hash_list);
+	list_del(&call->full_list);
+	rpc->_inflight--;
+	call->status = status;
+	call->resp = resp;
+	/* the sender still uses it, and completes it after the send */
+	if(call->sending) {
+		call->finished = 1;
+		return;
+	}
+	list_add_tail(&call->full_list, rpc->_done);
+}
+
+static void _packit_rpc_expire(struct packit_rpc *rpc, uint64_t now)
+{
+	struct packit_rpc_call *call, *n;
+
+	list_for_each_entry_safe(call, n, &rpc->_pending, full_list) {
+		if(call->deadline_ms <= now)
+			_packit_rpc_finish(rpc, call, PACKIT_RPC_TIMEDOUT, NULL);
+	}
+}
+
+static void _packit_rpc_flush(struct packit_rpc *rpc, int status)
+{
+	struct packit_rpc_call *call, *n;
+
+	list_for_each_entry_safe(call, n, &rpc->_pending, full_list) {
+		_packit_rpc_finish(rpc, call, status, NULL);
+	}
+}
+
+static void _packit_rpc_packit_h(struct packit *p, void *arg)
+{
+	struct packit_rpc *rpc = (struct packit_rpc *)arg;
+	struct packit_rpc_call *call;
+	uint32_t id;
+
+	if(_packit_rpc_get_id(p, &id) == 0 &&
+			(call = _packit_rpc_find(rpc, id)) != NULL) {
+		_packit_rpc_finish(rpc, call, PACKIT_RPC_OK, p);
+		return;
+	}
+
+	/* unsolicited - handed out with the completions, NULL cb */
+	if((call = (struct packit_rpc_call *)
+			calloc(1, sizeof(struct packit_rpc_call))) == NULL) {
+		free(p->data);
+		packit_free(p);
+		return;
+	}
+	call->resp = p;
+	list_add_tail(&call->full_list, rpc->_done);
+}
+/* end of _mutex held functions */
+
+/* runs the callbacks of completions gathered under the lock */
+static void _packit_rpc_complete(struct packit_rpc *rpc, ll_t *done)
+{
+	struct packit_rpc_call *call, *n;
+
+	list_for_each_entry_safe(call, n, done, full_list) {
+		list_del(&call->full_list);
+		if(call->cb) {
+			(call->cb)(rpc, call->resp, call->status, call->arg);
+		} else if(rpc->unsolicited_h) {
+			(rpc->unsolicited_h)(rpc, call->resp);
+		} else {
+			free(call->resp->data);
+			packit_free(call->resp);
+		}
+		free(call);
+	}
+}
+
+static PT_THREAD(_packit_rpc_conn_h(struct tcpc_client *c, size_t len))
+{
+	struct packit_rpc *rpc = (struct packit_rpc *)c->priv;
+	LIST_HEAD(done);
+	int offered;
+
+	/* the answer to our format offer switches tx_fmt, which is for the
+	 * _tx_mutex holder only. _offered only changes on this thread, and
+	 * the rest of the input doesn't need it
+	 */
+	offered = len && rpc->_session._offered;
+	if(offered)
+		pthread_mutex_lock(&rpc->_tx_mutex);
+	pthread_mutex_lock(&rpc->_mutex);
+	rpc->_done = &done;
+	if(len && packit_session_input(&rpc->_session, c->rxbuf, len) < 0)
+		rpc->_error = 1;
+	_packit_rpc_expire(rpc, _now_ms());
+	pthread_mutex_unlock(&rpc->_mutex);
+	if(offered)
+		pthread_mutex_unlock(&rpc->_tx_mutex);
+	_packit_rpc_complete(rpc, &done);
+
+	PT_BEGIN(c->conn_h_pt);
+
+	/* negotiate the format first thing */
+	if(rpc->_session.formats != PACKITS_FMT_MASK(PACKITS_FMT_TEXT)) {
+		pthread_mutex_lock(&rpc->_tx_mutex);
+		if(_packit_rpc_send(rpc, NULL) < 0)
+			rpc->_error = 1;
+		pthread_mutex_unlock(&rpc->_tx_mutex);
+	}
+
+	/* a malformed stream ends the connection */
+	PT_WAIT_UNTIL(c->conn_h_pt, rpc->_error);
+
+	PT_END(c->conn_h_pt);
+}
+
+static void _packit_rpc_close_h(struct tcpc_client *c)
+{
+	struct packit_rpc *rpc = (struct packit_rpc *)c->priv;
+	LIST_HEAD(done);
+
+	pthread_mutex_lock(&rpc->_mutex);
+	rpc->_done = &done;
+	_packit_rpc_flush(rpc, PACKIT_RPC_CLOSED);
+	pthread_mutex_unlock(&rpc->_mutex);
+	_packit_rpc_complete(rpc, &done);
+
+	if(rpc->close_h)
+		(rpc->close_h)(rpc);
+}
+
+/* packit_rpc_call_wait completion */
+struct _packit_rpc_waiter {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int done;
+	int status;
+	struct packit *resp;
+};
+
+static void _packit_rpc_wait_cb(struct packit_rpc *rpc, struct packit *resp,
+		int status, void *arg)
+{
+	struct _packit_rpc_waiter *w = (struct _packit_rpc_waiter *)arg;
+
+	(void)rpc;
+	pthread_mutex_lock(&w->mutex);
+	w->status = status;
+	w->resp = resp;
+	w->done = 1;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->mutex);
+}
+
+
+/* API FUNCTIONS */
+int packit_rpc_init(struct packit_rpc *rpc, struct tcpc_client *c,
+		unsigned int formats)
+{
+	unsigned int i;
+
+	/* clear the structure */
+	memset(rpc, 0, sizeof(struct packit_rpc));
+
+	if(packit_session_init(&rpc->_session, formats, &_packit_rpc_tx, rpc,
+			&_packit_rpc_packit_h, rpc) < 0) {
+		perror("packit_rpc_init");
+		return -1;
+	}
+
+	/* init the mutexes */
+	pthread_mutex_init(&rpc->_mutex, NULL);
+	pthread_mutex_init(&rpc->_tx_mutex, NULL);
+
+	for(i = 0; i < PACKIT_RPC_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&rpc->_hash_head[i]);
+	}
+	INIT_LIST_HEAD(&rpc->_pending);
+	rpc->_next_id = 1;
+
+	/* set the default configurations */
+	rpc->max_inflight = PACKIT_RPC_DEFAULT_MAX;
+
+	/* take over the client */
+	rpc->_client = c;
+	c->priv = rpc;
+	c->conn_h = &_packit_rpc_conn_h;
+	c->conn_close_h = &_packit_rpc_close_h;
+	PT_INIT(c->conn_h_pt);
+
+	return 0;
+}
+
+void packit_rpc_free(struct packit_rpc *rpc)
+{
+	LIST_HEAD(done);
+
+	/* nothing should be left, but never leak a callback */
+	pthread_mutex_lock(&rpc->_mutex);
+	rpc->_done = &done;
+	_packit_rpc_flush(rpc, PACKIT_RPC_CLOSED);
+	pthread_mutex_unlock(&rpc->_mutex);
+	_packit_rpc_complete(rpc, &done);
+
+	packit_session_free(&rpc->_session);
+	pthread_mutex_destroy(&rpc->_mutex);
+	pthread_mutex_destroy(&rpc->_tx_mutex);
+}
+
+int packit_rpc_call(struct packit_rpc *rpc, struct packit *req,
+		unsigned int timeout_ms, packit_rpc_cb_t cb, void *arg)
+{
+	struct packit_rpc_call *call;
+	LIST_HEAD(done);
+	int ret;
+
+	if((call = (struct packit_rpc_call *)
+			malloc(sizeof(struct packit_rpc_call))) == NULL)
+		return -2;
+	call->cb = cb;
+	call->arg = arg;
+	call->resp = NULL;
+	call->deadline_ms = _now_ms() + timeout_ms;
+	call->sending = 1;
+	call->finished = 0;
+
+	/* register before sending, the response may beat us back */
+	pthread_mutex_lock(&rpc->_mutex);
+	if(rpc->_inflight >= rpc->max_inflight) {
+		pthread_mutex_unlock(&rpc->_mutex);
+		free(call);
+		return -1;
+	}
+	if(tcpc_client_socket(rpc->_client) < 0) {
+		pthread_mutex_unlock(&rpc->_mutex);
+		free(call);
+		return -2;
+	}
+	call->id = rpc->_next_id++;
+	hlist_add_head(&call->hash_list,
+			&rpc->_hash_head[call->id % PACKIT_RPC_HASH_SIZE]);
+	list_add_tail(&call->full_list, &rpc->_pending);
+	rpc->_inflight++;
+	pthread_mutex_unlock(&rpc->_mutex);
+
+	pthread_mutex_lock(&rpc->_tx_mutex);
+	if(packit_add_uint_header(req, PACKITS_ID_KEY, call->id) == NULL)
+		ret = -1;
+	else
+		ret = _packit_rpc_send(rpc, req);
+	pthread_mutex_unlock(&rpc->_tx_mutex);
+
+	/* a completion during the send (the response, a close or the
+	 * deadline) left the call to us
+	 */
+	pthread_mutex_lock(&rpc->_mutex);
+	call->sending = 0;
+	if(call->finished) {
+		list_add_tail(&call->full_list, &done);
+		pthread_mutex_unlock(&rpc->_mutex);
+		_packit_rpc_complete(rpc, &done);
+		return 0;
+	}
+	if(ret == 0) {
+		pthread_mutex_unlock(&rpc->_mutex);
+		return 0;
+	}
+
+	/* take it back without calling cb */
+	hlist_del(&call->hash_list);
+	list_del(&call->full_list);
+	rpc->_inflight--;
+	pthread_mutex_unlock(&rpc->_mutex);
+	free(call);
+
+	return -2;
+}
+
+int packit_rpc_call_wait(struct packit_rpc *rpc, struct packit *req,
+		unsigned int timeout_ms, struct packit **resp)
+{
+	struct _packit_rpc_waiter w;
+	int ret;
+
+	memset(&w, 0, sizeof(w));
+	pthread_mutex_init(&w.mutex, NULL);
+	pthread_cond_init(&w.cond, NULL);
+
+	ret = packit_rpc_call(rpc, req, timeout_ms, &_packit_rpc_wait_cb, &w);
+	if(ret == 0) {
+		pthread_mutex_lock(&w.mutex);
+		while(!w.done)
+			pthread_cond_wait(&w.cond, &w.mutex);
+		pthread_mutex_unlock(&w.mutex);
+		*resp = w.resp;
+		ret = w.status;
+	} else {
+		ret = (ret == -1) ? PACKIT_RPC_BUSY : PACKIT_RPC_ESEND;
+	}
+
+	pthread_cond_destroy(&w.cond);
+	pthread_mutex_destroy(&w.mutex);
+
+	return ret;
+}
+
+int packit_rpc_reply_id(struct packit *resp, const struct packit *req)
+{
+	uint32_t id;
+
+	if(_packit_rpc_get_id(req, &id) < 0)
+		return -1;
+	return packit_add_uint_header(resp, PACKITS_ID_KEY, id) ? 0 : -1;
+}
@@ -0,0 +1,174 @@
+/*
+ * packit_rpc.h - Pipelined request/response calls over a TCPC client.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+/* DESCRIPTION: Every request gets a PACKITS_ID_KEY header with an id unique
+ * on the connection, so any number of requests can be in flight at once. The
+ * server copies the id into its response (see packit_rpc_reply_id), in any
+ * order, and the response is handed to the completion callback of the
+ * request it answers.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "tcpc.h"
+#include "packits.h"
+#include "ll.h"
+
+#ifndef I__PACKIT_RPC_H__
+	#define I__PACKIT_RPC_H__
+
+#define PACKIT_RPC_HASH_SIZE	64
+#define PACKIT_RPC_DEFAULT_MAX	1024
+
+/* Completion Status */
+#define PACKIT_RPC_OK		0
+#define PACKIT_RPC_TIMEDOUT	-1	/* deadline passed first */
+#define PACKIT_RPC_CLOSED	-2	/* connection closed first */
+#define PACKIT_RPC_BUSY		-3	/* too many requests in flight */
+#define PACKIT_RPC_ESEND	-4	/* the request couldn't be sent */
+
+struct packit_rpc;
+
+/* completion callback. resp is only set for PACKIT_RPC_OK, and belongs to
+ * the callback (free its data and the packit). Called from the client thread.
+ */
+typedef void (*packit_rpc_cb_t)(struct packit_rpc *rpc, struct packit *resp,
+		int status, void *arg);
+
+/* Outstanding Request */
+struct packit_rpc_call {
+	hl_node_t hash_list;	/* pending calls by id */
+	ll_t full_list;		/* pending calls, or completed ones */
+	uint32_t id;
+	uint64_t deadline_ms;
+	int status;
+	struct packit *resp;
+	packit_rpc_cb_t cb;
+	void *arg;
+	int sending;		/* packit_rpc_call hands it out when done */
+	int finished;		/* completed while sending */
+};
+
+/****************************************************************************
+ * struct packit_rpc
+ * 	DESCRIPTION: RPC state for one tcpc_client. packit_rpc_init takes over
+ * 	the client's priv, conn_h and conn_close_h. Calls can be made from any
+ * 	thread.
+ */
+struct packit_rpc {
+	/* private pointer. to be used by application */
+	void *priv;
+
+	/* configuration parameters */
+	unsigned int max_inflight;
+
+	/* callbacks */
+	/* unsolicited_h gets packits that don't answer a pending request. it
+	 * owns them. without one they are dropped.
+	 */
+	void (*unsolicited_h)(struct packit_rpc *rpc, struct packit *p);
+	/* close_h is called once the connection closes and every pending
+	 * request has completed with PACKIT_RPC_CLOSED.
+	 */
+	void (*close_h)(struct packit_rpc *rpc);
+
+	/* private members - don't modify directly */
+	struct tcpc_client *_client;
+	struct packit_session _session;
+	pthread_mutex_t _mutex;		/* ids and pending calls */
+	pthread_mutex_t _tx_mutex;	/* sending, taken before _mutex */
+	struct tcpc_txmsg *_txmsg;	/* being sent, under _tx_mutex */
+	uint32_t _next_id;
+	unsigned int _inflight;
+	hl_head_t _hash_head[PACKIT_RPC_HASH_SIZE];
+	ll_t _pending;
+	ll_t *_done;			/* completions gathered while locked */
+	int _error;
+};
+
+/* packit_rpc_init
+ * 	DESCRIPTION: attaches rpc to a client. Call it before
+ * 	tcpc_start_client. formats is a mask of PACKITS_FMT_MASK() values to
+ * 	offer the server once connected, 0 to stay with text.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- error
+ */
+int packit_rpc_init(struct packit_rpc *rpc, struct tcpc_client *c,
+		unsigned int formats);
+
+/* packit_rpc_free
+ * 	DESCRIPTION: frees the rpc state. The client must be closed.
+ */
+void packit_rpc_free(struct packit_rpc *rpc);
+
+/* packit_rpc_call
+ * 	DESCRIPTION: queues req with a new PACKITS_ID_KEY header for the
+ * 	client thread to send, without waiting for the response, or for the
+ * 	socket. cb is called exactly once with the response,
+ * 	or with an error status once timeout_ms have passed or the connection
+ * 	closes. Deadlines are checked every poll_timeout_ms of the client.
+ * 	A call completed while it was being sent has cb called from here.
+ * 	req still belongs to the caller.
+ *
+ * 	RETURN VALUES:
+ * 		0	- request queued, cb will be called
+ * 		-1	- max_inflight requests are already pending
+ * 		-2	- error sending the request, cb won't be called
+ */
+int packit_rpc_call(struct packit_rpc *rpc, struct packit *req,
+		unsigned int timeout_ms, packit_rpc_cb_t cb, void *arg);
+
+/* packit_rpc_call_wait
+ * 	DESCRIPTION: packit_rpc_call, blocking until it completes. Must not
+ * 	be called from the client thread (any rpc callback).
+ *
+ * 	RETURN VALUES:
+ * 		PACKIT_RPC_OK		- *resp is the response, and yours
+ * 		PACKIT_RPC_TIMEDOUT	- no response within timeout_ms
+ * 		PACKIT_RPC_CLOSED	- the connection closed
+ * 		PACKIT_RPC_BUSY		- max_inflight requests are pending
+ * 		PACKIT_RPC_ESEND	- error sending the request
+ */
+int packit_rpc_call_wait(struct packit_rpc *rpc, struct packit *req,
+		unsigned int timeout_ms, struct packit **resp);
+
+/* packit_rpc_inflight
+ * 	DESCRIPTION: returns the number of pending requests
+ */
+static inline unsigned int packit_rpc_inflight(struct packit_rpc *rpc)
+{
+	return rpc->_inflight;
+}
+
+/* packit_rpc_reply_id
+ * 	DESCRIPTION: server side. Copies the request id of req into resp.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- req has no id, or error
+ */
+int packit_rpc_reply_id(struct packit *resp, const struct packit *req);
+
+#endif /* I__PACKIT_RPC_H__ */
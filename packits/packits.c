@@ -25,140 +25,252 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 
 /* local helper functions */
-static inline unsigned int hash(const char *str)
+static inline int __packit_find(const struct packit *p, const char *key,
+		uint32_t h)
 {
-	unsigned int h = 0;
+	unsigned int i, mask;
 
-	while(*str) {
-		h += *str++ * 31;
+	if(p->_tbl == NULL) {
+		/* few headers - the hashes share a cacheline */
+		for(i = 0; i < p->_nhdrs; i++) {
+			if(p->_hash[i] == h && strcmp(key, p->_hdrs[i].key) == 0)
+				return (int)i;
+		}
+		return -1;
 	}
 
-	return h % PACKITS_HASH_SIZE;
+	mask = p->_tbl_sz - 1;
+	for(i = h & mask; p->_tbl[i].idx; i = (i + 1) & mask) {
+		if(p->_tbl[i].hash == h &&
+				strcmp(key, p->_hdrs[p->_tbl[i].idx - 1].key) == 0)
+			return (int)p->_tbl[i].idx - 1;
+	}
+	return -1;
 }
 
-static inline struct packit_record *__packit_get_header(const struct packit *p,
-		const char *key, unsigned int hash)
+static inline void __packit_tbl_insert(struct packit_slot *tbl,
+		unsigned int sz, uint32_t h, uint32_t idx)
 {
-	struct packit_record *r;
-	hl_node_t *n;
+	unsigned int i;
 
-	hlist_for_each_entry(r, n, &p->hash_head[hash], hash_list) {
-		if(strcmp(key, r->key) == 0) {
-			return r;
-		}
+	for(i = h & (sz - 1); tbl[i].idx; i = (i + 1) & (sz - 1));
+	tbl[i].hash = h;
+	tbl[i].idx = idx;
+}
+
+/* make room in the hash table for n records, keeping it at most half full */
+static int __packit_tbl_grow(struct packit *p, unsigned int n)
+{
+	struct packit_slot *tbl;
+	unsigned int sz = 16;
+	unsigned int i;
+
+	if(p->_tbl && n * 2 <= p->_tbl_sz)
+		return 0;
+	while(sz < n * 2)
+		sz <<= 1;
+	if((tbl = (struct packit_slot *)calloc(sz, sizeof(*tbl))) == NULL)
+		return -1;
+	for(i = 0; i < p->_nhdrs; i++) {
+		__packit_tbl_insert(tbl, sz, p->_hdrs[i]._hash, i + 1);
 	}
+	free(p->_tbl);
+	p->_tbl = tbl;
+	p->_tbl_sz = sz;
 
-	return NULL;
+	return 0;
 }
 
+static int __packit_hdrs_grow(struct packit *p)
+{
+	struct packit_record *hdrs;
+	unsigned int cap = p->_hdrs_cap * 2;
 
-/* API FUNCTIONS */
-struct packit_record *packit_add_header(struct packit *p, const char *key,
-		const char *val)
+	if(p->_hdrs == p->_inline) {
+		hdrs = (struct packit_record *)malloc(cap * sizeof(*hdrs));
+		if(hdrs)
+			memcpy(hdrs, p->_inline, sizeof(p->_inline));
+	} else {
+		hdrs = (struct packit_record *)realloc(p->_hdrs,
+				cap * sizeof(*hdrs));
+	}
+	if(hdrs == NULL)
+		return -1;
+	p->_hdrs = hdrs;
+	p->_hdrs_cap = cap;
+
+	return 0;
+}
+
+/* counts n more bytes of p against its account */
+static int __packit_charge(struct packit *p, size_t n)
 {
-	struct packit_record *nr;
-	unsigned int h;
-	size_t keylen = strlen(key);
-	size_t vallen = strlen(val);
-	
+	if(p->_mem == NULL)
+		return 0;
+	if(tcpc_mem_charge(p->_mem, n) < 0)
+		return -1;
+	p->_charged += n;
+	return 0;
+}
+
+static void __packit_uncharge(struct packit *p, size_t n)
+{
+	if(p->_mem == NULL)
+		return;
+	tcpc_mem_uncharge(p->_mem, n);
+	p->_charged -= n;
+}
+
+static struct packit_record *__packit_add_header(struct packit *p,
+		const char *key, size_t keylen, uint32_t h,
+		const char *val, size_t vallen)
+{
+	struct packit_record *r;
+	size_t need = keylen + 1 + vallen + 1;
+	char *rec;
+	int i;
+
 	/* check lengths */
 	if(keylen > PACKITS_MAX_KEY)
 		return NULL;
 	if(vallen > PACKITS_MAX_HVAL)
 		return NULL;
 
-	/* hash entry */
-	h = hash(key);
-
 	/* check for existing key */
-	nr = __packit_get_header(p, key, h);
-
-	if(nr) { /* key already existed */
-		free(nr->_rec);
-		nr->_rec = NULL;
-		nr->key = NULL;
-		nr->val = NULL;
+	if((i = __packit_find(p, key, h)) >= 0) { /* key already existed */
+		r = &p->_hdrs[i];
+		if(need > r->_rec_size) {
+			if(__packit_charge(p, need - r->_rec_size) < 0)
+				return NULL;
+			if((rec = (char *)realloc(r->key, need)) == NULL) {
+				__packit_uncharge(p, need - r->_rec_size);
+				return NULL;
+			}
+			r->key = rec;
+			r->_rec_size = (uint32_t)need;
+		}
 	} else { /* key did not exist */
-		/* allocate record */
-		nr = (struct packit_record *)
-				malloc(sizeof(struct packit_record));
-		if(nr == NULL) {
+		if(p->_nhdrs == p->_hdrs_cap && __packit_hdrs_grow(p) < 0)
+			return NULL;
+		if(p->_nhdrs >= PACKITS_INLINE_HDRS &&
+				__packit_tbl_grow(p, p->_nhdrs + 1) < 0)
+			return NULL;
+		/* allocate rec */
+		if(__packit_charge(p, sizeof(*r) + need) < 0)
+			return NULL;
+		if((rec = (char *)malloc(need)) == NULL) {
+			__packit_uncharge(p, sizeof(*r) + need);
 			return NULL;
 		}
-		memset(nr, 0, sizeof(struct packit_record));
 
 		/* insert */
-		hlist_add_head(&nr->hash_list, &p->hash_head[h]);
-		list_add_tail(&nr->full_list, &p->full_head);
+		r = &p->_hdrs[p->_nhdrs];
+		r->key = rec;
+		r->_rec_size = (uint32_t)need;
+		r->_hash = h;
+		r->_keylen = (uint16_t)keylen;
+		/* copy key */
+		memcpy(r->key, key, keylen + 1);
+		if(p->_tbl)
+			__packit_tbl_insert(p->_tbl, p->_tbl_sz, h, p->_nhdrs + 1);
+		else
+			p->_hash[p->_nhdrs] = h;
+		p->_nhdrs++;
 	}
 
-	/* allocate rec */
-	if((nr->_rec = (char *)malloc(keylen + 1 + vallen + 1)) == NULL) {
-		hlist_del(&nr->hash_list);
-		list_del(&nr->full_list);
-		free(nr);
-		return NULL;
-	}
-	nr->key = nr->_rec;
-	nr->val = nr->_rec + keylen + 1;
-	/* copy key */
-	strcpy(nr->key, key);
+	r->val = r->key + keylen + 1;
 	/* copy val */
-	strcpy(nr->val, val);
+	memcpy(r->val, val, vallen + 1);
+	r->_vallen = (uint16_t)vallen;
+	r->type = PACKITS_REC_STR;
+	r->num.u = 0;
+
+	return r;
+}
 
-	return nr;
+static struct packit_record *__packit_add_uint_header(struct packit *p,
+		const char *key, uint32_t h, unsigned int val)
+{
+	struct packit_record *r;
+	char ns[21];
+	int l = snprintf((char *)&ns, sizeof(ns), "%u", val);
+	if((r = __packit_add_header(p, key, strlen(key), h, ns, (size_t)l))
+			!= NULL) {
+		r->type = PACKITS_REC_UINT;
+		r->num.u = val;
+	}
+	return r;
+}
+
+
+/* API FUNCTIONS */
+struct packit_record *packit_add_header(struct packit *p, const char *key,
+		const char *val)
+{
+	return __packit_add_header(p, key, strlen(key), packit_hash(key),
+			val, strlen(val));
 }
 
 struct packit_record *packit_add_uint_header(struct packit *p, const char *key,
 		unsigned int val)
 {
-	char ns[21];
-	snprintf((char *)&ns, sizeof(ns), "%u", val);
-	return packit_add_header(p, key, (const char *)&ns);
+	return __packit_add_uint_header(p, key, packit_hash(key), val);
 }
 
 struct packit_record *packit_add_int_header(struct packit *p, const char *key,
 		int val)
 {
+	struct packit_record *r;
 	char ns[21];
 	snprintf((char *)&ns, sizeof(ns), "%d", val);
-	return packit_add_header(p, key, (const char *)&ns);
+	if((r = packit_add_header(p, key, (const char *)&ns)) != NULL) {
+		r->type = PACKITS_REC_INT;
+		r->num.i = val;
+	}
+	return r;
 }
 
 struct packit_record *packit_get_header(const struct packit *p, const char *key)
 {
-	return __packit_get_header(p, key, hash(key));
+	return packit_get_header_hash(p, key, packit_hash(key));
 }
 
-int packit_send(struct packit *p,
+struct packit_record *packit_get_header_hash(const struct packit *p,
+		const char *key, uint32_t hash)
+{
+	int i = __packit_find(p, key, hash);
+	return i < 0 ? NULL : &p->_hdrs[i];
+}
+
+/* send helpers */
+static int _packit_send_text(struct packit *p,
 		ssize_t (*txf)(const void *buf, size_t len, void *arg),
 		void *arg)
 {
 	struct packit_record *r;
 
-	packit_add_uint_header(p, CLENGTH_KEY, p->clen);
-
 	/* start of packit */
 	if((*txf)(PACKITS_HEADER_START, PACKITS_HEADER_START_L, arg) <= 0) {
 		return -1;
 	}
 
 	forall_packit_headers(p, r) {
-		size_t sep = strlen(r->key);
-		size_t term = strlen(r->val) + sep + 1;
+		size_t sep = r->_keylen;
+		size_t term = r->_vallen + sep + 1;
 		/* make the key/value into single record to send */
-		r->_rec[sep]=PACKITS_KV;
-		r->_rec[term]=PACKITS_RS;
+		r->key[sep]=PACKITS_KV;
+		r->key[term]=PACKITS_RS;
 		/* send the packet */
-		if((*txf)(r->_rec, term + 1, arg) <= 0) {
+		if((*txf)(r->key, term + 1, arg) <= 0) {
 			return -1;
 		}
 		/* fix the record back to separate key/value valid strings */
-		r->_rec[sep]='\0';
-		r->_rec[term]='\0';
+		r->key[sep]='\0';
+		r->key[term]='\0';
 	}
 	
 	/* end of header */
@@ -166,6 +278,110 @@ int packit_send(struct packit *p,
 		return -1;
 	}
 
+	return 0;
+}
+
+static inline uint32_t _zigzag(int v)
+{
+	return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static inline int _unzigzag(uint32_t v)
+{
+	return (int)((v >> 1) ^ -(v & 1));
+}
+
+/* size of a record in the binary header block */
+static size_t _packit_rec_bin_len(const struct packit_record *r)
+{
+	size_t keylen = r->_keylen;
+
+	keylen += 1 + packit_varint_len(keylen);
+	switch(r->type) {
+	case PACKITS_REC_UINT:
+		return keylen + packit_varint_len(r->num.u);
+	case PACKITS_REC_INT:
+		return keylen + packit_varint_len(_zigzag(r->num.i));
+	default:
+		return keylen + packit_varint_len(r->_vallen) + r->_vallen;
+	}
+}
+
+static size_t _packit_val_bin_put(uint8_t *b, const struct packit_record *r)
+{
+	size_t vallen = r->_vallen;
+	size_t n = 0;
+
+	switch(r->type) {
+	case PACKITS_REC_UINT:
+		n += packit_varint_put(b + n, r->num.u);
+		break;
+	case PACKITS_REC_INT:
+		n += packit_varint_put(b + n, _zigzag(r->num.i));
+		break;
+	default:
+		n += packit_varint_put(b + n, vallen);
+		memcpy(b + n, r->val, vallen);
+		n += vallen;
+		break;
+	}
+
+	return n;
+}
+
+static size_t _packit_rec_bin_put(uint8_t *b, const struct packit_record *r)
+{
+	size_t keylen = r->_keylen;
+	size_t n = 0;
+
+	b[n++] = (uint8_t)r->type;
+	n += packit_varint_put(b + n, keylen);
+	memcpy(b + n, r->key, keylen);
+	n += keylen;
+
+	return n + _packit_val_bin_put(b + n, r);
+}
+
+static int _packit_send_binary(struct packit *p,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
+	struct packit_record *r;
+	uint8_t sbuf[512];
+	uint8_t *buf = sbuf;
+	size_t hlen = 0;
+	size_t len;
+	int ret = -1;
+
+	forall_packit_headers(p, r) {
+		hlen += _packit_rec_bin_len(r);
+	}
+	if(hlen > PACKITS_MAX_HBLOCK)
+		return -1;
+
+	/* the whole header goes out in one piece */
+	len = 1 + packit_varint_len(hlen) + hlen;
+	if(len > sizeof(sbuf) && (buf = (uint8_t *)malloc(len)) == NULL)
+		return -1;
+	len = 0;
+	buf[len++] = PACKITS_BIN_START;
+	len += packit_varint_put(buf + len, hlen);
+	forall_packit_headers(p, r) {
+		len += _packit_rec_bin_put(buf + len, r);
+	}
+
+	if((*txf)(buf, len, arg) > 0)
+		ret = 0;
+
+	if(buf != sbuf)
+		free(buf);
+	return ret;
+}
+
+static int _packit_send_data(struct packit *p,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
 	/* send the data */
 	if(p->clen) {
 		if((*txf)(p->data, p->clen, arg) <= 0) {
@@ -175,3 +391,1211 @@ int packit_send(struct packit *p,
 
 	return 0;
 }
+
+/* HEADER COMPRESSION */
+/* unique keys have a new value nearly every packit. they're sent with the
+ * key indexed, but never added, so they don't churn the table
+ */
+static const struct {
+	const char *key;
+	uint32_t hash;
+	int unique;
+} _packit_static_keys[] = {
+	{ CLENGTH_KEY,		CLENGTH_HASH,		1 },
+	{ CTYPE_KEY,		CTYPE_HASH,		0 },
+	{ SERVER_TYPE_KEY,	SERVER_TYPE_HASH,	0 },
+	{ CONN_COUNT_KEY,	CONN_COUNT_HASH,	0 },
+	{ PACKITS_FMT_KEY,	PACKITS_FMT_HASH,	0 },
+	{ PACKITS_ID_KEY,	PACKITS_ID_HASH,	1 },
+};
+#define PACKITS_STATIC_KEYS \
+	(sizeof(_packit_static_keys) / sizeof(_packit_static_keys[0]))
+
+static unsigned int _packit_static_find(const char *key, uint32_t h)
+{
+	unsigned int i;
+	for(i = 0; i < PACKITS_STATIC_KEYS; i++) {
+		if(_packit_static_keys[i].hash == h &&
+				strcmp(_packit_static_keys[i].key, key) == 0)
+			return i + 1;
+	}
+	return 0;
+}
+
+static inline size_t _hentry_size(size_t keylen, size_t vallen)
+{
+	return keylen + vallen + PACKITS_HENTRY_OVERHEAD;
+}
+
+/* i = 1 is the newest entry */
+static inline struct packit_hentry *_htable_get(struct packit_htable *t,
+		uint64_t i)
+{
+	if(i == 0 || i > t->_count)
+		return NULL;
+	return &t->_ents[(t->_head + t->_cap - (unsigned int)(i - 1)) %
+		t->_cap];
+}
+
+static void _htable_evict(struct packit_htable *t)
+{
+	struct packit_hentry *e = _htable_get(t, t->_count);
+
+	t->_size -= _hentry_size(e->keylen, e->vallen);
+	free(e->key);
+	e->key = NULL;
+	t->_count--;
+}
+
+/* puts r in the table, evicting the oldest entries to make room. rec holds
+ * its key and val, and belongs to the table from here on
+ */
+static void _htable_insert(struct packit_htable *t,
+		const struct packit_record *r, char *rec)
+{
+	size_t sz = _hentry_size(r->_keylen, r->_vallen);
+	struct packit_hentry *e;
+
+	while(t->_size + sz > t->max_size)
+		_htable_evict(t);
+
+	t->_head = (t->_head + 1) % t->_cap;
+	e = &t->_ents[t->_head];
+	e->key = rec;
+	e->val = rec + r->_keylen + 1;
+	memcpy(e->key, r->key, r->_keylen + 1);
+	memcpy(e->val, r->val, r->_vallen + 1);
+	e->type = r->type;
+	e->num = r->num.u;
+	e->hash = r->_hash;
+	e->keylen = r->_keylen;
+	e->vallen = r->_vallen;
+	t->_count++;
+	t->_size += sz;
+}
+
+/* encoder and decoder both call this for every PACKITS_REC_ADD record, so
+ * the two tables stay identical
+ */
+static int _htable_add(struct packit_htable *t, const struct packit_record *r)
+{
+	char *rec;
+
+	if(_hentry_size(r->_keylen, r->_vallen) > t->max_size)
+		return 0;
+	if((rec = (char *)malloc(r->_keylen + 1 + r->_vallen + 1)) == NULL)
+		return -1;
+	_htable_insert(t, r, rec);
+
+	return 0;
+}
+
+/* 0 - no match, 1 - same key, 2 - same key and value */
+static int _hentry_match(const struct packit_hentry *e,
+		const struct packit_record *r)
+{
+	if(e->hash != r->_hash || e->keylen != r->_keylen ||
+			memcmp(e->key, r->key, e->keylen) != 0)
+		return 0;
+	if(e->type == r->type && e->vallen == r->_vallen &&
+			memcmp(e->val, r->val, e->vallen) == 0)
+		return 2;
+	return 1;
+}
+
+/* A header block being encoded sees the table as it will be once the block
+ * is decoded, but only touches it once the block is sent. Until then the
+ * block's adds are kept here, newest last, along with how much of the table
+ * they would leave.
+ */
+struct _hview_add {
+	const struct packit_record *r;
+	char *rec;
+};
+
+struct _htable_view {
+	struct packit_htable *t;
+	struct _hview_add *adds;
+	unsigned int nadd;
+	unsigned int first;	/* oldest of the adds not evicted */
+	unsigned int old;	/* table entries not evicted */
+	size_t size;
+};
+
+static void _hview_init(struct _htable_view *v, struct packit_htable *t,
+		struct _hview_add *adds)
+{
+	v->t = t;
+	v->adds = adds;
+	v->nadd = 0;
+	v->first = 0;
+	v->old = t->_count;
+	v->size = t->_size;
+}
+
+/* returns the index of an entry equal to r, or 0. *kidx is set to the index
+ * of the newest entry with the same key, or 0.
+ */
+static unsigned int _hview_find(struct _htable_view *v,
+		const struct packit_record *r, unsigned int *kidx)
+{
+	struct packit_hentry e;
+	unsigned int i, idx = 0;
+	int m;
+
+	*kidx = 0;
+	for(i = v->nadd; i > v->first; i--) {
+		idx++;
+		/* the copy is made with the add, compare against the record */
+		e.key = (char *)v->adds[i - 1].r->key;
+		e.val = v->adds[i - 1].r->val;
+		e.type = v->adds[i - 1].r->type;
+		e.hash = v->adds[i - 1].r->_hash;
+		e.keylen = v->adds[i - 1].r->_keylen;
+		e.vallen = v->adds[i - 1].r->_vallen;
+		if((m = _hentry_match(&e, r)) == 0)
+			continue;
+		if(*kidx == 0)
+			*kidx = idx;
+		if(m == 2)
+			return idx;
+	}
+	for(i = 1; i <= v->old; i++) {
+		idx++;
+		if((m = _hentry_match(_htable_get(v->t, i), r)) == 0)
+			continue;
+		if(*kidx == 0)
+			*kidx = idx;
+		if(m == 2)
+			return idx;
+	}
+	return 0;
+}
+
+/* _htable_add, as far as the view goes. the copy is made now so that
+ * committing can't fail
+ */
+static int _hview_add(struct _htable_view *v, const struct packit_record *r)
+{
+	size_t sz = _hentry_size(r->_keylen, r->_vallen);
+	struct _hview_add *a;
+	char *rec;
+
+	if(sz > v->t->max_size)
+		return 0;
+	if((rec = (char *)malloc(r->_keylen + 1 + r->_vallen + 1)) == NULL)
+		return -1;
+	while(v->size + sz > v->t->max_size) {
+		if(v->old) {
+			v->size -= _hentry_size(
+					_htable_get(v->t, v->old)->keylen,
+					_htable_get(v->t, v->old)->vallen);
+			v->old--;
+		} else {
+			a = &v->adds[v->first++];
+			v->size -= _hentry_size(a->r->_keylen, a->r->_vallen);
+		}
+	}
+	v->adds[v->nadd].r = r;
+	v->adds[v->nadd].rec = rec;
+	v->nadd++;
+	v->size += sz;
+
+	return 0;
+}
+
+/* the block went out, the table catches up the same way the peer's does */
+static void _hview_commit(struct _htable_view *v)
+{
+	unsigned int i;
+
+	for(i = 0; i < v->nadd; i++)
+		_htable_insert(v->t, v->adds[i].r, v->adds[i].rec);
+	v->nadd = 0;
+}
+
+static void _hview_abort(struct _htable_view *v)
+{
+	unsigned int i;
+
+	for(i = 0; i < v->nadd; i++)
+		free(v->adds[i].rec);
+	v->nadd = 0;
+}
+
+static int _packit_rec_hpack_put(uint8_t *b, struct _htable_view *v,
+		const struct packit_record *r, size_t *len)
+{
+	unsigned int idx, kidx;
+	size_t n = 0;
+	int type = r->type;
+	int unique = 0;
+
+	if((idx = _hview_find(v, r, &kidx)) != 0) {
+		b[n++] = PACKITS_REC_INDEXED;
+		n += packit_varint_put(b + n, PACKITS_STATIC_KEYS + idx);
+		*len = n;
+		return 0;
+	}
+
+	if((idx = _packit_static_find(r->key, r->_hash)) != 0) {
+		kidx = idx;
+		unique = _packit_static_keys[idx - 1].unique;
+	} else if(kidx) {
+		kidx += PACKITS_STATIC_KEYS;
+	}
+	if(kidx)
+		type |= PACKITS_REC_KEY_INDEXED;
+	if(!unique && _hentry_size(r->_keylen, r->_vallen) <= v->t->max_size)
+		type |= PACKITS_REC_ADD;
+
+	if(kidx) {
+		b[n++] = (uint8_t)type;
+		n += packit_varint_put(b + n, kidx);
+		n += _packit_val_bin_put(b + n, r);
+	} else {
+		n += _packit_rec_bin_put(b, r);
+		b[0] = (uint8_t)type;
+	}
+	*len = n;
+
+	if(type & PACKITS_REC_ADD)
+		return _hview_add(v, r);
+	return 0;
+}
+
+int packit_htable_init(struct packit_htable *t, size_t max_size)
+{
+	memset(t, 0, sizeof(struct packit_htable));
+	t->max_size = max_size;
+	/* entries are always bigger than the overhead, so the ring can't fill
+	 * up before max_size is reached
+	 */
+	t->_cap = max_size / PACKITS_HENTRY_OVERHEAD + 1;
+	t->_ents = (struct packit_hentry *)calloc(t->_cap,
+			sizeof(struct packit_hentry));
+	if(t->_ents == NULL)
+		return -1;
+
+	return 0;
+}
+
+void packit_htable_free(struct packit_htable *t)
+{
+	if(t->_ents == NULL)
+		return;
+	while(t->_count)
+		_htable_evict(t);
+	free(t->_ents);
+	t->_ents = NULL;
+}
+
+static int _packit_send_hpack(struct packit *p, struct packit_htable *t,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
+	struct packit_record *r;
+	struct _hview_add sadds[16];
+	struct _htable_view v;
+	uint8_t sbuf[512];
+	uint8_t *buf = sbuf;
+	size_t hlen = 0;
+	size_t n, vl;
+	unsigned int nrec = 0;
+	int ret = -1;
+
+	/* worst case is every record literal plus an index */
+	forall_packit_headers(p, r) {
+		hlen += _packit_rec_bin_len(r) + PACKITS_VARINT_MAX;
+		nrec++;
+	}
+	if(hlen + 4 > sizeof(sbuf) &&
+			(buf = (uint8_t *)malloc(hlen + 4)) == NULL)
+		return -1;
+	if(nrec > sizeof(sadds) / sizeof(sadds[0])) {
+		_hview_init(&v, t, (struct _hview_add *)malloc(nrec *
+				sizeof(struct _hview_add)));
+		if(v.adds == NULL)
+			goto out;
+	} else {
+		_hview_init(&v, t, sadds);
+	}
+
+	/* encode behind room for the start byte and block length. the table
+	 * only changes once the block is out
+	 */
+	hlen = 0;
+	forall_packit_headers(p, r) {
+		if(_packit_rec_hpack_put(buf + 4 + hlen, &v, r, &n) < 0)
+			goto out;
+		hlen += n;
+	}
+	if(hlen > PACKITS_MAX_HBLOCK)
+		goto out;
+	vl = packit_varint_len(hlen);
+	buf[3 - vl] = PACKITS_BIN_START;
+	packit_varint_put(buf + 4 - vl, hlen);
+
+	if((*txf)(buf + 3 - vl, 1 + vl + hlen, arg) > 0) {
+		_hview_commit(&v);
+		ret = 0;
+	}
+
+out:
+	if(v.adds) {
+		_hview_abort(&v);
+		if(v.adds != sadds)
+			free(v.adds);
+	}
+	if(buf != sbuf)
+		free(buf);
+	return ret;
+}
+
+
+/* SENDING */
+/* sends everything up to the body */
+static int _packit_send_head(struct packit *p, int fmt,
+		struct packit_htable *t,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
+	__packit_add_uint_header(p, CLENGTH_KEY, CLENGTH_HASH, p->clen);
+
+	if(fmt == PACKITS_FMT_TEXT)
+		return _packit_send_text(p, txf, arg);
+	if(fmt == PACKITS_FMT_HPACK && t)
+		return _packit_send_hpack(p, t, txf, arg);
+	return _packit_send_binary(p, txf, arg);
+}
+
+static int _packit_send_stream(struct packit *p, int fmt,
+		struct packit_htable *t,
+		ssize_t (*body_f)(void *buf, size_t len, void *arg),
+		void *body_arg,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
+	size_t left = p->clen;
+	size_t n;
+	ssize_t l;
+	char *chunk;
+	int ret = -1;
+
+	if(_packit_send_head(p, fmt, t, txf, arg) < 0)
+		return -1;
+	if(left == 0)
+		return 0;
+
+	n = left < PACKITS_STREAM_CHUNK ? left : PACKITS_STREAM_CHUNK;
+	if((chunk = (char *)malloc(n)) == NULL)
+		return -1;
+	while(left) {
+		if(n > left)
+			n = left;
+		/* the body can't end before clen bytes */
+		if((l = (*body_f)(chunk, n, body_arg)) <= 0)
+			goto out;
+		if((*txf)(chunk, (size_t)l, arg) <= 0)
+			goto out;
+		left -= (size_t)l;
+	}
+	ret = 0;
+
+out:
+	free(chunk);
+	return ret;
+}
+
+int packit_send_fmt(struct packit *p, int fmt,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
+	if(_packit_send_head(p, fmt, NULL, txf, arg) < 0)
+		return -1;
+	return _packit_send_data(p, txf, arg);
+}
+
+int packit_send(struct packit *p,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
+	return packit_send_fmt(p, PACKITS_FMT_TEXT, txf, arg);
+}
+
+int packit_send_hpack(struct packit *p, struct packit_htable *t,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
+	if(_packit_send_head(p, PACKITS_FMT_HPACK, t, txf, arg) < 0)
+		return -1;
+	return _packit_send_data(p, txf, arg);
+}
+
+int packit_send_stream(struct packit *p, int fmt,
+		ssize_t (*body_f)(void *buf, size_t len, void *arg),
+		void *body_arg,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg)
+{
+	return _packit_send_stream(p, fmt, NULL, body_f, body_arg, txf, arg);
+}
+
+
+/* PARSER */
+enum {
+	PP_START = 0,
+	PP_TEXT_START,
+	PP_TEXT_LINE,
+	PP_BIN_HLEN,
+	PP_BIN_HDR,
+	PP_BODY,
+	PP_ERROR,
+};
+
+/* longest text header line, without the record separator */
+#define PP_LINE_MAX	(PACKITS_MAX_KEY + 1 + PACKITS_MAX_HVAL)
+#define PP_BUF_SZ	(PP_LINE_MAX > PACKITS_MAX_HBLOCK ? \
+				PP_LINE_MAX + 1 : PACKITS_MAX_HBLOCK + 1)
+
+static void _pp_drop(struct packit_parser *pp)
+{
+	if(pp->_p) {
+		free(pp->_p->data);
+		packit_free(pp->_p);
+		pp->_p = NULL;
+	}
+}
+
+static void _pp_emit(struct packit_parser *pp)
+{
+	struct packit *p = pp->_p;
+
+	pp->_p = NULL;
+	pp->_state = PP_START;
+	if(pp->packit_h) {
+		(pp->packit_h)(p, pp->arg);
+	} else {
+		free(p->data);
+		packit_free(p);
+	}
+}
+
+static int _pp_header_end(struct packit_parser *pp)
+{
+	struct packit *p = pp->_p;
+	struct packit_record *r;
+
+	if((r = packit_get_header_hash(p, CLENGTH_KEY, CLENGTH_HASH)) != NULL) {
+		if(r->type == PACKITS_REC_UINT) {
+			p->clen = r->num.u;
+		} else {
+			unsigned long l;
+			char *e;
+			if(r->val[0] < '0' || r->val[0] > '9')
+				return -1;
+			l = strtoul(r->val, &e, 10);
+			if(*e != '\0' || l > UINT_MAX)
+				return -1;
+			p->clen = (unsigned int)l;
+		}
+	}
+
+	if(p->clen == 0) {
+		_pp_emit(pp);
+		return 0;
+	}
+	/* big bodies go to body_h as they arrive */
+	pp->_stream = pp->body_h && p->clen > pp->stream_min;
+	if(!pp->_stream && (__packit_charge(p, p->clen) < 0 ||
+			(p->data = (char *)malloc(p->clen)) == NULL))
+		return -1;
+	pp->_have = 0;
+	pp->_state = PP_BODY;
+
+	return 0;
+}
+
+static int _pp_text_line(struct packit_parser *pp)
+{
+	char *sep;
+
+	if(pp->_have == 0)
+		return _pp_header_end(pp);
+
+	pp->_buf[pp->_have] = '\0';
+	sep = (char *)memchr(pp->_buf, PACKITS_KV, pp->_have);
+	if(sep == NULL || sep == pp->_buf)
+		return -1;
+	*sep = '\0';
+	if(__packit_add_header(pp->_p, pp->_buf, (size_t)(sep - pp->_buf),
+			packit_hash(pp->_buf), sep + 1,
+			pp->_have - (size_t)(sep - pp->_buf) - 1) == NULL)
+		return -1;
+	pp->_have = 0;
+
+	return 0;
+}
+
+static int _pp_bin_block(struct packit_parser *pp)
+{
+	const uint8_t *pos = (const uint8_t *)pp->_buf;
+	const uint8_t *end = pos + pp->_need;
+	struct packit_htable *t = pp->_htbl;
+	struct packit_hentry *e;
+	char keybuf[PACKITS_MAX_KEY + 1];
+	char val[PACKITS_MAX_HVAL + 1];
+	const char *key;
+	struct packit_record *r;
+	uint32_t h;
+	uint64_t l, v;
+	int type;
+
+	while(pos < end) {
+		type = *pos++;
+		if(type == PACKITS_REC_INDEXED) {
+			/* whole record from the dynamic table */
+			if(t == NULL || packit_varint_get(&pos, end, &v) < 0 ||
+					v <= PACKITS_STATIC_KEYS ||
+					(e = _htable_get(t,
+					v - PACKITS_STATIC_KEYS)) == NULL)
+				return -1;
+			r = __packit_add_header(pp->_p, e->key, e->keylen,
+					e->hash, e->val, e->vallen);
+			if(r == NULL)
+				return -1;
+			r->type = e->type;
+			r->num.u = e->num;
+			continue;
+		}
+		if(type & ~(PACKITS_REC_TYPE_MASK | PACKITS_REC_KEY_INDEXED |
+				PACKITS_REC_ADD))
+			return -1;
+		if(t == NULL && type & ~PACKITS_REC_TYPE_MASK)
+			return -1;
+
+		if(packit_varint_get(&pos, end, &l) < 0)
+			return -1;
+		if(type & PACKITS_REC_KEY_INDEXED) {
+			if(l == 0) {
+				return -1;
+			} else if(l <= PACKITS_STATIC_KEYS) {
+				key = _packit_static_keys[l - 1].key;
+				h = _packit_static_keys[l - 1].hash;
+				l = strlen(key);
+			} else if((e = _htable_get(t, l - PACKITS_STATIC_KEYS))
+					!= NULL) {
+				key = e->key;
+				h = e->hash;
+				l = e->keylen;
+			} else {
+				return -1;
+			}
+		} else {
+			if(l == 0 || l > PACKITS_MAX_KEY ||
+					l > (size_t)(end - pos) ||
+					memchr(pos, '\0', l))
+				return -1;
+			memcpy(keybuf, pos, l);
+			keybuf[l] = '\0';
+			pos += l;
+			key = keybuf;
+			h = packit_hash(keybuf);
+		}
+
+		if(packit_varint_get(&pos, end, &v) < 0)
+			return -1;
+		switch(type & PACKITS_REC_TYPE_MASK) {
+		case PACKITS_REC_STR:
+			if(v > PACKITS_MAX_HVAL || v > (size_t)(end - pos) ||
+					memchr(pos, '\0', v))
+				return -1;
+			memcpy(val, pos, v);
+			val[v] = '\0';
+			pos += v;
+			r = __packit_add_header(pp->_p, key, l, h, val, v);
+			break;
+		case PACKITS_REC_UINT:
+			if(v > UINT_MAX)
+				return -1;
+			r = __packit_add_uint_header(pp->_p, key, h,
+					(unsigned int)v);
+			break;
+		case PACKITS_REC_INT:
+			if(v > UINT32_MAX)
+				return -1;
+			r = packit_add_int_header(pp->_p, key,
+					_unzigzag((uint32_t)v));
+			break;
+		default:
+			return -1;
+		}
+		if(r == NULL)
+			return -1;
+		if((type & PACKITS_REC_ADD) && _htable_add(t, r) < 0)
+			return -1;
+	}
+
+	return _pp_header_end(pp);
+}
+
+int packit_parser_init(struct packit_parser *pp,
+		void (*packit_h)(struct packit *p, void *arg), void *arg)
+{
+	memset(pp, 0, sizeof(struct packit_parser));
+	if((pp->_buf = (char *)malloc(PP_BUF_SZ)) == NULL)
+		return -1;
+	pp->packit_h = packit_h;
+	pp->arg = arg;
+	pp->_state = PP_START;
+
+	return 0;
+}
+
+void packit_parser_free(struct packit_parser *pp)
+{
+	_pp_drop(pp);
+	free(pp->_buf);
+	pp->_buf = NULL;
+}
+
+int packit_parse(struct packit_parser *pp, const void *buf, size_t len)
+{
+	const uint8_t *b = (const uint8_t *)buf;
+	const uint8_t *end = b + len;
+	const uint8_t *nl;
+	size_t n;
+
+	while(b < end) {
+		switch(pp->_state) {
+		case PP_START:
+			/* first byte tells the format of the packit */
+			if(*b == (uint8_t)PACKITS_HEADER_START[0]) {
+				pp->_state = PP_TEXT_START;
+			} else if(*b == PACKITS_BIN_START) {
+				pp->_state = PP_BIN_HLEN;
+				pp->_varint = 0;
+				pp->_vshift = 0;
+				b++;
+			} else {
+				goto error;
+			}
+			if((pp->_p = packit_new()) == NULL)
+				goto error;
+			pp->_p->_mem = pp->mem;
+			if(__packit_charge(pp->_p, sizeof(struct packit)) < 0)
+				goto error;
+			pp->_have = 0;
+			break;
+		case PP_TEXT_START:
+			if(*b++ != (uint8_t)PACKITS_HEADER_START[pp->_have++])
+				goto error;
+			if(pp->_have == PACKITS_HEADER_START_L) {
+				pp->_have = 0;
+				pp->_state = PP_TEXT_LINE;
+			}
+			break;
+		case PP_TEXT_LINE:
+			nl = (const uint8_t *)memchr(b, PACKITS_RS,
+					(size_t)(end - b));
+			n = (size_t)((nl ? nl : end) - b);
+			if(pp->_have + n > PP_LINE_MAX)
+				goto error;
+			memcpy(pp->_buf + pp->_have, b, n);
+			pp->_have += n;
+			b += n;
+			if(nl) {
+				b++;
+				if(_pp_text_line(pp) < 0)
+					goto error;
+			}
+			break;
+		case PP_BIN_HLEN:
+			pp->_varint |= (uint64_t)(*b & 0x7f) << pp->_vshift;
+			pp->_vshift += 7;
+			if(*b++ & 0x80) {
+				if(pp->_vshift >= 7 * PACKITS_VARINT_MAX)
+					goto error;
+				break;
+			}
+			if(pp->_varint > PACKITS_MAX_HBLOCK)
+				goto error;
+			pp->_need = (size_t)pp->_varint;
+			pp->_have = 0;
+			pp->_state = PP_BIN_HDR;
+			if(pp->_need == 0 && _pp_bin_block(pp) < 0)
+				goto error;
+			break;
+		case PP_BIN_HDR:
+			n = pp->_need - pp->_have;
+			if(n > (size_t)(end - b))
+				n = (size_t)(end - b);
+			memcpy(pp->_buf + pp->_have, b, n);
+			pp->_have += n;
+			b += n;
+			if(pp->_have == pp->_need && _pp_bin_block(pp) < 0)
+				goto error;
+			break;
+		case PP_BODY:
+			n = pp->_p->clen - pp->_have;
+			if(n > (size_t)(end - b))
+				n = (size_t)(end - b);
+			if(!pp->_stream)
+				memcpy(pp->_p->data + pp->_have, b, n);
+			else if((pp->body_h)(pp->_p, b, n, pp->arg) < 0)
+				goto error;
+			pp->_have += n;
+			b += n;
+			if(pp->_have == pp->_p->clen)
+				_pp_emit(pp);
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+
+error:
+	_pp_drop(pp);
+	pp->_state = PP_ERROR;
+	return -1;
+}
+
+
+/* SESSION */
+static const char *_packit_fmt_names[] = {
+	[PACKITS_FMT_TEXT] = PACKITS_FMT_TEXT_NAME,
+	[PACKITS_FMT_BINARY] = PACKITS_FMT_BINARY_NAME,
+	[PACKITS_FMT_HPACK] = PACKITS_FMT_HPACK_NAME,
+};
+#define PACKITS_FMT_COUNT \
+	(sizeof(_packit_fmt_names) / sizeof(_packit_fmt_names[0]))
+
+static int _packit_fmt_lookup(const char *name, size_t len)
+{
+	unsigned int i;
+	for(i = 0; i < PACKITS_FMT_COUNT; i++) {
+		if(strlen(_packit_fmt_names[i]) == len &&
+				strncmp(_packit_fmt_names[i], name, len) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int _packit_session_ctl(struct packit_session *s, const char *key,
+		const char *val)
+{
+	struct packit *p;
+	int ret;
+
+	if((p = packit_new()) == NULL)
+		return -1;
+	ret = packit_add_header(p, key, val) ? packit_send(p, s->txf, s->txarg)
+		: -1;
+	packit_free(p);
+
+	return ret;
+}
+
+/* picks the first offered format this end is willing to use */
+static int _packit_session_pick(struct packit_session *s, const char *offer)
+{
+	const char *e;
+	int fmt;
+
+	while(*offer) {
+		e = strchr(offer, ',');
+		if(e == NULL)
+			e = offer + strlen(offer);
+		fmt = _packit_fmt_lookup(offer, (size_t)(e - offer));
+		if(fmt >= 0 && (s->formats & PACKITS_FMT_MASK(fmt)))
+			return fmt;
+		offer = *e ? e + 1 : e;
+	}
+
+	return PACKITS_FMT_TEXT;
+}
+
+static int _packit_session_body_h(struct packit *p, const void *buf,
+		size_t len, void *arg)
+{
+	struct packit_session *s = (struct packit_session *)arg;
+	return (s->body_h)(p, buf, len, s->arg);
+}
+
+static void _packit_session_packit_h(struct packit *p, void *arg)
+{
+	struct packit_session *s = (struct packit_session *)arg;
+	struct packit_record *r;
+	int fmt;
+
+	if(p->clen == 0 && (r = packit_get_header_hash(p, PACKITS_FMT_OFFER_KEY,
+			PACKITS_FMT_OFFER_HASH))) {
+		/* answer in text, then switch */
+		fmt = _packit_session_pick(s, r->val);
+		if(_packit_session_ctl(s, PACKITS_FMT_KEY,
+				_packit_fmt_names[fmt]) == 0)
+			s->tx_fmt = fmt;
+		packit_free(p);
+		return;
+	}
+	if(p->clen == 0 && s->_offered &&
+			(r = packit_get_header_hash(p, PACKITS_FMT_KEY,
+					PACKITS_FMT_HASH))) {
+		fmt = _packit_fmt_lookup(r->val, strlen(r->val));
+		if(fmt >= 0 && (s->formats & PACKITS_FMT_MASK(fmt)))
+			s->tx_fmt = fmt;
+		s->_offered = 0;
+		packit_free(p);
+		return;
+	}
+
+	if(s->packit_h) {
+		(s->packit_h)(p, s->arg);
+	} else {
+		free(p->data);
+		packit_free(p);
+	}
+}
+
+int packit_session_init(struct packit_session *s, unsigned int formats,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *txarg,
+		void (*packit_h)(struct packit *p, void *arg), void *arg)
+{
+	memset(s, 0, sizeof(struct packit_session));
+	s->formats = formats | PACKITS_FMT_MASK(PACKITS_FMT_TEXT);
+	s->tx_fmt = PACKITS_FMT_TEXT;
+	s->txf = txf;
+	s->txarg = txarg;
+	s->packit_h = packit_h;
+	s->arg = arg;
+
+	if(packit_parser_init(&s->_parser, &_packit_session_packit_h, s) < 0)
+		return -1;
+	if(s->formats & PACKITS_FMT_MASK(PACKITS_FMT_HPACK)) {
+		if(packit_htable_init(&s->_htx, PACKITS_HTABLE_SZ) < 0 ||
+				packit_htable_init(&s->_hrx,
+					PACKITS_HTABLE_SZ) < 0) {
+			packit_session_free(s);
+			return -1;
+		}
+		packit_parser_set_htable(&s->_parser, &s->_hrx);
+	}
+
+	return 0;
+}
+
+void packit_session_free(struct packit_session *s)
+{
+	packit_parser_free(&s->_parser);
+	packit_htable_free(&s->_htx);
+	packit_htable_free(&s->_hrx);
+}
+
+int packit_session_offer(struct packit_session *s)
+{
+	char offer[PACKITS_MAX_HVAL];
+	size_t l = 0;
+	int i;
+
+	/* most compact format first */
+	offer[0] = '\0';
+	for(i = PACKITS_FMT_COUNT - 1; i >= 0; i--) {
+		if(!(s->formats & PACKITS_FMT_MASK(i)))
+			continue;
+		l += snprintf(offer + l, sizeof(offer) - l, "%s%s",
+				l ? "," : "", _packit_fmt_names[i]);
+	}
+
+	s->_offered = 1;
+	return _packit_session_ctl(s, PACKITS_FMT_OFFER_KEY, offer);
+}
+
+int packit_session_input(struct packit_session *s, const void *buf,
+		size_t len)
+{
+	s->_parser.mem = s->mem;
+	return packit_parse(&s->_parser, buf, len);
+}
+
+int packit_session_send(struct packit_session *s, struct packit *p)
+{
+	if(s->tx_fmt == PACKITS_FMT_HPACK)
+		return packit_send_hpack(p, &s->_htx, s->txf, s->txarg);
+	return packit_send_fmt(p, s->tx_fmt, s->txf, s->txarg);
+}
+
+int packit_session_send_stream(struct packit_session *s, struct packit *p,
+		ssize_t (*body_f)(void *buf, size_t len, void *arg),
+		void *body_arg)
+{
+	return _packit_send_stream(p, s->tx_fmt, &s->_htx, body_f, body_arg,
+			s->txf, s->txarg);
+}
+
+void packit_session_set_body_h(struct packit_session *s,
+		int (*body_h)(struct packit *p, const void *buf, size_t len,
+			void *arg),
+		size_t stream_min)
+{
+	s->body_h = body_h;
+	s->_parser.body_h = body_h ? &_packit_session_body_h : NULL;
+	s->_parser.stream_min = stream_min;
+}
+
+
+/* ROUTER */
+enum {
+	PR_START = 0,
+	PR_TEXT,
+	PR_BIN_HLEN,
+	PR_BIN_HDR,
+	PR_BODY,
+	PR_ERROR,
+};
+
+/* a whole header block as received, binary start byte and length included */
+#define PR_BUF_SZ	(1 + PACKITS_VARINT_MAX + PACKITS_MAX_HBLOCK)
+
+/* looks at one header for the body length and the routing key */
+static int _pr_field(struct packit_router *r, const char *key, size_t keylen,
+		const char *val, size_t vallen)
+{
+	char num[21], *e;
+	unsigned long l;
+
+	if(keylen == sizeof(CLENGTH_KEY) - 1 &&
+			memcmp(key, CLENGTH_KEY, keylen) == 0) {
+		if(vallen == 0 || vallen >= sizeof(num) ||
+				val[0] < '0' || val[0] > '9')
+			return -1;
+		memcpy(num, val, vallen);
+		num[vallen] = '\0';
+		l = strtoul(num, &e, 10);
+		if(*e != '\0' || l > UINT_MAX)
+			return -1;
+		r->_clen = (unsigned int)l;
+	}
+	if(keylen == r->_keylen && memcmp(key, r->key, keylen) == 0) {
+		if(vallen > PACKITS_MAX_HVAL)
+			return -1;
+		memcpy(r->_val, val, vallen);
+		r->_val[vallen] = '\0';
+		r->_vallen = (ssize_t)vallen;
+	}
+
+	return 0;
+}
+
+static int _pr_header_end(struct packit_router *r)
+{
+	r->_route = (r->route_h)(r->_vallen < 0 ? NULL : r->_val,
+			r->_vallen < 0 ? 0 : (size_t)r->_vallen, r->arg);
+	if(r->_route && (r->fwd_h)(r->_route, r->_buf, r->_have,
+			r->_clen == 0, r->arg) < 0)
+		return -1;
+	r->_sent = 0;
+	r->_state = r->_clen ? PR_BODY : PR_START;
+
+	return 0;
+}
+
+/* the text line from _mark, record separator included */
+static int _pr_text_line(struct packit_router *r)
+{
+	const char *line = (const char *)r->_buf + r->_mark;
+	size_t len = r->_have - r->_mark - 1;
+	const char *sep;
+
+	if(r->_mark == 0) {
+		return (len == PACKITS_HEADER_START_L - 1 &&
+				memcmp(line, PACKITS_HEADER_START, len) == 0) ?
+			0 : -1;
+	}
+	if(len == 0)
+		return _pr_header_end(r);
+	if(len > PP_LINE_MAX)
+		return -1;
+	sep = (const char *)memchr(line, PACKITS_KV, len);
+	if(sep == NULL || sep == line)
+		return -1;
+
+	return _pr_field(r, line, (size_t)(sep - line), sep + 1,
+			len - (size_t)(sep - line) - 1);
+}
+
+static int _pr_bin_block(struct packit_router *r)
+{
+	const uint8_t *pos = r->_buf + r->_mark;
+	const uint8_t *end = r->_buf + r->_need;
+	const char *key;
+	char num[21];
+	uint64_t l, v;
+	int type, n;
+
+	while(pos < end) {
+		/* anything but plain records needs the sender's table */
+		type = *pos++;
+		if(type & ~PACKITS_REC_TYPE_MASK)
+			return -1;
+		if(packit_varint_get(&pos, end, &l) < 0 || l == 0 ||
+				l > PACKITS_MAX_KEY || l > (size_t)(end - pos))
+			return -1;
+		key = (const char *)pos;
+		pos += l;
+
+		if(packit_varint_get(&pos, end, &v) < 0)
+			return -1;
+		switch(type) {
+		case PACKITS_REC_STR:
+			if(v > PACKITS_MAX_HVAL || v > (size_t)(end - pos))
+				return -1;
+			n = _pr_field(r, key, l, (const char *)pos, v);
+			pos += v;
+			break;
+		case PACKITS_REC_UINT:
+			if(v > UINT_MAX)
+				return -1;
+			n = snprintf(num, sizeof(num), "%u", (unsigned int)v);
+			n = _pr_field(r, key, l, num, (size_t)n);
+			break;
+		case PACKITS_REC_INT:
+			if(v > UINT32_MAX)
+				return -1;
+			n = snprintf(num, sizeof(num), "%d",
+					_unzigzag((uint32_t)v));
+			n = _pr_field(r, key, l, num, (size_t)n);
+			break;
+		default:
+			return -1;
+		}
+		if(n < 0)
+			return -1;
+	}
+
+	return _pr_header_end(r);
+}
+
+int packit_router_init(struct packit_router *r, const char *key,
+		void *(*route_h)(const char *val, size_t len, void *arg),
+		int (*fwd_h)(void *route, const void *buf, size_t len, int end,
+			void *arg),
+		void *arg)
+{
+	memset(r, 0, sizeof(struct packit_router));
+	if((r->_buf = (uint8_t *)malloc(PR_BUF_SZ + PACKITS_MAX_HVAL + 1))
+			== NULL)
+		return -1;
+	r->_val = (char *)r->_buf + PR_BUF_SZ;
+	r->key = key;
+	r->_keylen = strlen(key);
+	r->route_h = route_h;
+	r->fwd_h = fwd_h;
+	r->arg = arg;
+	r->_state = PR_START;
+
+	return 0;
+}
+
+void packit_router_free(struct packit_router *r)
+{
+	free(r->_buf);
+	r->_buf = NULL;
+	r->_val = NULL;
+}
+
+int packit_route(struct packit_router *r, const void *buf, size_t len)
+{
+	const uint8_t *b = (const uint8_t *)buf;
+	const uint8_t *end = b + len;
+	const uint8_t *nl;
+	size_t n;
+
+	while(b < end) {
+		switch(r->_state) {
+		case PR_START:
+			/* first byte tells the format of the packit */
+			r->_have = 0;
+			r->_mark = 0;
+			r->_vallen = -1;
+			r->_clen = 0;
+			if(*b == (uint8_t)PACKITS_HEADER_START[0]) {
+				r->_state = PR_TEXT;
+			} else if(*b == PACKITS_BIN_START) {
+				r->_buf[r->_have++] = *b++;
+				r->_varint = 0;
+				r->_vshift = 0;
+				r->_state = PR_BIN_HLEN;
+			} else {
+				goto error;
+			}
+			break;
+		case PR_TEXT:
+			/* up to and including the end of the line */
+			nl = (const uint8_t *)memchr(b, PACKITS_RS,
+					(size_t)(end - b));
+			n = (size_t)((nl ? nl + 1 : end) - b);
+			if(r->_have + n > PR_BUF_SZ)
+				goto error;
+			memcpy(r->_buf + r->_have, b, n);
+			r->_have += n;
+			b += n;
+			if(nl) {
+				if(_pr_text_line(r) < 0)
+					goto error;
+				r->_mark = r->_have;
+			}
+			break;
+		case PR_BIN_HLEN:
+			r->_varint |= (uint64_t)(*b & 0x7f) << r->_vshift;
+			r->_vshift += 7;
+			r->_buf[r->_have++] = *b;
+			if(*b++ & 0x80) {
+				if(r->_vshift >= 7 * PACKITS_VARINT_MAX)
+					goto error;
+				break;
+			}
+			if(r->_varint > PACKITS_MAX_HBLOCK)
+				goto error;
+			r->_mark = r->_have;
+			r->_need = r->_have + (size_t)r->_varint;
+			r->_state = PR_BIN_HDR;
+			if(r->_need == r->_mark && _pr_bin_block(r) < 0)
+				goto error;
+			break;
+		case PR_BIN_HDR:
+			n = r->_need - r->_have;
+			if(n > (size_t)(end - b))
+				n = (size_t)(end - b);
+			memcpy(r->_buf + r->_have, b, n);
+			r->_have += n;
+			b += n;
+			if(r->_have == r->_need && _pr_bin_block(r) < 0)
+				goto error;
+			break;
+		case PR_BODY:
+			/* straight from the caller's buffer */
+			n = r->_clen - r->_sent;
+			if(n > (size_t)(end - b))
+				n = (size_t)(end - b);
+			r->_sent += (unsigned int)n;
+			if(r->_route && (r->fwd_h)(r->_route, b, n,
+					r->_sent == r->_clen, r->arg) < 0)
+				goto error;
+			b += n;
+			if(r->_sent == r->_clen)
+				r->_state = PR_START;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
+
+error:
+	r->_state = PR_ERROR;
+	return -1;
+}
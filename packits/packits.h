@@ -21,9 +21,11 @@
 
 /****************************************************************************/
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include "ll.h"
+#include <sys/types.h>
+#include "tcpc_mem.h"
 
 #ifndef I__PACKITS_H__
 	#define I__PACKITS_H__
@@ -43,28 +45,116 @@
 /* Max Value Size */
 #define PACKITS_MAX_HVAL	1024
 
+/* Streamed Body Chunk Size */
+#define PACKITS_STREAM_CHUNK	16384
+
 /* Header Length Field */
 #define CLENGTH_KEY		"Content-Length"
+#define CLENGTH_HASH		0x0aa8645dU	/* packit_hash(CLENGTH_KEY) */
+
+/* Wire Formats */
+#define PACKITS_FMT_TEXT	0
+#define PACKITS_FMT_BINARY	1
+#define PACKITS_FMT_HPACK	2	/* binary, compressed headers */
+#define PACKITS_FMT_MASK(fmt)	(1U << (fmt))
+
+/* Binary Packit Start Byte - never the first byte of a text packit. A binary
+ * packit is: start byte, varint header block length, header block, body. The
+ * header block is a sequence of records: type byte, varint key length, key,
+ * then a varint value length and value for PACKITS_REC_STR, a varint for
+ * PACKITS_REC_UINT or a zigzag varint for PACKITS_REC_INT.
+ */
+#define PACKITS_BIN_START	0xB7
+/* Max Binary Header Block Size */
+#define PACKITS_MAX_HBLOCK	16384
+
+/* Header Record Value Types */
+#define PACKITS_REC_STR		0
+#define PACKITS_REC_UINT	1
+#define PACKITS_REC_INT		2
+#define PACKITS_REC_TYPE_MASK	0x03
 
+/* Compressed Binary Record Flags (PACKITS_FMT_HPACK). The lowest table
+ * indexes are the well known keys of the static table, the dynamic table
+ * follows with the most recently added entry first.
+ */
+#define PACKITS_REC_INDEXED	0x10	/* varint index of a whole record */
+#define PACKITS_REC_KEY_INDEXED	0x20	/* varint index instead of the key */
+#define PACKITS_REC_ADD		0x40	/* add record to the dynamic table */
+
+/* Dynamic Table Size - in bytes, counting PACKITS_HENTRY_OVERHEAD plus the
+ * key and value lengths for every entry. Both ends must use the same size.
+ */
+#define PACKITS_HTABLE_SZ	4096
+#define PACKITS_HENTRY_OVERHEAD	32
+
+/* Format Negotiation Headers. The initiator sends a text packit with
+ * PACKITS_FMT_OFFER_KEY listing the formats it can receive, the peer answers
+ * with a text packit carrying PACKITS_FMT_KEY set to the format both ends
+ * switch to. Peers that don't negotiate just see an extra text packit.
+ */
+#define PACKITS_FMT_OFFER_KEY	"Packit-Format-Offer"
+#define PACKITS_FMT_OFFER_HASH	0x989495dcU
+#define PACKITS_FMT_KEY		"Packit-Format"
+#define PACKITS_FMT_HASH	0xaf32f7c3U
+#define PACKITS_FMT_TEXT_NAME	"text"
+#define PACKITS_FMT_BINARY_NAME	"binary"
+#define PACKITS_FMT_HPACK_NAME	"binary+hpack"
 
-/* Packits Header Record */
+/* Well Known Keys */
+#define CTYPE_KEY		"Content-Type"
+#define CTYPE_HASH		0x220dc0d5U
+#define SERVER_TYPE_KEY		"Server-Type"
+#define SERVER_TYPE_HASH	0x61d77425U
+#define CONN_COUNT_KEY		"Connection-Count"
+#define CONN_COUNT_HASH		0x53725a23U
+#define PACKITS_ID_KEY		"Packit-Id"	/* request/response correlation */
+#define PACKITS_ID_HASH		0xb57b8c1dU
+
+
+/* Packits Header Record - key and val share one allocation, key first */
 struct packit_record {
-	hl_node_t hash_list;	/* hash table linked list of records */
-	ll_t full_list;		/* full linked list of records */
 	char *key;
 	char *val;
-	char *_rec;
-	size_t _rec_size;
+	int type;		/* PACKITS_REC_* */
+	union {
+		unsigned int u;
+		int i;
+	} num;			/* native value for the integer types */
+	uint32_t _hash;
+	uint16_t _keylen;
+	uint16_t _vallen;
+	uint32_t _rec_size;
 };
 
-#define PACKITS_HASH_SIZE	32
+/* Headers kept in the packit itself. Packits with more headers move them to
+ * a malloced array indexed by an open addressed hash table.
+ */
+#define PACKITS_INLINE_HDRS	8
+
+/* Open Addressed Hash Table Slot */
+struct packit_slot {
+	uint32_t hash;
+	uint32_t idx;		/* record index + 1, 0 for an empty slot */
+};
 
-/* Packit Structure */
+/* Packit Structure - record pointers are only valid until the next header is
+ * added to the packit.
+ */
 struct packit {
-	hl_head_t hash_head[PACKITS_HASH_SIZE];
-	ll_t full_head;
 	unsigned int clen;
 	char *data;
+
+	/* private members - don't modify directly */
+	unsigned int _nhdrs;
+	unsigned int _hdrs_cap;
+	struct packit_record *_hdrs;	/* in insertion order */
+	struct packit_slot *_tbl;	/* NULL while the headers are inline */
+	unsigned int _tbl_sz;
+	uint32_t _hash[PACKITS_INLINE_HDRS];	/* scanned while inline */
+	struct packit_record _inline[PACKITS_INLINE_HDRS];
+	struct tcpc_mem *_mem;	/* headers and body are charged to it */
+	size_t _charged;
 };
 
 /* Packit Interface Structure */
@@ -72,6 +162,125 @@ struct packit {
 	char pbuf[PACKITS_MAX_KEY + PACKITS_MAX_HVAL + 2];
 };*/
 
+/* Header Compression Table Entry */
+struct packit_hentry {
+	char *key;		/* key and val share one allocation */
+	char *val;
+	int type;
+	unsigned int num;
+	uint32_t hash;
+	uint16_t keylen;
+	uint16_t vallen;
+};
+
+/* Header Compression Table - the dynamic table for one direction of a
+ * connection. Oldest entries are evicted once max_size is reached.
+ */
+struct packit_htable {
+	size_t max_size;
+
+	/* private members - don't modify directly */
+	struct packit_hentry *_ents;	/* ring, _head is the newest */
+	unsigned int _cap;
+	unsigned int _head;
+	unsigned int _count;
+	size_t _size;
+};
+
+/* Packit Parser - incremental decoder for both wire formats. The format is
+ * detected per packit from its first byte. Each complete packit is handed to
+ * packit_h, which owns it (and its malloced data) from then on.
+ *
+ * With body_h set, bodies longer than stream_min bytes are not buffered.
+ * body_h gets them in pieces straight from the parsed buffer as they arrive,
+ * along with the packit's headers, and packit_h then gets the packit with a
+ * NULL data pointer. body_h returning < 0 fails the parse.
+ *
+ * With mem set, each packit's structure, headers and buffered body are
+ * charged to it until packit_free, and a packit that doesn't fit fails the
+ * parse. Streamed bodies aren't charged.
+ */
+struct packit_parser {
+	void (*packit_h)(struct packit *p, void *arg);
+	void *arg;
+	int (*body_h)(struct packit *p, const void *buf, size_t len,
+			void *arg);
+	size_t stream_min;
+	struct tcpc_mem *mem;
+
+	/* private members - don't modify directly */
+	int _state;
+	struct packit *_p;
+	char *_buf;		/* line / header block buffer */
+	size_t _have;		/* bytes in _buf, or body bytes received */
+	size_t _need;		/* header block length */
+	uint64_t _varint;
+	unsigned int _vshift;
+	struct packit_htable *_htbl;	/* for compressed packits */
+	int _stream;			/* body goes to body_h */
+};
+
+/* Packit Session - per connection format negotiation. Keep one alongside
+ * the connection's priv pointer and feed it everything received.
+ */
+struct packit_session {
+	/* formats this end is willing to use */
+	unsigned int formats;
+	/* format used by packit_session_send */
+	int tx_fmt;
+
+	ssize_t (*txf)(const void *buf, size_t len, void *arg);
+	void *txarg;
+	void (*packit_h)(struct packit *p, void *arg);
+	int (*body_h)(struct packit *p, const void *buf, size_t len,
+			void *arg);
+	void *arg;
+	/* received packits are charged to it, see struct packit_parser */
+	struct tcpc_mem *mem;
+
+	/* private members - don't modify directly */
+	int _offered;
+	struct packit_parser _parser;
+	struct packit_htable _htx;	/* mirrors the peer's _hrx */
+	struct packit_htable _hrx;
+};
+
+/* Packit Router - forwards packits as they were received, without building
+ * or re-encoding them. Only the header block is scanned, for Content-Length
+ * and the routing header key. Once a packit's headers are in, route_h picks
+ * where it goes from the key's value (NULL if the packit has none) and
+ * returns a route, or NULL to drop the packit. fwd_h then gets the packit's
+ * original bytes for that route, in order: the header block first, then
+ * the body in pieces straight from the routed buffer as they arrive. end is
+ * set on the last piece. fwd_h returning < 0 fails the routing.
+ *
+ * Compressed packits (PACKITS_FMT_HPACK) refer to their connection's header
+ * table, so they can't be forwarded as they are and fail the routing. So do
+ * header blocks over PACKITS_MAX_HBLOCK bytes.
+ */
+struct packit_router {
+	const char *key;
+	void *(*route_h)(const char *val, size_t len, void *arg);
+	int (*fwd_h)(void *route, const void *buf, size_t len, int end,
+			void *arg);
+	void *arg;
+
+	/* private members - don't modify directly */
+	int _state;
+	size_t _keylen;
+	uint8_t *_buf;		/* header block as received */
+	size_t _have;		/* bytes in _buf */
+	size_t _mark;		/* text line or binary header block start */
+	size_t _need;		/* binary header block end */
+	uint64_t _varint;
+	unsigned int _vshift;
+	char *_val;		/* routing key value */
+	ssize_t _vallen;	/* -1 when the packit has none */
+	unsigned int _clen;
+	unsigned int _sent;	/* body bytes forwarded */
+	void *_route;
+};
+
 
 /* Packits API */
 
@@ -83,30 +292,51 @@ struct packit {
 static inline struct packit *packit_new(void)
 {
 	struct packit *p;
-	unsigned int i;
 	if((p = (struct packit *)malloc(sizeof(struct packit))) == NULL)
 		return NULL;
-	for(i = 0; i < PACKITS_HASH_SIZE; i++) {
-		INIT_HLIST_HEAD(&p->hash_head[i]);
-	}
-	INIT_LIST_HEAD(&p->full_head);
+	p->clen = 0;
+	p->data = NULL;
+	p->_nhdrs = 0;
+	p->_hdrs_cap = PACKITS_INLINE_HDRS;
+	p->_hdrs = p->_inline;
+	p->_tbl = NULL;
+	p->_tbl_sz = 0;
+	p->_mem = NULL;
+	p->_charged = 0;
 	return p;
 }
 
 /* packit_free
- *     NOTE: you must free your own data if necessary BEFORE this call
+ *     NOTE: you must free your own data if necessary BEFORE this call. Memory
+ *     charged for the packit, data included, is given back here.
  */
 static inline void packit_free(struct packit *p)
 {
-	struct packit_record *r,*n;
-	list_for_each_entry_safe(r, n, &p->full_head, full_list) {
-		list_del(&r->full_list);
-		free(r->_rec);
-		free(r);
+	unsigned int i;
+	for(i = 0; i < p->_nhdrs; i++) {
+		free(p->_hdrs[i].key);
 	}
+	if(p->_hdrs != p->_inline)
+		free(p->_hdrs);
+	free(p->_tbl);
+	tcpc_mem_uncharge(p->_mem, p->_charged);
 	free(p);
 }
 
+/* packit_hash
+ *     DESCRIPTION: header key hash (32 bit FNV-1a). Well known keys have
+ *     their hash precomputed as *_HASH defines.
+ */
+static inline uint32_t packit_hash(const char *key)
+{
+	uint32_t h = 2166136261U;
+	while(*key) {
+		h ^= (uint8_t)*key++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
 /* packit_add_header
  *     RETURNS:
  *         pointer to new packit_record on success
@@ -139,6 +369,15 @@ struct packit_record *packit_add_int_header(struct packit *p, const char *key,
 struct packit_record *packit_get_header(const struct packit *p,
 		const char *key);
 
+/* packit_get_header_hash
+ *     DESCRIPTION: packit_get_header with a precomputed packit_hash(key)
+ *     RETURNS:
+ *         pointer to packit_record on success
+ *         NULL on failure
+ */
+struct packit_record *packit_get_header_hash(const struct packit *p,
+		const char *key, uint32_t hash);
+
 /* packit_get_key
  *     RETURNS:
  *         0 on success
@@ -152,10 +391,225 @@ int packit_send(struct packit *p,
 		ssize_t (*txf)(const void *buf, size_t len, void *arg),
 		void *arg);
 
+/* packit_send_fmt
+ *     DESCRIPTION: same as packit_send, using wire format fmt.
+ *     PACKITS_FMT_HPACK needs a table, see packit_send_hpack.
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_send_fmt(struct packit *p, int fmt,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg);
+
+/* packit_send_stream
+ *     DESCRIPTION: same as packit_send_fmt, except the body isn't taken from
+ *     p->data. body_f is called to fill buf with up to len bytes of it until
+ *     p->clen bytes have been sent, and returns how many it filled.
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure, including body_f returning <= 0
+ */
+int packit_send_stream(struct packit *p, int fmt,
+		ssize_t (*body_f)(void *buf, size_t len, void *arg),
+		void *body_arg,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg);
+
+/* packit_send_hpack
+ *     DESCRIPTION: same as packit_send, using PACKITS_FMT_HPACK with the
+ *     dynamic table t. t must see every packit sent on the connection.
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_send_hpack(struct packit *p, struct packit_htable *t,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg);
+
+/* packit_htable_init
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_htable_init(struct packit_htable *t, size_t max_size);
+
+/* packit_htable_free
+ */
+void packit_htable_free(struct packit_htable *t);
+
+/* packit_parser_init
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_parser_init(struct packit_parser *pp,
+		void (*packit_h)(struct packit *p, void *arg), void *arg);
+
+/* packit_parser_free
+ *     NOTE: a partially received packit is dropped
+ */
+void packit_parser_free(struct packit_parser *pp);
+
+/* packit_parse
+ *     DESCRIPTION: feeds len received bytes to the parser. packit_h is
+ *     called for every packit completed by these bytes.
+ *     RETURNS:
+ *         0 on success
+ *         -1 on a malformed stream. the parser must be freed.
+ */
+int packit_parse(struct packit_parser *pp, const void *buf, size_t len);
+
+/* packit_parser_set_htable
+ *     DESCRIPTION: sets the dynamic table used to decode compressed
+ *     packits. Without one they are treated as malformed.
+ */
+static inline void packit_parser_set_htable(struct packit_parser *pp,
+		struct packit_htable *t)
+{
+	pp->_htbl = t;
+}
+
+/* packit_session_init
+ *     DESCRIPTION: sessions start out sending text. formats is a mask of
+ *     PACKITS_FMT_MASK() values this end accepts switching to.
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_session_init(struct packit_session *s, unsigned int formats,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *txarg,
+		void (*packit_h)(struct packit *p, void *arg), void *arg);
+
+/* packit_session_free
+ */
+void packit_session_free(struct packit_session *s);
+
+/* packit_session_offer
+ *     DESCRIPTION: starts format negotiation. Only the connecting side
+ *     should call this.
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_session_offer(struct packit_session *s);
+
+/* packit_session_input
+ *     DESCRIPTION: feeds received bytes to the session. Negotiation packits
+ *     are handled internally, everything else goes to packit_h.
+ *     RETURNS:
+ *         0 on success
+ *         -1 on a malformed stream
+ */
+int packit_session_input(struct packit_session *s, const void *buf,
+		size_t len);
+
+/* packit_session_send
+ *     DESCRIPTION: packit_send using the negotiated format
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_session_send(struct packit_session *s, struct packit *p);
+
+/* packit_session_send_stream
+ *     DESCRIPTION: packit_send_stream using the negotiated format
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_session_send_stream(struct packit_session *s, struct packit *p,
+		ssize_t (*body_f)(void *buf, size_t len, void *arg),
+		void *body_arg);
+
+/* packit_session_set_body_h
+ *     DESCRIPTION: streams received bodies longer than stream_min bytes to
+ *     body_h, see struct packit_parser. NULL buffers every body again.
+ */
+void packit_session_set_body_h(struct packit_session *s,
+		int (*body_h)(struct packit *p, const void *buf, size_t len,
+			void *arg),
+		size_t stream_min);
+
+/* packit_router_init
+ *     DESCRIPTION: routes packits on the value of the header key, which
+ *     must stay valid while the router is used
+ *     RETURNS:
+ *         0 on success
+ *         -1 on failure
+ */
+int packit_router_init(struct packit_router *r, const char *key,
+		void *(*route_h)(const char *val, size_t len, void *arg),
+		int (*fwd_h)(void *route, const void *buf, size_t len, int end,
+			void *arg),
+		void *arg);
+
+/* packit_router_free
+ *     NOTE: the rest of a partially forwarded packit is never sent
+ */
+void packit_router_free(struct packit_router *r);
+
+/* packit_route
+ *     DESCRIPTION: feeds len received bytes to the router. route_h and
+ *     fwd_h are called as the packits in them come in.
+ *     RETURNS:
+ *         0 on success
+ *         -1 on a malformed stream, a compressed packit or a failed
+ *         fwd_h. the router must be freed.
+ */
+int packit_route(struct packit_router *r, const void *buf, size_t len);
+
+/* varint helpers - LEB128, 7 bits per byte, least significant first */
+#define PACKITS_VARINT_MAX	10
+
+static inline size_t packit_varint_len(uint64_t v)
+{
+	size_t n = 1;
+	while(v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static inline size_t packit_varint_put(uint8_t *b, uint64_t v)
+{
+	size_t n = 0;
+	while(v >= 0x80) {
+		b[n++] = (uint8_t)(v | 0x80);
+		v >>= 7;
+	}
+	b[n++] = (uint8_t)v;
+	return n;
+}
+
+/* packit_varint_get
+ *     RETURNS:
+ *         0 on success, *pos is advanced past the varint
+ *         -1 if the varint is truncated or too long
+ */
+static inline int packit_varint_get(const uint8_t **pos, const uint8_t *end,
+		uint64_t *v)
+{
+	const uint8_t *b = *pos;
+	unsigned int shift = 0;
+	*v = 0;
+	while(b < end && shift < 7 * PACKITS_VARINT_MAX) {
+		*v |= (uint64_t)(*b & 0x7f) << shift;
+		if(!(*b++ & 0x80)) {
+			*pos = b;
+			return 0;
+		}
+		shift += 7;
+	}
+	return -1;
+}
+
 /* forall_packit_headers
  */
 #define forall_packit_headers(packitp, recordp) \
-	list_for_each_entry(recordp, &(packitp)->full_head, \
-			full_list)
+	for(recordp = (packitp)->_hdrs; \
+		recordp < (packitp)->_hdrs + (packitp)->_nhdrs; recordp++)
 
 #endif /* I__PACKITS_H__ */
@@ -0,0 +1,817 @@
+#include "tcpc.h"
+#include "tcpc_shm.h"
+#include "packits/packits.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Runs the server and its clients in one process over loopback, one test
+ * per feature, and prints what each one saw. Exits with the number of
+ * failed tests.
+ *
+ * 	./feature_test [base port] [unix socket path]
+ */
+
+#define DEFAULT_PORT	7300
+#define DEFAULT_PATH	"/tmp/tcpc_feature_test.sock"
+#define WAIT_MS		5000
+#define REJECT_MSG	"BUSY"
+
+/* a test's server side. tests run one at a time */
+static volatile int conns;
+static volatile int closed;
+static volatile size_t got;
+static volatile size_t max_held;
+static volatile long bad;
+static struct tcpc_server_conn *volatile last_conn;
+static int upstream_port;
+
+/* helpers */
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* waits up to WAIT_MS for *v to reach n */
+static int wait_for(volatile int *v, int n)
+{
+	double t0 = now_ms();
+
+	while(*v < n) {
+		if(now_ms() - t0 > WAIT_MS)
+			return -1;
+		usleep(1000);
+	}
+	return 0;
+}
+
+static int check(const char *name, int ok, const char *detail)
+{
+	printf("%-12s %-6s %s\n", name, ok ? "ok" : "FAILED", detail);
+	return ok ? 0 : 1;
+}
+
+static uint8_t pattern(size_t off)
+{
+	return (uint8_t)(off * 7 + (off >> 8));
+}
+
+static void loopback(struct sockaddr *sa, int port)
+{
+	struct sockaddr_in *a = (struct sockaddr_in *)sa;
+
+	memset(a, 0, sizeof(struct sockaddr_in));
+	a->sin_family = AF_INET;
+	a->sin_port = htons(port);
+	a->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+}
+
+static void reset(void)
+{
+	conns = 0;
+	closed = 0;
+	got = 0;
+	max_held = 0;
+	bad = 0;
+	last_conn = NULL;
+}
+
+static int server_init(struct tcpc_server *s, int port,
+		void (*new_conn)(struct tcpc_server_conn *))
+{
+	reset();
+	if(tcpc_init_server(s, sizeof(struct sockaddr_in), new_conn) < 0)
+		return -1;
+	loopback(s->serv_addr, port);
+	return 0;
+}
+
+static int server_start(struct tcpc_server *s)
+{
+	int one = 1;
+
+	if(tcpc_open_server(s) < 0)
+		return -1;
+	setsockopt(tcpc_server_socket(s), SOL_SOCKET, SO_REUSEADDR,
+			&one, sizeof(one));
+	return tcpc_start_server(s);
+}
+
+static void server_stop(struct tcpc_server *s)
+{
+	tcpc_close_server(s);
+	free_tcpc_server_members(s);
+}
+
+static int raw_connect(int port)
+{
+	struct sockaddr_in a;
+	struct timeval tv = { 2, 0 };
+	int fd;
+
+	loopback((struct sockaddr *)&a, port);
+	if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if(connect(fd, (struct sockaddr *)&a, sizeof(a)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* sends len bytes of the pattern to fd, then shuts it down for writing */
+struct raw_sender {
+	int fd;
+	size_t len;
+};
+
+static void *raw_send_routine(void *arg)
+{
+	struct raw_sender *rs = (struct raw_sender *)arg;
+	uint8_t buf[16384];
+	size_t off, n, i;
+	ssize_t w;
+
+	for(off = 0; off < rs->len; off += (size_t)w) {
+		n = rs->len - off < sizeof(buf) ? rs->len - off : sizeof(buf);
+		for(i = 0; i < n; i++)
+			buf[i] = pattern(off + i);
+		if((w = send(rs->fd, buf, n, MSG_NOSIGNAL)) <= 0)
+			break;
+	}
+	shutdown(rs->fd, SHUT_WR);
+	return NULL;
+}
+
+/* server callbacks shared by the tests */
+PT_THREAD(idle_h(struct tcpc_server_conn *c, size_t len))
+{
+	return PT_YIELDED;
+}
+
+/* echoes everything back, blocking */
+PT_THREAD(echo_h(struct tcpc_server_conn *c, size_t len))
+{
+	size_t off = 0;
+	ssize_t w;
+
+	while(off < len) {
+		if((w = tcpc_server_send_to(c, c->rxbuf + off, len - off, 0))
+				<= 0)
+			return PT_ENDED;
+		off += (size_t)w;
+	}
+	return PT_YIELDED;
+}
+
+void count_close(struct tcpc_server_conn *c)
+{
+	__atomic_add_fetch(&closed, 1, __ATOMIC_SEQ_CST);
+}
+
+void count_conn(struct tcpc_server_conn *c)
+{
+	c->conn_h = &idle_h;
+	c->conn_close_h = &count_close;
+	__atomic_add_fetch(&conns, 1, __ATOMIC_SEQ_CST);
+}
+
+void echo_conn(struct tcpc_server_conn *c)
+{
+	c->conn_h = &echo_h;
+	c->conn_close_h = &count_close;
+	__atomic_add_fetch(&conns, 1, __ATOMIC_SEQ_CST);
+}
+
+/* ADMISSION: at max_connections, overload_reject sends REJECT_MSG and
+ * resets the connection
+ */
+static int test_reject(int port)
+{
+	struct tcpc_server s;
+	char buf[16], detail[128];
+	int fd[3], i, ok;
+	ssize_t r, r2;
+
+	if(server_init(&s, port, &count_conn) < 0)
+		return check("reject", 0, "init");
+	s.max_connections = 2;
+	s.overload_reject = 1;
+	s.reject_msg = REJECT_MSG;
+	s.reject_len = strlen(REJECT_MSG);
+	if(server_start(&s) < 0)
+		return check("reject", 0, "start");
+
+	fd[0] = raw_connect(port);
+	fd[1] = raw_connect(port);
+	wait_for(&conns, 2);
+	fd[2] = raw_connect(port);
+	r = recv(fd[2], buf, sizeof(buf), 0);
+	r2 = recv(fd[2], buf + (r > 0 ? r : 0), 1, 0);
+	/* counted once the reset is out */
+	for(i = 0; i < WAIT_MS && tcpc_server_rejected(&s) == 0; i++)
+		usleep(1000);
+	ok = conns == 2 && r == (ssize_t)strlen(REJECT_MSG) &&
+		memcmp(buf, REJECT_MSG, r) == 0 && r2 <= 0 &&
+		tcpc_server_rejected(&s) == 1;
+	snprintf(detail, sizeof(detail),
+			"%d admitted, third got %zd bytes then %zd, "
+			"%lu rejected",
+			conns, r, r2, tcpc_server_rejected(&s));
+
+	for(i = 0; i < 3; i++)
+		close(fd[i]);
+	server_stop(&s);
+	return check("reject", ok, detail);
+}
+
+/* ADMISSION: accept_rate spreads out a burst of connects */
+#define RATE_CONNS	30
+#define RATE		50
+#define RATE_BURST	5
+
+static int test_rate_limit(int port)
+{
+	struct tcpc_server s;
+	char detail[128];
+	double t0, ms, min_ms;
+	int fd[RATE_CONNS], i, ok;
+
+	if(server_init(&s, port, &count_conn) < 0)
+		return check("rate limit", 0, "init");
+	s.max_connections = 2 * RATE_CONNS;
+	s.listen_backlog = 2 * RATE_CONNS;
+	s.accept_rate = RATE;
+	s.accept_burst = RATE_BURST;
+	if(server_start(&s) < 0)
+		return check("rate limit", 0, "start");
+
+	t0 = now_ms();
+	for(i = 0; i < RATE_CONNS; i++)
+		fd[i] = raw_connect(port);
+	wait_for(&conns, RATE_CONNS);
+	ms = now_ms() - t0;
+	/* the burst goes at once, the rest at RATE a second */
+	min_ms = (RATE_CONNS - RATE_BURST) * 1000.0 / RATE;
+	ok = conns == RATE_CONNS && ms >= 0.8 * min_ms;
+	snprintf(detail, sizeof(detail),
+			"%d connects at %d/s, burst %d: %.0f ms "
+			"(%.0f expected)",
+			conns, RATE, RATE_BURST, ms, min_ms);
+
+	for(i = 0; i < RATE_CONNS; i++)
+		close(fd[i]);
+	server_stop(&s);
+	return check("rate limit", ok, detail);
+}
+
+/* RX WATERMARKS: a fast sender and a slow consumer. reading stops at
+ * rx_high held bytes until the consumer is back down to rx_low
+ */
+#define WM_LEN		(4 << 20)
+#define WM_HIGH		65536
+#define WM_LOW		16384
+
+PT_THREAD(held_h(struct tcpc_server_conn *c, size_t len))
+{
+	size_t held, i;
+
+	if(len) {
+		/* check the bytes, then leave them held */
+		for(i = 0; i < len; i++) {
+			if(c->rxbuf[i] != pattern(got + i))
+				bad++;
+		}
+		got += len;
+		if((held = tcpc_server_conn_rx_held(c)) > max_held)
+			max_held = held;
+	}
+	return PT_YIELDED;
+}
+
+void held_conn(struct tcpc_server_conn *c)
+{
+	c->conn_h = &held_h;
+	c->conn_close_h = &count_close;
+	c->rx_high = WM_HIGH;
+	c->rx_low = WM_LOW;
+	last_conn = c;
+	__atomic_add_fetch(&conns, 1, __ATOMIC_SEQ_CST);
+}
+
+static int test_watermarks(int port, int io_threads)
+{
+	struct tcpc_server s;
+	struct raw_sender rs;
+	pthread_t t;
+	char detail[160];
+	size_t consumed = 0, n, held;
+	double t0;
+	int ok;
+
+	if(server_init(&s, port, &held_conn) < 0)
+		return check("watermarks", 0, "init");
+	s.io_threads = io_threads;
+	if(server_start(&s) < 0)
+		return check("watermarks", 0, "start");
+
+	rs.fd = raw_connect(port);
+	rs.len = WM_LEN;
+	wait_for(&conns, 1);
+	pthread_create(&t, NULL, &raw_send_routine, &rs);
+
+	/* consume 32k every 2ms. the connection may close, and be freed,
+	 * as soon as the last byte is consumed
+	 */
+	t0 = now_ms();
+	while(consumed < WM_LEN && now_ms() - t0 < WAIT_MS) {
+		usleep(2000);
+		held = tcpc_server_conn_rx_held(last_conn);
+		n = held < 32768 ? held : 32768;
+		if(n) {
+			consumed += n;
+			tcpc_server_conn_rx_consumed(last_conn, n);
+		}
+	}
+	pthread_join(t, NULL);
+	wait_for(&closed, 1);
+
+	/* a read can go past rx_high by up to a buffer */
+	ok = got == WM_LEN && consumed == WM_LEN && !bad &&
+		max_held <= WM_HIGH + TCPC_RXBUF_MAX_BULK && closed == 1;
+	snprintf(detail, sizeof(detail),
+			"io_threads %d: %zu of %d bytes, %ld bad, "
+			"max held %zu (rx_high %d)", io_threads, (size_t)got,
+			WM_LEN, bad, (size_t)max_held, WM_HIGH);
+
+	close(rs.fd);
+	server_stop(&s);
+	return check("watermarks", ok, detail);
+}
+
+/* DATAGRAMS: each datagram is echoed back to its sender as one */
+#define DG_COUNT	2000
+#define DG_WINDOW	64
+
+static volatile int dg_got;
+
+static size_t dg_len(uint32_t seq)
+{
+	return 8 + (seq % 7) * 200;
+}
+
+static int dg_check(const uint8_t *buf, size_t len)
+{
+	uint32_t seq;
+	size_t i;
+
+	if(len < 8)
+		return -1;
+	memcpy(&seq, buf, 4);
+	if(len != dg_len(seq))
+		return -1;
+	for(i = 8; i < len; i++) {
+		if(buf[i] != pattern(seq + i))
+			return -1;
+	}
+	return 0;
+}
+
+/* on the connection's own thread, so the reply goes to conn_addr */
+PT_THREAD(dg_echo_h(struct tcpc_server_conn *c, size_t len))
+{
+	if(len && tcpc_server_queue(c, c->rxbuf, len, TCPC_TX_CLASS_DEFAULT)
+			< 0)
+		bad++;
+	return PT_YIELDED;
+}
+
+void dg_conn(struct tcpc_server_conn *c)
+{
+	/* room for the biggest datagram, or it's cut short */
+	c->rxbuf_sz = 2048;
+	c->conn_h = &dg_echo_h;
+	c->conn_close_h = &count_close;
+}
+
+PT_THREAD(dg_client_h(struct tcpc_client *c, size_t len))
+{
+	if(len) {
+		if(dg_check(c->rxbuf, len) < 0)
+			bad++;
+		__atomic_add_fetch(&dg_got, 1, __ATOMIC_SEQ_CST);
+	}
+	return PT_YIELDED;
+}
+
+static int test_dgram(int port)
+{
+	struct tcpc_server s;
+	struct tcpc_client c;
+	uint8_t buf[2048];
+	char detail[128];
+	int big = 1 << 20, ok;
+	uint32_t seq;
+	size_t i;
+	double t0;
+
+	if(server_init(&s, port, &dg_conn) < 0)
+		return check("datagrams", 0, "init");
+	s.sock_type = SOCK_DGRAM;
+	if(tcpc_open_server(&s) < 0)
+		return check("datagrams", 0, "open");
+	setsockopt(tcpc_server_socket(&s), SOL_SOCKET, SO_RCVBUF, &big,
+			sizeof(big));
+	if(tcpc_start_server(&s) < 0)
+		return check("datagrams", 0, "start");
+
+	dg_got = 0;
+	tcpc_init_client(&c, sizeof(struct sockaddr_in), sizeof(buf),
+			&dg_client_h, NULL);
+	c.sock_type = SOCK_DGRAM;
+	loopback(c.serv_addr, port);
+	if(tcpc_open_client(&c) < 0 || tcpc_start_client(&c) < 0) {
+		server_stop(&s);
+		return check("datagrams", 0, "client");
+	}
+	setsockopt(tcpc_client_socket(&c), SOL_SOCKET, SO_RCVBUF, &big,
+			sizeof(big));
+
+	t0 = now_ms();
+	for(seq = 0; seq < DG_COUNT && now_ms() - t0 < WAIT_MS; seq++) {
+		while(seq - dg_got > DG_WINDOW && now_ms() - t0 < WAIT_MS)
+			usleep(100);
+		memcpy(buf, &seq, 4);
+		for(i = 8; i < dg_len(seq); i++)
+			buf[i] = pattern(seq + i);
+		if(tcpc_client_queue(&c, buf, dg_len(seq),
+				TCPC_TX_CLASS_DEFAULT) < 0)
+			bad++;
+	}
+	wait_for(&dg_got, DG_COUNT);
+	ok = dg_got == DG_COUNT && !bad;
+	snprintf(detail, sizeof(detail), "%d of %d echoed, %ld bad",
+			dg_got, DG_COUNT, bad);
+
+	tcpc_close_client(&c);
+	free_tcpc_client_members(&c);
+	server_stop(&s);
+	return check("datagrams", ok, detail);
+}
+
+/* SHARED MEMORY: an echo over rings much smaller than what's sent, so
+ * both sides wait on full rings
+ */
+#define SHM_LEN		(8 << 20)
+#define SHM_RING	4096
+
+static volatile size_t shm_got;
+
+void shm_conn(struct tcpc_server_conn *c)
+{
+	c->rxbuf_sz = 8192;
+	if(tcpc_shm_server_conn(c, SHM_RING) < 0)
+		bad++;
+	c->conn_h = &echo_h;
+	c->conn_close_h = &count_close;
+	__atomic_add_fetch(&conns, 1, __ATOMIC_SEQ_CST);
+}
+
+PT_THREAD(shm_client_h(struct tcpc_client *c, size_t len))
+{
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		if(c->rxbuf[i] != pattern(shm_got + i))
+			bad++;
+	}
+	shm_got += len;
+	return PT_YIELDED;
+}
+
+static int test_shm(const char *path)
+{
+	struct tcpc_server s;
+	struct tcpc_client c;
+	struct sockaddr_un *a;
+	uint8_t buf[10000];
+	char detail[128];
+	size_t off, n, i;
+	ssize_t w;
+	double t0;
+	int ok;
+
+	unlink(path);
+	reset();
+	if(tcpc_init_server(&s, sizeof(struct sockaddr_un), &shm_conn) < 0)
+		return check("shm", 0, "init");
+	a = (struct sockaddr_un *)s.serv_addr;
+	memset(a, 0, sizeof(struct sockaddr_un));
+	a->sun_family = AF_UNIX;
+	strncpy(a->sun_path, path, sizeof(a->sun_path) - 1);
+	if(tcpc_open_server(&s) < 0 || tcpc_start_server(&s) < 0)
+		return check("shm", 0, "start");
+
+	shm_got = 0;
+	tcpc_init_client(&c, sizeof(struct sockaddr_un), 3000,
+			&shm_client_h, NULL);
+	memcpy(c.serv_addr, a, sizeof(struct sockaddr_un));
+	tcpc_shm_client(&c);
+	if(tcpc_open_client(&c) < 0 || tcpc_start_client(&c) < 0) {
+		server_stop(&s);
+		unlink(path);
+		return check("shm", 0, "client");
+	}
+
+	t0 = now_ms();
+	for(off = 0; off < SHM_LEN; off += (size_t)w) {
+		n = SHM_LEN - off < sizeof(buf) ? SHM_LEN - off : sizeof(buf);
+		for(i = 0; i < n; i++)
+			buf[i] = pattern(off + i);
+		if((w = tcpc_client_send_to(&c, buf, n, 0)) <= 0)
+			break;
+	}
+	while(shm_got < SHM_LEN && now_ms() - t0 < WAIT_MS)
+		usleep(1000);
+	tcpc_close_client(&c);
+	wait_for(&closed, 1);
+	ok = conns == 1 && shm_got == SHM_LEN && !bad && closed == 1;
+	snprintf(detail, sizeof(detail),
+			"%zu of %d bytes echoed over %d byte rings in %.0f ms, "
+			"%ld bad", (size_t)shm_got, SHM_LEN, SHM_RING,
+			now_ms() - t0, bad);
+
+	free_tcpc_client_members(&c);
+	server_stop(&s);
+	unlink(path);
+	return check("shm", ok, detail);
+}
+
+/* PROXY: a client through the proxy to an echo server. the client's
+ * half close goes through, and the echo's close comes back
+ */
+#define PROXY_LEN	(4 << 20)
+
+static volatile int up_closed;
+
+void up_close(struct tcpc_client *up)
+{
+	free_tcpc_client_members(up);
+	free(up);
+	__atomic_add_fetch(&up_closed, 1, __ATOMIC_SEQ_CST);
+}
+
+void proxy_conn(struct tcpc_server_conn *c)
+{
+	struct tcpc_client *up;
+
+	c->conn_close_h = &count_close;
+	if((up = (struct tcpc_client *)calloc(1, sizeof(struct tcpc_client)))
+			== NULL)
+		return;
+	tcpc_init_client(up, sizeof(struct sockaddr_in), 16, NULL, &up_close);
+	loopback(up->serv_addr, upstream_port);
+	if(tcpc_open_client(up) < 0 || tcpc_server_conn_proxy(c, up) < 0) {
+		bad++;
+		free_tcpc_client_members(up);
+		free(up);
+	}
+}
+
+static int test_proxy(int port)
+{
+	struct tcpc_server echo, s;
+	struct raw_sender rs;
+	pthread_t t;
+	uint8_t buf[16384];
+	char detail[128];
+	size_t echoed = 0;
+	long wrong = 0;
+	ssize_t r, i;
+	int ok;
+
+	upstream_port = port + 1;
+	up_closed = 0;
+	if(server_init(&echo, upstream_port, &echo_conn) < 0 ||
+			server_start(&echo) < 0)
+		return check("proxy", 0, "upstream");
+	if(server_init(&s, port, &proxy_conn) < 0 || server_start(&s) < 0) {
+		server_stop(&echo);
+		return check("proxy", 0, "start");
+	}
+
+	rs.fd = raw_connect(port);
+	rs.len = PROXY_LEN;
+	pthread_create(&t, NULL, &raw_send_routine, &rs);
+	while((r = recv(rs.fd, buf, sizeof(buf), 0)) > 0) {
+		for(i = 0; i < r; i++) {
+			if(buf[i] != pattern(echoed + i))
+				wrong++;
+		}
+		echoed += r;
+	}
+	pthread_join(t, NULL);
+	close(rs.fd);
+	/* the echo connection and the proxied one */
+	wait_for(&closed, 2);
+	wait_for(&up_closed, 1);
+	ok = r == 0 && echoed == PROXY_LEN && !wrong && !bad &&
+		up_closed == 1;
+	snprintf(detail, sizeof(detail),
+			"%zu of %d bytes echoed through, %ld wrong, upstream "
+			"closed %d", echoed, PROXY_LEN, wrong, up_closed);
+
+	server_stop(&s);
+	server_stop(&echo);
+	return check("proxy", ok, detail);
+}
+
+/* ROUTER: packits are forwarded on their Route header without being
+ * rebuilt. "echo" ones go back to the sender, the rest are dropped
+ */
+#define ROUTE_COUNT	400
+#define ROUTE_KEY	"Route"
+
+static volatile int routed;
+
+static void *route_h(const char *val, size_t len, void *arg)
+{
+	if(val && len == 4 && memcmp(val, "echo", 4) == 0)
+		return arg;
+	return NULL;
+}
+
+static int fwd_h(void *route, const void *buf, size_t len, int end,
+		void *arg)
+{
+	struct tcpc_server_conn *c = (struct tcpc_server_conn *)route;
+	size_t off = 0;
+	ssize_t w;
+
+	while(off < len) {
+		if((w = tcpc_server_send_to(c, (const uint8_t *)buf + off,
+				len - off, 0)) <= 0)
+			return -1;
+		off += (size_t)w;
+	}
+	return 0;
+}
+
+PT_THREAD(route_conn_h(struct tcpc_server_conn *c, size_t len))
+{
+	if(len && packit_route((struct packit_router *)c->priv, c->rxbuf,
+			len) < 0) {
+		bad++;
+		return PT_ENDED;
+	}
+	return PT_YIELDED;
+}
+
+void route_close(struct tcpc_server_conn *c)
+{
+	packit_router_free((struct packit_router *)c->priv);
+	free(c->priv);
+	count_close(c);
+}
+
+void route_conn(struct tcpc_server_conn *c)
+{
+	struct packit_router *r;
+
+	c->conn_h = &route_conn_h;
+	c->conn_close_h = &route_close;
+	if((r = (struct packit_router *)malloc(sizeof(*r))) == NULL ||
+			packit_router_init(r, ROUTE_KEY, &route_h, &fwd_h, c)
+			< 0) {
+		free(r);
+		c->priv = NULL;
+		c->conn_h = &idle_h;
+		c->conn_close_h = &count_close;
+		bad++;
+		return;
+	}
+	c->priv = r;
+}
+
+static ssize_t raw_txf(const void *buf, size_t len, void *arg)
+{
+	return send(*(int *)arg, buf, len, MSG_NOSIGNAL);
+}
+
+static size_t route_body(unsigned int seq)
+{
+	return (seq * 37) % 3000;
+}
+
+/* text and binary, every other one to be echoed */
+static void *route_send_routine(void *arg)
+{
+	int fd = *(int *)arg;
+	struct packit *p;
+	char body[3000];
+	unsigned int seq;
+	size_t i;
+
+	for(seq = 0; seq < ROUTE_COUNT; seq++) {
+		if((p = packit_new()) == NULL)
+			break;
+		packit_add_header(p, ROUTE_KEY, seq % 2 ? "drop" : "echo");
+		packit_add_uint_header(p, "Seq", seq);
+		for(i = 0; i < route_body(seq); i++)
+			body[i] = (char)pattern(seq + i);
+		p->data = body;
+		p->clen = route_body(seq);
+		if(packit_send_fmt(p, (seq / 2) % 2 ? PACKITS_FMT_BINARY :
+				PACKITS_FMT_TEXT, &raw_txf, &fd) < 0)
+			bad++;
+		packit_free(p);
+	}
+	shutdown(fd, SHUT_WR);
+	return NULL;
+}
+
+/* the client checks the echoes are the even ones, in order */
+static void route_packit_h(struct packit *p, void *arg)
+{
+	struct packit_record *r = packit_get_header(p, "Seq");
+	unsigned int seq;
+	size_t i;
+
+	seq = r == NULL ? ~0U : r->type == PACKITS_REC_UINT ? r->num.u :
+		(unsigned int)strtoul(r->val, NULL, 10);
+	if(seq != 2U * routed || p->clen != route_body(seq))
+		bad++;
+	for(i = 0; i < p->clen && seq != ~0U; i++) {
+		if((uint8_t)p->data[i] != pattern(seq + i))
+			bad++;
+	}
+	routed++;
+	free(p->data);
+	packit_free(p);
+}
+
+static int test_router(int port)
+{
+	struct tcpc_server s;
+	struct packit_parser pp;
+	pthread_t t;
+	char buf[4096], detail[128];
+	ssize_t r;
+	int fd, ok;
+
+	if(server_init(&s, port, &route_conn) < 0 || server_start(&s) < 0)
+		return check("router", 0, "start");
+	routed = 0;
+	fd = raw_connect(port);
+	pthread_create(&t, NULL, &route_send_routine, &fd);
+
+	packit_parser_init(&pp, &route_packit_h, NULL);
+	while((r = recv(fd, buf, sizeof(buf), 0)) > 0) {
+		if(packit_parse(&pp, buf, r) < 0) {
+			bad++;
+			break;
+		}
+	}
+	packit_parser_free(&pp);
+	pthread_join(t, NULL);
+	close(fd);
+	wait_for(&closed, 1);
+	ok = routed == ROUTE_COUNT / 2 && !bad;
+	snprintf(detail, sizeof(detail), "%d of %d packits routed back, "
+			"%ld bad", routed, ROUTE_COUNT / 2, bad);
+
+	server_stop(&s);
+	return check("router", ok, detail);
+}
+
+/* Main Routine */
+int main(int argc, char *argv[])
+{
+	int port = argc > 1 ? atoi(argv[1]) : DEFAULT_PORT;
+	const char *path = argc > 2 ? argv[2] : DEFAULT_PATH;
+	int failed = 0;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+
+	failed += test_reject(port);
+	failed += test_rate_limit(port + 1);
+	failed += test_watermarks(port + 2, 0);
+	failed += test_watermarks(port + 3, 2);
+	failed += test_dgram(port + 4);
+	failed += test_shm(path);
+	failed += test_proxy(port + 5);
+	failed += test_router(port + 7);
+
+	printf("%d failed\n", failed);
+	return failed;
+}
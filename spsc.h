@@ -0,0 +1,120 @@
+/*
+ * spsc.h - Lock-free Single Producer Single Consumer Ring.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+/* DESCRIPTION: A bounded FIFO of pointers between exactly two threads. One
+ * thread pushes, the other pops, with no locks and no atomic
+ * read-modify-write. The slot array is supplied by the caller and its size
+ * must be a power of two. The indexes are padded onto separate cache lines
+ * so the two ends don't bounce a line between them.
+ */
+
+#include <stddef.h>
+
+#ifndef I__SPSC_H__
+	#define I__SPSC_H__
+
+#define SPSC_CACHE_LINE		64
+
+typedef struct spsc_ring {
+	void **slots;
+	unsigned int mask;
+	char _pad0[SPSC_CACHE_LINE];
+	unsigned int head; /* producer */
+	char _pad1[SPSC_CACHE_LINE];
+	unsigned int tail; /* consumer */
+} spsc_t;
+
+
+/* INIT */
+
+/* spsc_init
+ * 	size is the number of slots, a power of two
+ */
+static inline void spsc_init(spsc_t *r, void **slots, unsigned int size)
+{
+	r->slots = slots;
+	r->mask = size - 1;
+	r->head = 0;
+	r->tail = 0;
+}
+
+/* spsc_size
+ * 	rounds n up to a power of two
+ */
+static inline unsigned int spsc_size(unsigned int n)
+{
+	unsigned int size = 1;
+
+	while(size < n)
+		size <<= 1;
+	return size;
+}
+
+
+/* PUSH */
+
+/* spsc_push
+ * 	producer thread only. returns -1 when the ring is full
+ */
+static inline int spsc_push(spsc_t *r, void *p)
+{
+	unsigned int h = r->head;
+
+	if(h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > r->mask)
+		return -1;
+	r->slots[h & r->mask] = p;
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+/* POP */
+
+/* spsc_pop
+ * 	consumer thread only. returns NULL when the ring is empty
+ */
+static inline void *spsc_pop(spsc_t *r)
+{
+	unsigned int t = r->tail;
+	void *p;
+
+	if(t == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE))
+		return NULL;
+	p = r->slots[t & r->mask];
+	__atomic_store_n(&r->tail, t + 1, __ATOMIC_RELEASE);
+	return p;
+}
+
+
+/* TESTS */
+
+/* spsc_count
+ * 	exact from either end's own thread, a snapshot otherwise
+ */
+static inline unsigned int spsc_count(spsc_t *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+		__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif /* I__SPSC_H__ */
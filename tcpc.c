@@ -21,10 +21,104 @@
 
 /****************************************************************************/
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include "tcpc.h"
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+
+/* I/O LOOP */
+#define TCPC_LOOP_EVENTS	64
+#define TCPC_LOOP_TX_ROUNDS	16	/* sending rounds between polls */
+
+struct tcpc_io_loop {
+	struct tcpc_server *_server;
+	int _epfd;
+	int _wakefd; /* eventfd shared by the connections' queues */
+	int _timeout;
+	volatile int _end_thread;
+	pthread_t _thread;
+	int _cpu; /* pinned to, or -1 */
+	pthread_mutex_t _mutex; /* _new */
+	ll_t _new; /* handed over by the listen thread */
+	ll_t _conns;
+	ll_t _active;
+};
+
+/* CONNECTION THREADS */
+struct tcpc_conn_worker {
+	struct tcpc_server *_server;
+	struct tcpc_server_conn *_conn; /* NULL while idle */
+	pthread_cond_t _cond;
+	ll_t _list; /* on _idle_workers while idle */
+};
+
+/* RX BUFFER POOL */
+struct tcpc_pooled_buf {
+	struct tcpc_pooled_buf *_next;
+	size_t _size;
+	uint8_t data[];
+};
+
+/* PROXY */
+/* one direction of a proxied connection, source socket to pipe to
+ * destination socket
+ */
+struct tcpc_splice {
+	int pipe[2];
+	size_t size; /* of the pipe */
+	size_t pending; /* bytes in the pipe */
+	int eof; /* the source is done sending */
+	int shut; /* and the destination has been told */
+};
+
+struct tcpc_proxy {
+	struct tcpc_client *up;
+	struct tcpc_splice dir[2]; /* to the upstream, and back */
+};
+
+/* DATAGRAMS */
+/* room for a UDP_GRO or UDP_SEGMENT control message */
+#define TCPC_DGRAM_CTL		CMSG_SPACE(sizeof(int))
+
+/* the batches of a datagram socket. messages taken off the outbound queue
+ * wait in txm until they're sent
+ */
+struct tcpc_dgram {
+	int batch;
+	size_t bufsz;
+	int gro; /* a read may hold several datagrams of one size */
+	size_t gso_max; /* largest datagram sent in a GSO run, 0 for none */
+	uint8_t *bufs;
+	struct mmsghdr *rx;
+	struct iovec *rxiov;
+	struct sockaddr_storage *rxaddr;
+	char *rxctl;
+	struct mmsghdr *tx;
+	struct iovec *txiov;
+	char *txctl;
+	struct tcpc_txmsg **txm;
+	int ntxm;
+	socklen_t from; /* of the sender in conn_addr, 0 before any */
+};
+
+/* the datagram server connection served by this thread, if any. conn_addr
+ * only holds the sender of the datagram being handled on it
+ */
+static __thread struct tcpc_server_conn *_dgram_self;
 
 
 /* local helper functions */
@@ -39,6 +133,649 @@ static ssize_t _tcpc_tx_handler(int sock, const void *buf, size_t len,
 	return send(sock, buf, len, flags | MSG_NOSIGNAL);
 }
 
+static int _tcpc_close_handler(int sock)
+{
+	return close(sock);
+}
+
+static inline int _tx_class(int tx_class)
+{
+	if(tx_class < 0)
+		return 0;
+	if(tx_class >= TCPC_TX_CLASSES)
+		return TCPC_TX_CLASSES - 1;
+	return tx_class;
+}
+
+static uint64_t _now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* BUSY POLLING */
+/* how long to spin before sleeping for timeout_ms. spinning through an
+ * infinite timeout goes a TCPC_DEFAULT_POLL_TO slice at a time
+ */
+static uint64_t _spin_ns(int spin_us, int timeout_ms)
+{
+	if(spin_us >= 0)
+		return (uint64_t)spin_us * 1000;
+	if(timeout_ms < 0)
+		timeout_ms = TCPC_DEFAULT_POLL_TO;
+	return (uint64_t)timeout_ms * 1000000;
+}
+
+/* poll that spins for spin_us before sleeping. with spin_us < 0 it spins
+ * for the whole timeout. returns like poll
+ */
+static int _tcpc_poll(struct pollfd *fds, nfds_t n, int timeout_ms,
+		int spin_us)
+{
+	uint64_t start, spin_ns;
+	int e;
+
+	if(spin_us == 0)
+		return poll(fds, n, timeout_ms);
+
+	spin_ns = _spin_ns(spin_us, timeout_ms);
+	start = _now_ns();
+	do {
+		if((e = poll(fds, n, 0)) != 0)
+			return e;
+	} while(_now_ns() - start < spin_ns);
+
+	return (spin_us < 0) ? 0 : poll(fds, n, timeout_ms);
+}
+
+/* PLACEMENT */
+/* the n-th CPU of set, wrapping around. -1 for an empty set */
+static int _tcpc_nth_cpu(const cpu_set_t *set, int n)
+{
+	int cpu, count = CPU_COUNT(set);
+
+	if(count == 0)
+		return -1;
+	n %= count;
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if(CPU_ISSET(cpu, set) && n-- == 0)
+			return cpu;
+	}
+
+	return -1;
+}
+
+/* creates a thread, on cpus when that isn't NULL */
+static int _tcpc_thread_create(pthread_t *t, const cpu_set_t *cpus,
+		void *(*routine)(void *), void *arg)
+{
+	pthread_attr_t attr;
+	int e;
+
+	pthread_attr_init(&attr);
+	if(cpus)
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), cpus);
+	e = pthread_create(t, &attr, routine, arg);
+	pthread_attr_destroy(&attr);
+
+	return e;
+}
+
+/* lets the kernel spin on the device queue when the socket is read */
+static void _tcpc_busy_poll_sock(int sock, int spin_us)
+{
+#ifdef SO_BUSY_POLL
+	int us = (spin_us < 0) ? 50 : spin_us;
+
+	/* past net.core.busy_read it takes CAP_NET_ADMIN. spinning here
+	 * still works without it
+	 */
+	if(spin_us)
+		setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));
+#endif
+}
+
+static void _tcpc_txq_init(struct tcpc_txq *q)
+{
+	int i;
+
+	memset(q, 0, sizeof(struct tcpc_txq));
+	for(i = 0; i < TCPC_TX_CLASSES; i++) {
+		mpsc_init(&q->in[i]);
+		INIT_LIST_HEAD(&q->q[i]);
+	}
+	q->wakefd = -1;
+}
+
+/* wakes the connection thread, once until it next flushes */
+static inline void _tcpc_txq_wake(struct tcpc_txq *q)
+{
+	uint64_t one = 1;
+	int fd;
+
+	if(__atomic_exchange_n(&q->wake, 1, __ATOMIC_ACQ_REL))
+		return;
+	if((fd = __atomic_load_n(&q->wakefd, __ATOMIC_ACQUIRE)) >= 0 &&
+			write(fd, &one, sizeof(one)) < 0)
+		perror("tcpc_txq_wake");
+}
+
+/* safe from any thread, without locks */
+static int _tcpc_txq_put(struct tcpc_txq *q, struct tcpc_txmsg *m,
+		int tx_class)
+{
+	__atomic_add_fetch(&q->producers, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&q->closed, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&q->producers, 1, __ATOMIC_SEQ_CST);
+		tcpc_txmsg_free(m);
+		return -1;
+	}
+	if(q->mem) {
+		if(tcpc_mem_charge(q->mem, sizeof(struct tcpc_txmsg) +
+				m->cap) < 0) {
+			__atomic_sub_fetch(&q->producers, 1,
+					__ATOMIC_SEQ_CST);
+			tcpc_txmsg_free(m);
+			return -1;
+		}
+		m->_mem = q->mem;
+		m->_charged = sizeof(struct tcpc_txmsg) + m->cap;
+	}
+	m->queued_ns = _now_ns();
+	mpsc_push(&q->in[_tx_class(tx_class)], &m->node);
+	__atomic_add_fetch(&q->count, 1, __ATOMIC_RELEASE);
+	_tcpc_txq_wake(q);
+	__atomic_sub_fetch(&q->producers, 1, __ATOMIC_SEQ_CST);
+
+	return 0;
+}
+
+/* the following must be called from the connection thread */
+/* moves pushed messages onto the class lists, keeping their order */
+static void _tcpc_txq_collect(struct tcpc_txq *q)
+{
+	mpsc_node_t *n;
+	int i;
+
+	__atomic_store_n(&q->wake, 0, __ATOMIC_RELEASE);
+	for(i = 0; i < TCPC_TX_CLASSES; i++) {
+		while((n = mpsc_pop(&q->in[i])) != NULL) {
+			list_add_tail(&mpsc_entry(n, struct tcpc_txmsg,
+						node)->list, &q->q[i]);
+		}
+	}
+}
+
+static struct tcpc_txmsg *_tcpc_txq_pick(struct tcpc_txq *q)
+{
+	struct tcpc_txmsg *m;
+	uint64_t delay;
+	int i, pick = -1;
+
+	/* the highest starved class, or else the highest class */
+	for(i = 0; i < TCPC_TX_CLASSES; i++) {
+		if(list_empty(&q->q[i]))
+			continue;
+		if(q->skipped[i] >= TCPC_TX_STARVE_LIMIT) {
+			pick = i;
+			break;
+		}
+		if(pick < 0)
+			pick = i;
+	}
+	if(pick < 0)
+		return NULL;
+
+	/* lower classes waiting behind this one age */
+	for(i = pick + 1; i < TCPC_TX_CLASSES; i++) {
+		if(!list_empty(&q->q[i]))
+			q->skipped[i]++;
+	}
+	q->skipped[pick] = 0;
+
+	m = list_first_entry(&q->q[pick], struct tcpc_txmsg, list);
+	list_del(&m->list);
+	__atomic_sub_fetch(&q->count, 1, __ATOMIC_RELAXED);
+
+	/* the stats are read from other threads */
+	delay = _now_ns() - m->queued_ns;
+	__atomic_add_fetch(&q->stats.msgs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->stats.bytes, m->len, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&q->stats.delay_ns_total, delay, __ATOMIC_RELAXED);
+	if(delay > q->stats.delay_ns_max)
+		__atomic_store_n(&q->stats.delay_ns_max, delay,
+				__ATOMIC_RELAXED);
+
+	return m;
+}
+
+static inline int _tcpc_txq_pending(struct tcpc_txq *q)
+{
+	return q->cur || __atomic_load_n(&q->count, __ATOMIC_ACQUIRE);
+}
+
+/* sends queued messages until the socket would block, or budget bytes
+ * (unlimited when NULL) have gone out
+ * 	returns 0 when the queue is empty, 1 when the socket is full, 2 when
+ * 	the budget is spent and -1 on error
+ */
+static int _tcpc_txq_flush(struct tcpc_txq *q, int sock,
+		ssize_t (*tx_h)(int sock, const void *buf, size_t len,
+			int flags), size_t *budget)
+{
+	struct tcpc_txmsg *m;
+	size_t n;
+	ssize_t r;
+
+	_tcpc_txq_collect(q);
+	for(;;) {
+		if(budget && *budget == 0)
+			return 2;
+		if(q->cur == NULL && (q->cur = _tcpc_txq_pick(q)) == NULL)
+			return 0;
+		m = q->cur;
+		n = m->len - m->off;
+		if(budget && n > *budget)
+			n = *budget;
+		r = (tx_h)(sock, m->data + m->off, n, MSG_DONTWAIT);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			return -1;
+		}
+		m->off += (size_t)r;
+		if(budget)
+			*budget -= (size_t)r;
+		if(m->off == m->len) {
+			q->cur = NULL;
+			tcpc_txmsg_free(m);
+		}
+	}
+}
+
+/* clears a wakeup */
+static inline void _tcpc_wake_ack(int fd)
+{
+	uint64_t v;
+
+	if(read(fd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		perror("tcpc_wake_ack");
+}
+
+/* drops everything queued and refuses new messages */
+static void _tcpc_txq_close(struct tcpc_txq *q)
+{
+	struct tcpc_txmsg *m, *n;
+	int i;
+
+	__atomic_store_n(&q->closed, 1, __ATOMIC_SEQ_CST);
+	/* let pushes in progress land */
+	while(__atomic_load_n(&q->producers, __ATOMIC_SEQ_CST))
+		sched_yield();
+	_tcpc_txq_collect(q);
+	for(i = 0; i < TCPC_TX_CLASSES; i++) {
+		list_for_each_entry_safe(m, n, &q->q[i], list) {
+			list_del(&m->list);
+			tcpc_txmsg_free(m);
+		}
+	}
+	q->count = 0;
+	tcpc_txmsg_free(q->cur);
+	q->cur = NULL;
+}
+
+/* datagram batches */
+static void _dgram_free(struct tcpc_dgram *d)
+{
+	int i;
+
+	if(d == NULL)
+		return;
+	for(i = 0; i < d->ntxm; i++)
+		tcpc_txmsg_free(d->txm[i]);
+	free(d->bufs);
+	free(d->rx);
+	free(d->rxiov);
+	free(d->rxaddr);
+	free(d->rxctl);
+	free(d->tx);
+	free(d->txiov);
+	free(d->txctl);
+	free(d->txm);
+	free(d);
+}
+
+/* datagrams per system call for a dgram_batch setting */
+static inline int _dgram_batch(int batch)
+{
+	if(batch <= 0)
+		return TCPC_DEFAULT_DGRAM_BATCH;
+	return (batch > IOV_MAX) ? IOV_MAX : batch;
+}
+
+static struct tcpc_dgram *_dgram_alloc(int sock, int batch, size_t bufsz)
+{
+	struct tcpc_dgram *d;
+	socklen_t len = sizeof(int);
+	int proto = 0, one = 1;
+	size_t n;
+
+	batch = _dgram_batch(batch);
+	n = (size_t)batch * TCPC_DGRAM_GSO_SEGS;
+	if((d = (struct tcpc_dgram *)calloc(1, sizeof(struct tcpc_dgram)))
+			== NULL)
+		return NULL;
+	d->batch = batch;
+	d->bufsz = bufsz;
+	if((d->bufs = (uint8_t *)malloc(batch * bufsz)) == NULL ||
+			(d->rx = (struct mmsghdr *)calloc(batch,
+				sizeof(struct mmsghdr))) == NULL ||
+			(d->rxiov = (struct iovec *)calloc(batch,
+				sizeof(struct iovec))) == NULL ||
+			(d->rxaddr = (struct sockaddr_storage *)calloc(batch,
+				sizeof(struct sockaddr_storage))) == NULL ||
+			(d->rxctl = (char *)calloc(batch, TCPC_DGRAM_CTL))
+				== NULL ||
+			(d->tx = (struct mmsghdr *)calloc(batch,
+				sizeof(struct mmsghdr))) == NULL ||
+			(d->txiov = (struct iovec *)calloc(n,
+				sizeof(struct iovec))) == NULL ||
+			(d->txctl = (char *)calloc(batch, TCPC_DGRAM_CTL))
+				== NULL ||
+			(d->txm = (struct tcpc_txmsg **)calloc(n,
+				sizeof(struct tcpc_txmsg *))) == NULL) {
+		_dgram_free(d);
+		return NULL;
+	}
+
+	/* segmentation offload is UDP's, where the kernel has it */
+	if(getsockopt(sock, SOL_SOCKET, SO_PROTOCOL, &proto, &len) < 0 ||
+			proto != IPPROTO_UDP)
+		return d;
+#ifdef UDP_SEGMENT
+	d->gso_max = TCPC_DGRAM_GSO_MAX;
+#endif
+#ifdef UDP_GRO
+	/* a joined read is up to 64k. only turn it on with room for that */
+	if(bufsz >= 65535 && setsockopt(sock, SOL_UDP, UDP_GRO, &one,
+			sizeof(one)) == 0)
+		d->gro = 1;
+#endif
+	(void)one;
+
+	return d;
+}
+
+/* reads a batch into the buffers. returns the number of reads, each
+ * holding a datagram or with GRO a run of them, and -1 on error
+ */
+static int _dgram_recv(struct tcpc_dgram *d, int sock)
+{
+	struct msghdr *mh;
+	int i, n;
+
+	for(i = 0; i < d->batch; i++) {
+		d->rxiov[i].iov_base = d->bufs + i * d->bufsz;
+		d->rxiov[i].iov_len = d->bufsz;
+		mh = &d->rx[i].msg_hdr;
+		mh->msg_name = &d->rxaddr[i];
+		mh->msg_namelen = sizeof(struct sockaddr_storage);
+		mh->msg_iov = &d->rxiov[i];
+		mh->msg_iovlen = 1;
+		mh->msg_control = d->gro ? d->rxctl + i * TCPC_DGRAM_CTL : NULL;
+		mh->msg_controllen = d->gro ? TCPC_DGRAM_CTL : 0;
+		mh->msg_flags = 0;
+	}
+	if((n = recvmmsg(sock, d->rx, d->batch, MSG_DONTWAIT, NULL)) < 0) {
+		/* a refused earlier datagram isn't this socket's end */
+		if(errno == EAGAIN || errno == EWOULDBLOCK ||
+				errno == EINTR || errno == ECONNREFUSED)
+			return 0;
+		return -1;
+	}
+
+	return n;
+}
+
+/* the size of the datagrams in read i. a read is one datagram unless GRO
+ * joined several
+ */
+static size_t _dgram_seg(struct tcpc_dgram *d, int i)
+{
+	size_t len = d->rx[i].msg_len;
+#ifdef UDP_GRO
+	struct cmsghdr *cm;
+	int seg;
+
+	for(cm = CMSG_FIRSTHDR(&d->rx[i].msg_hdr); cm;
+			cm = CMSG_NXTHDR(&d->rx[i].msg_hdr, cm)) {
+		if(cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+			memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+			if(seg > 0 && (size_t)seg < len)
+				return (size_t)seg;
+		}
+	}
+#endif
+
+	return len;
+}
+
+/* m can follow prev in f's GSO run: same peer, same size but for a
+ * shorter last one
+ */
+static int _dgram_joins(struct tcpc_txmsg *f, struct tcpc_txmsg *prev,
+		struct tcpc_txmsg *m)
+{
+	if(prev->len != f->len || m->len == 0 || m->len > f->len)
+		return 0;
+	if(f->_to == NULL || m->_to == NULL)
+		return f->_to == m->_to;
+	return f->_tolen == m->_tolen && memcmp(f->_to, m->_to, f->_tolen) == 0;
+}
+
+/* sends queued messages, one datagram each, until the socket would block.
+ * A datagram the socket refuses is dropped.
+ * 	returns 0 when the queue is empty and 1 when the socket is full
+ */
+static int _dgram_flush(struct tcpc_dgram *d, struct tcpc_txq *q, int sock)
+{
+	struct tcpc_txmsg *m, *f;
+	struct msghdr *mh;
+	struct cmsghdr *cm;
+	int i, j, n, k, sent, retried = 0;
+	size_t total;
+#ifdef UDP_SEGMENT
+	uint16_t seg;
+#endif
+
+	_tcpc_txq_collect(q);
+	for(;;) {
+		while(d->ntxm < d->batch * TCPC_DGRAM_GSO_SEGS &&
+				(m = _tcpc_txq_pick(q)) != NULL)
+			d->txm[d->ntxm++] = m;
+		if(d->ntxm == 0)
+			return 0;
+
+		/* an entry per datagram, or per GSO run */
+		for(i = 0, n = 0; i < d->ntxm && n < d->batch; n++) {
+			f = d->txm[i];
+			mh = &d->tx[n].msg_hdr;
+			memset(mh, 0, sizeof(struct msghdr));
+			mh->msg_name = f->_to;
+			mh->msg_namelen = f->_to ? f->_tolen : 0;
+			mh->msg_iov = &d->txiov[i];
+			total = 0;
+			do {
+				d->txiov[i].iov_base = d->txm[i]->data;
+				d->txiov[i].iov_len = d->txm[i]->len;
+				total += d->txm[i]->len;
+				mh->msg_iovlen++;
+				i++;
+			} while(i < d->ntxm && f->len <= d->gso_max &&
+					mh->msg_iovlen < TCPC_DGRAM_GSO_SEGS &&
+					total + d->txm[i]->len <=
+						TCPC_DGRAM_GSO_MAX &&
+					_dgram_joins(f, d->txm[i - 1],
+						d->txm[i]));
+#ifdef UDP_SEGMENT
+			if(mh->msg_iovlen > 1) {
+				mh->msg_control = d->txctl + n * TCPC_DGRAM_CTL;
+				mh->msg_controllen = CMSG_SPACE(sizeof(seg));
+				cm = CMSG_FIRSTHDR(mh);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(seg));
+				seg = (uint16_t)f->len;
+				memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+			}
+#else
+			(void)cm;
+#endif
+		}
+
+		if((sent = sendmmsg(sock, d->tx, n, MSG_DONTWAIT |
+				MSG_NOSIGNAL)) < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			/* the first entry failed. an ICMP error left over from
+			 * an earlier datagram is reported once, go again
+			 */
+			if(!retried && (errno == ECONNREFUSED ||
+					errno == EHOSTUNREACH ||
+					errno == ENETUNREACH)) {
+				retried = 1;
+				continue;
+			}
+			/* a run the stack or device won't segment goes again
+			 * without GSO at its size
+			 */
+			if(d->tx[0].msg_hdr.msg_iovlen > 1 &&
+					(errno == EINVAL || errno == EIO ||
+					 errno == EOPNOTSUPP)) {
+				d->gso_max = d->txm[0]->len - 1;
+				continue;
+			}
+			/* anything else drops it */
+			sent = 1;
+		}
+		retried = 0;
+
+		/* done with the messages of the entries sent */
+		for(j = 0, k = 0; j < sent; j++)
+			k += (int)d->tx[j].msg_hdr.msg_iovlen;
+		for(j = 0; j < k; j++)
+			tcpc_txmsg_free(d->txm[j]);
+		d->ntxm -= k;
+		memmove(d->txm, d->txm + k,
+				d->ntxm * sizeof(struct tcpc_txmsg *));
+	}
+}
+/* end of connection thread functions */
+
+/* receive handoff */
+static int _tcpc_rxq_init(struct tcpc_rxq *q, int count, size_t size)
+{
+	unsigned int n = spsc_size(count);
+	int i;
+
+	memset(q, 0, sizeof(struct tcpc_rxq));
+	if((q->bufs = (struct tcpc_rxbuf **)calloc(count,
+			sizeof(struct tcpc_rxbuf *))) == NULL ||
+			(q->slots = (void **)calloc(2 * n, sizeof(void *)))
+			== NULL)
+		goto error;
+	spsc_init(&q->filled, q->slots, n);
+	spsc_init(&q->free, q->slots + n, n);
+	for(q->count = 0; q->count < count; q->count++) {
+		if((q->bufs[q->count] = (struct tcpc_rxbuf *)malloc(
+				sizeof(struct tcpc_rxbuf) + size)) == NULL)
+			goto error;
+		spsc_push(&q->free, q->bufs[q->count]);
+	}
+
+	return 0;
+
+error:
+	for(i = 0; i < q->count; i++)
+		free(q->bufs[i]);
+	free(q->bufs);
+	free(q->slots);
+	memset(q, 0, sizeof(struct tcpc_rxq));
+	return -1;
+}
+
+static void _tcpc_rxq_free(struct tcpc_rxq *q)
+{
+	int i;
+
+	/* every buffer goes, wherever it is */
+	for(i = 0; i < q->count; i++)
+		free(q->bufs[i]);
+	free(q->bufs);
+	free(q->slots);
+	memset(q, 0, sizeof(struct tcpc_rxq));
+}
+
+/* the following must be called from the connection thread */
+/* a free buffer to read into, or NULL while the consumer holds them all */
+static struct tcpc_rxbuf *_tcpc_rxq_get(struct tcpc_rxq *q)
+{
+	struct tcpc_rxbuf *b = q->spare;
+
+	q->spare = NULL;
+	if(b == NULL)
+		b = (struct tcpc_rxbuf *)spsc_pop(&q->free);
+	return b;
+}
+
+/* hands a read buffer to the consumer, or keeps it when nothing was read */
+static void _tcpc_rxq_fill(struct tcpc_rxq *q, struct tcpc_rxbuf *b,
+		ssize_t l)
+{
+	if(l <= 0) {
+		q->spare = b;
+		return;
+	}
+	b->len = (size_t)l;
+	spsc_push(&q->filled, b);
+}
+
+/* whether a read has a buffer to go into. if not, the consumer wakes us
+ * when it releases one
+ */
+static int _tcpc_rxq_can_read(struct tcpc_rxq *q)
+{
+	if(q->count == 0 || q->spare || spsc_count(&q->free))
+		return 1;
+	__atomic_store_n(&q->stalled, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	/* a release may have slipped in before the store */
+	if(spsc_count(&q->free)) {
+		__atomic_store_n(&q->stalled, 0, __ATOMIC_RELAXED);
+		return 1;
+	}
+	return 0;
+}
+/* end of connection thread functions */
+
+/* consumer thread */
+static void _tcpc_rxq_release(struct tcpc_rxq *q, struct tcpc_rxbuf *b,
+		int wakefd)
+{
+	uint64_t one = 1;
+
+	spsc_push(&q->free, b);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_exchange_n(&q->stalled, 0, __ATOMIC_SEQ_CST) &&
+			wakefd >= 0 && write(wakefd, &one, sizeof(one)) < 0)
+		perror("tcpc_rx_release");
+}
+
 static inline void _tcpc_server_add_conn(struct tcpc_server *s,
 		struct tcpc_server_conn *c)
 {
@@ -56,6 +793,8 @@ static inline void _tcpc_server_add_conn(struct tcpc_server *s,
 static inline void _tcpc_server_remove_conn(struct tcpc_server *s,
 		struct tcpc_server_conn *c)
 {
+	uint64_t one = 1;
+
 	pthread_mutex_lock(&s->_conn_ll_mutex);
 	if(c->_prev==NULL) {
 		/* if I'm the beginning of the list, update the main list
@@ -74,32 +813,180 @@ static inline void _tcpc_server_remove_conn(struct tcpc_server *s,
 	 */
 	if(c->_next)
 		c->_next->_prev = c->_prev;
+	if(c->_shed)
+		s->_shedding--;
 
-	/* decrement the connection count in the parent */
-	s->_conn_count--;
+	/* decrement the connection count in the parent. the listener stops
+	 * watching its socket while full, so tell it there's room
+	 */
+	if(s->_conn_count-- >= s->max_connections &&
+			write(s->_poll[1].fd, &one, sizeof(one)) < 0)
+		perror("_tcpc_server_remove_conn");
 	pthread_mutex_unlock(&s->_conn_ll_mutex);
 }
 
+/* the server's memory ran out. with mem_shed, ends the connection using
+ * the most, unless one is still on its way out
+ */
+static void _server_mem_over(struct tcpc_mem *m, size_t n)
+{
+	struct tcpc_server *s = (struct tcpc_server *)m->priv;
+	struct tcpc_server_conn *c, *heavy = NULL;
+
+	(void)n;
+	if(!s->mem_shed)
+		return;
+
+	pthread_mutex_lock(&s->_conn_ll_mutex);
+	if(s->_shedding == 0) {
+		for(c = s->_conns_ll; c; c = c->_next) {
+			if(!c->_end_thread && (heavy == NULL ||
+					tcpc_mem_used(&c->_mem) >
+					tcpc_mem_used(&heavy->_mem)))
+				heavy = c;
+		}
+	}
+	if(heavy) {
+		heavy->_shed = 1;
+		s->_shedding++;
+		__atomic_add_fetch(&s->_shed, 1, __ATOMIC_RELAXED);
+		TCPC_PROBE2(server_conn_shed, heavy,
+				tcpc_mem_used(&heavy->_mem));
+		heavy->_end_thread = 1;
+	}
+	pthread_mutex_unlock(&s->_conn_ll_mutex);
+}
+
+/* borrows a buffer of at least size bytes from the server's pool */
+static uint8_t *_rxpool_get(struct tcpc_server *s, size_t size)
+{
+	struct tcpc_pooled_buf *b;
+
+	pthread_mutex_lock(&s->_rxpool_mutex);
+	if((b = s->_rxpool) != NULL) {
+		s->_rxpool = b->_next;
+		s->_rxpool_free--;
+	}
+	pthread_mutex_unlock(&s->_rxpool_mutex);
+
+	if(b && b->_size < size) {
+		free(b);
+		b = NULL;
+	}
+	if(b == NULL) {
+		if((b = (struct tcpc_pooled_buf *)malloc(
+				sizeof(struct tcpc_pooled_buf) + size)) == NULL)
+			return NULL;
+		b->_size = size;
+	}
+
+	return b->data;
+}
+
+static void _rxpool_put(struct tcpc_server *s, uint8_t *data)
+{
+	struct tcpc_pooled_buf *b = (struct tcpc_pooled_buf *)
+		(data - offsetof(struct tcpc_pooled_buf, data));
+
+	pthread_mutex_lock(&s->_rxpool_mutex);
+	if(s->_rxpool_free < s->rxbuf_pool_max) {
+		b->_next = s->_rxpool;
+		s->_rxpool = b;
+		s->_rxpool_free++;
+		b = NULL;
+	}
+	pthread_mutex_unlock(&s->_rxpool_mutex);
+	free(b);
+}
+
+static void _rxpool_drain(struct tcpc_server *s)
+{
+	struct tcpc_pooled_buf *b;
+
+	pthread_mutex_lock(&s->_rxpool_mutex);
+	while((b = s->_rxpool) != NULL) {
+		s->_rxpool = b->_next;
+		free(b);
+	}
+	s->_rxpool_free = 0;
+	pthread_mutex_unlock(&s->_rxpool_mutex);
+}
+
+/* gives a borrowed rxbuf back */
+static inline void _server_conn_rxbuf_return(struct tcpc_server_conn *c)
+{
+	if(c->_rxpooled && c->rxbuf) {
+		_rxpool_put(c->_parent, c->rxbuf);
+		tcpc_mem_uncharge(&c->_mem, c->rxbuf_sz);
+		c->rxbuf = NULL;
+	}
+}
+
+/* closes the pipes and the upstream */
+static void _proxy_free(struct tcpc_server_conn *c)
+{
+	struct tcpc_proxy *px = c->_proxy;
+	struct tcpc_client *up = px->up;
+	int i, j;
+
+	for(i = 0; i < 2; i++) {
+		for(j = 0; j < 2; j++) {
+			if(px->dir[i].pipe[j] >= 0)
+				close(px->dir[i].pipe[j]);
+		}
+	}
+	if(up->_state == TCPC_STATE_ACTIVE)
+		TCPC_PROBE2(client_close, up, up->_sock);
+	close(up->_sock);
+	up->_sock = -1;
+	up->_poll[0].fd = -1;
+	/* last touch of up, its close callback may free it */
+	up->_state = TCPC_STATE_INACTIVE;
+	if(up->conn_close_h)
+		(up->conn_close_h)(up);
+	free(px);
+	c->_proxy = NULL;
+}
+
 static inline void _free_tcpc_server_conn(struct tcpc_server_conn *c)
 {
+	_server_conn_rxbuf_return(c);
+	/* drop unsent messages */
+	_tcpc_txq_close(&c->_txq);
+	/* the wakeup belongs to the I/O loop in loop mode */
+	if(c->_loop == NULL && c->_txq.wakefd >= 0)
+		close(c->_txq.wakefd);
 	/* always free everything. free does nothing with NULLs */
 	free(c->rxbuf);
+	_tcpc_rxq_free(&c->_rxq);
 	free(c->conn_addr);
+	if(c->_proxy)
+		_proxy_free(c);
+	_dgram_free(c->_dgram);
+	/* give back the structure and buffers charged to it */
+	tcpc_mem_uncharge(&c->_mem, tcpc_mem_used(&c->_mem));
 	free(c);
 }
 
 static inline struct tcpc_server_conn *_setup_server_conn(struct tcpc_server *s)
 {
 	struct tcpc_server_conn *nc;
+	int e;
 
-	/* get a connection structure */
-	nc = (struct tcpc_server_conn *)malloc(sizeof(struct tcpc_server_conn));
-	if(!nc) {
+	/* get a connection structure, its hot part starting a cache line */
+	if((e = posix_memalign((void **)&nc, TCPC_CACHE_LINE,
+			sizeof(struct tcpc_server_conn))) != 0) {
+		errno = e;
 		perror("_setup_server_conn");
 		return NULL;
 	}
 	/* clear the memory */
 	memset(nc, 0, sizeof(struct tcpc_server_conn));
+	/* everything it uses counts against the server too */
+	tcpc_mem_init(&nc->_mem, &s->_mem, s->conn_mem_limit);
+	/* setup the outbound queue */
+	_tcpc_txq_init(&nc->_txq);
+	nc->_txq.mem = &nc->_mem;
 	/* allocate the sockaddr */
 	nc->_sockaddr_size = s->_sockaddr_size;
 	nc->conn_addr = (struct sockaddr *)malloc(nc->_sockaddr_size);
@@ -112,112 +999,1162 @@ static inline struct tcpc_server_conn *_setup_server_conn(struct tcpc_server *s)
 	nc->_parent = s;
 	/* set the default buffer size */
 	nc->rxbuf_sz = TCPC_DEFAULT_BUF_SZ;
+	nc->rxbuf_max = s->rxbuf_max;
 	/* set the default poll timeout */
 	nc->poll_timeout_ms = TCPC_DEFAULT_POLL_TO;
 	/* set the default rx handler */
 	nc->rx_h = &_tcpc_rx_handler;
 	/* set the default tx handler */
 	nc->tx_h = &_tcpc_tx_handler;
-	/* accept the connection */
-	nc->_sock = accept(s->_sock, nc->conn_addr, &nc->_sockaddr_size);
+	nc->close_h = &_tcpc_close_handler;
+	/* set the default tx weight */
+	nc->tx_weight = 1;
+	nc->busy_poll_us = s->busy_poll_us;
+	INIT_LIST_HEAD(&nc->_loop_list);
+	INIT_LIST_HEAD(&nc->_active_list);
+	/* handler work runs in order on the pool */
+	if(s->pool)
+		tcpc_strand_init(&nc->_strand, s->pool);
+	/* accept the connection. a datagram server's is its socket */
+	if(s->sock_type == SOCK_DGRAM)
+		nc->_sock = fcntl(s->_sock, F_DUPFD_CLOEXEC, 0);
+	else
+		nc->_sock = accept(s->_sock, nc->conn_addr,
+				&nc->_sockaddr_size);
 	if(nc->_sock < 0) {
 		perror("_setup_server_conn");
 		_free_tcpc_server_conn(nc);
 		return NULL;
 	}
-	/* add connection to list */
-	_tcpc_server_add_conn(s, nc);
-	/* initialize the rx buffer mutex */
-	pthread_mutex_init(&nc->rxbuf_mutex, NULL);
-	/* call callback */
-	if(s->new_conn_h)
-		(s->new_conn_h)(nc);
-	/* allocate connection buffers - done after callback so callback can
-	 * change default size
-	 */
-	nc->rxbuf = (uint8_t *)malloc(nc->rxbuf_sz);
-	if(!nc->rxbuf) {
-		perror("_setup_server_conn");
-		if(nc->conn_close_h)
-			(nc->conn_close_h)(nc);
-		close(nc->_sock);
-		_tcpc_server_remove_conn(nc->_parent, nc);
-		_free_tcpc_server_conn(nc);
-		return NULL;
+	/* turn it away if there's no memory for it */
+	if(tcpc_mem_charge(&nc->_mem, sizeof(struct tcpc_server_conn) +
+			nc->_sockaddr_size) < 0) {
+		__atomic_add_fetch(&s->_rejected, 1, __ATOMIC_RELAXED);
+		TCPC_PROBE2(server_conn_reject, nc->_sock, s->_rejected);
+		close(nc->_sock);
+		_free_tcpc_server_conn(nc);
+		return NULL;
+	}
+	/* add connection to list */
+	_tcpc_server_add_conn(s, nc);
+	TCPC_PROBE3(server_conn_accept, nc, nc->_sock, s->_conn_count);
+	/* call callback */
+	if(s->new_conn_h)
+		(s->new_conn_h)(nc);
+	/* allocate connection buffers - done after callback so callback can
+	 * change default size. a proxy reads into its pipes, datagrams go
+	 * in batches
+	 */
+	if(nc->_proxy)
+		e = 0;
+	else if(s->sock_type == SOCK_DGRAM)
+		e = (tcpc_mem_charge(&nc->_mem, _dgram_batch(s->dgram_batch) *
+				nc->rxbuf_sz) == 0 && (nc->_dgram =
+				_dgram_alloc(nc->_sock, s->dgram_batch,
+				nc->rxbuf_sz))) ? 0 : -1;
+	else if(nc->rx_handoff > 0)
+		e = (tcpc_mem_charge(&nc->_mem, nc->rx_handoff *
+				(sizeof(struct tcpc_rxbuf) + nc->rxbuf_sz)) < 0) ?
+			-1 : _tcpc_rxq_init(&nc->_rxq, nc->rx_handoff,
+					nc->rxbuf_sz);
+	else if((nc->_rxpooled = s->rxbuf_pooled))
+		e = 0;
+	else
+		e = (tcpc_mem_charge(&nc->_mem, nc->rxbuf_sz) == 0 &&
+			(nc->rxbuf = (uint8_t *)malloc(nc->rxbuf_sz))) ? 0 : -1;
+	nc->_rxbuf_min = nc->rxbuf_sz;
+	_tcpc_busy_poll_sock(nc->_sock, nc->busy_poll_us);
+	if(e < 0) {
+		perror("_setup_server_conn");
+		if(nc->conn_close_h)
+			(nc->conn_close_h)(nc);
+		(nc->close_h)(nc->_sock);
+		_tcpc_server_remove_conn(nc->_parent, nc);
+		_free_tcpc_server_conn(nc);
+		return NULL;
+	}
+
+	return nc;
+}
+
+/* server connection service functions, shared by the connection threads
+ * and the I/O loops
+ */
+/* reads what's available. returns the length read, or -1 once the peer
+ * has closed
+ */
+static ssize_t _server_conn_rx(struct tcpc_server_conn *c)
+{
+	struct tcpc_rxbuf *b = NULL;
+	size_t len, held;
+	ssize_t l;
+
+	if(c->_rxq.count && (b = _tcpc_rxq_get(&c->_rxq)) == NULL)
+		return 0;
+	/* borrow a buffer only now that there's something to read */
+	if(c->_rxpooled) {
+		if(tcpc_mem_charge(&c->_mem, c->rxbuf_sz) < 0)
+			return 0;
+		if((c->rxbuf = _rxpool_get(c->_parent, c->rxbuf_sz)) == NULL) {
+			tcpc_mem_uncharge(&c->_mem, c->rxbuf_sz);
+			perror("server_conn_rx");
+			return 0;
+		}
+	}
+	/* don't read past rx_high */
+	len = c->rxbuf_sz;
+	if(c->rx_high && (held = __atomic_load_n(&c->_rxheld,
+			__ATOMIC_SEQ_CST)) < c->rx_high &&
+			c->rx_high - held < len)
+		len = c->rx_high - held;
+	l=(c->rx_h)(c->_sock, b ? b->data : c->rxbuf, len);
+	if(b)
+		_tcpc_rxq_fill(&c->_rxq, b, l);
+	if(l <= 0)
+		_server_conn_rxbuf_return(c);
+	else if(c->rx_high)
+		__atomic_add_fetch(&c->_rxheld, (size_t)l, __ATOMIC_SEQ_CST);
+	TCPC_PROBE3(server_conn_rx, c, c->_sock, l);
+	if(l == 0) {
+		/* connection closed */
+		return -1;
+	} else if(l < 0) {
+		/* error, unless it was a wakeup with nothing to read */
+		if(errno != EAGAIN)
+			perror("server_conn_rx");
+		return 0;
+	}
+
+	return l;
+}
+
+/* calls the connection protothread. returns -1 once it has ended */
+static int _server_conn_call(struct tcpc_server_conn *c, ssize_t l)
+{
+	int r = 0;
+
+	if(c->conn_h) {
+		TCPC_PROBE2(server_conn_h_entry, c, l);
+		r = (c->conn_h)(c, (size_t)l);
+		TCPC_PROBE2(server_conn_h_return, c, r);
+	}
+	/* conn_h is done with the data */
+	_server_conn_rxbuf_return(c);
+
+	return (r == PT_ENDED) ? -1 : 0;
+}
+
+/* whether to read more: there's a buffer to read into, memory for what
+ * the read may lead to, and the held bytes are under the watermarks
+ */
+static int _server_conn_can_read(struct tcpc_server_conn *c)
+{
+	struct tcpc_mem *m;
+
+	/* room for a pooled buffer, or at least a byte. uncharges are seen
+	 * on the next poll or tick
+	 */
+	if((m = tcpc_mem_over(&c->_mem, c->_rxpooled ? c->rxbuf_sz : 1))
+			!= NULL) {
+		if(m->over_h)
+			(m->over_h)(m, 0);
+		return 0;
+	}
+	if(!_tcpc_rxq_can_read(&c->_rxq))
+		return 0;
+	if(c->rx_high == 0)
+		return 1;
+
+	if(__atomic_load_n(&c->_rxpaused, __ATOMIC_SEQ_CST)) {
+		if(__atomic_load_n(&c->_rxheld, __ATOMIC_SEQ_CST) > c->rx_low)
+			return 0;
+	} else {
+		if(__atomic_load_n(&c->_rxheld, __ATOMIC_SEQ_CST) < c->rx_high)
+			return 1;
+		/* pause, then look again. a consumer that caught up before
+		 * seeing the pause doesn't wake us
+		 */
+		__atomic_store_n(&c->_rxpaused, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&c->_rxheld, __ATOMIC_SEQ_CST) > c->rx_low)
+			return 0;
+	}
+	__atomic_store_n(&c->_rxpaused, 0, __ATOMIC_SEQ_CST);
+
+	return 1;
+}
+
+/* sizes rxbuf for avail waiting bytes. it doubles up to rxbuf_max right
+ * away, and halves back toward the starting size after a run of small reads
+ */
+static void _server_conn_rxbuf_fit(struct tcpc_server_conn *c, size_t avail)
+{
+	size_t sz = c->rxbuf_sz;
+	uint8_t *b;
+
+	/* handoff buffers are all one size */
+	if(c->rxbuf_max <= c->_rxbuf_min || c->_rxq.count)
+		return;
+
+	if(avail > sz) {
+		while(sz < avail && sz < c->rxbuf_max)
+			sz <<= 1;
+		if(sz > c->rxbuf_max)
+			sz = c->rxbuf_max;
+		c->_rxsmall = 0;
+	} else if(avail <= sz / 4) {
+		if(++c->_rxsmall >= TCPC_RXBUF_SHRINK_READS &&
+				sz / 2 >= c->_rxbuf_min) {
+			sz /= 2;
+			c->_rxsmall = 0;
+		}
+	} else {
+		c->_rxsmall = 0;
+	}
+	if(sz == c->rxbuf_sz)
+		return;
+
+	/* a pooled buffer is borrowed, and charged, at the new size */
+	if(!c->_rxpooled) {
+		if(sz > c->rxbuf_sz && tcpc_mem_charge(&c->_mem,
+				sz - c->rxbuf_sz) < 0)
+			return;
+		if((b = (uint8_t *)realloc(c->rxbuf, sz)) == NULL) {
+			if(sz > c->rxbuf_sz)
+				tcpc_mem_uncharge(&c->_mem, sz - c->rxbuf_sz);
+			return;
+		}
+		c->rxbuf = b;
+		if(sz < c->rxbuf_sz)
+			tcpc_mem_uncharge(&c->_mem, c->rxbuf_sz - sz);
+	}
+	c->rxbuf_sz = sz;
+}
+
+/* reads until the socket is drained or rx_budget bytes are read, calling
+ * conn_h with each read. returns -1 once the connection is done
+ */
+static int _server_conn_drain(struct tcpc_server_conn *c)
+{
+	size_t budget = c->_parent->rx_budget;
+	ssize_t l;
+	int avail, first = 1;
+
+	for(;;) {
+		/* what's waiting. a closed peer shows up on the first read */
+		if(ioctl(c->_sock, FIONREAD, &avail) < 0)
+			avail = 0;
+		if(avail <= 0 && !first)
+			return 0;
+		first = 0;
+		_server_conn_rxbuf_fit(c, (size_t)avail);
+
+		if((l = _server_conn_rx(c)) < 0)
+			return -1;
+		if(l == 0)
+			return 0;
+		/* call the connection protothread */
+		if(_server_conn_call(c, l) < 0)
+			return -1;
+
+		if((size_t)l >= budget || !_server_conn_can_read(c))
+			return 0;
+		budget -= (size_t)l;
+	}
+}
+
+/* the rest of closing a connection, once dispatched work is done with it */
+static void _server_conn_finish(struct tcpc_server_conn *c)
+{
+	_tcpc_txq_close(&c->_txq);
+	/* call the close callback */
+	if(c->conn_close_h)
+		(c->conn_close_h)(c);
+	/* close the socket */
+	(c->close_h)(c->_sock);
+	/* remove from the linked list of connections */
+	_tcpc_server_remove_conn(c->_parent, c);
+	/* free the memory */
+	_free_tcpc_server_conn(c);
+}
+
+static void _server_conn_finish_work(struct tcpc_work *w)
+{
+	_server_conn_finish(container_of(w, struct tcpc_server_conn,
+				_closing));
+}
+
+static void _server_conn_cleanup(struct tcpc_server_conn *c)
+{
+	TCPC_PROBE2(server_conn_close, c, c->_sock);
+	/* dispatched work may still use the connection. the pool finishes
+	 * closing it after that work, so an I/O loop doesn't wait on it
+	 */
+	if(c->_strand._pool) {
+		c->_closing.fn = &_server_conn_finish_work;
+		tcpc_strand_close(&c->_strand, &c->_closing);
+		return;
+	}
+	_server_conn_finish(c);
+}
+
+/* moves what it can of one proxied direction without blocking. returns -1
+ * on an error
+ */
+static int _splice_pump(struct tcpc_splice *d, int src, int dst)
+{
+	ssize_t r;
+	int moved;
+
+	do {
+		moved = 0;
+		/* fill the pipe. EAGAIN is an empty socket or a full pipe */
+		if(!d->eof && d->pending < d->size) {
+			r = splice(src, NULL, d->pipe[1], NULL,
+					d->size - d->pending,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(r > 0) {
+				d->pending += (size_t)r;
+				moved = 1;
+			} else if(r == 0) {
+				d->eof = 1;
+			} else if(errno != EAGAIN && errno != EINTR) {
+				return -1;
+			}
+		}
+		/* and drain it */
+		if(d->pending) {
+			r = splice(d->pipe[0], NULL, dst, NULL, d->pending,
+					SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if(r > 0) {
+				d->pending -= (size_t)r;
+				moved = 1;
+			} else if(r < 0 && errno != EAGAIN && errno != EINTR) {
+				return -1;
+			}
+		}
+	} while(moved);
+
+	/* pass a half-close on once everything before it is through */
+	if(d->eof && !d->pending && !d->shut) {
+		shutdown(dst, SHUT_WR);
+		d->shut = 1;
+	}
+
+	return 0;
+}
+
+static inline short _splice_wants_in(struct tcpc_splice *d)
+{
+	return (!d->eof && d->pending < d->size) ? POLLIN : 0;
+}
+
+static inline short _splice_wants_out(struct tcpc_splice *d)
+{
+	return d->pending ? POLLOUT : 0;
+}
+
+/* connects the upstream without holding up the connection thread past
+ * poll_timeout_ms at a time, so closing the connection is still seen
+ */
+static int _proxy_connect(struct tcpc_server_conn *c, struct tcpc_client *up)
+{
+	struct pollfd p;
+	socklen_t len = sizeof(int);
+	int e;
+
+	if(connect(up->_sock, up->serv_addr, up->_sockaddr_size) == 0)
+		return 0;
+	if(errno != EINPROGRESS)
+		return -1;
+
+	p.fd = up->_sock;
+	p.events = POLLOUT;
+	for(;;) {
+		if(c->_end_thread || up->_end_thread) {
+			errno = ECANCELED;
+			return -1;
+		}
+		p.revents = 0;
+		if((e = poll(&p, 1, c->poll_timeout_ms >= 0 ?
+				c->poll_timeout_ms : TCPC_DEFAULT_POLL_TO)) < 0 &&
+				errno != EINTR)
+			return -1;
+		if(e > 0)
+			break;
+	}
+	if(getsockopt(up->_sock, SOL_SOCKET, SO_ERROR, &e, &len) < 0)
+		return -1;
+	if(e) {
+		errno = e;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* proxies a connection on its own thread until both directions are done */
+static void _server_conn_proxy(struct tcpc_server_conn *c)
+{
+	struct tcpc_proxy *px = c->_proxy;
+	struct tcpc_client *up = px->up;
+	struct pollfd fds[3];
+
+	/* the pipes are non-blocking, and so are both ends */
+	if(fcntl(c->_sock, F_SETFL, fcntl(c->_sock, F_GETFL) | O_NONBLOCK)
+			< 0 || fcntl(up->_sock, F_SETFL,
+			fcntl(up->_sock, F_GETFL) | O_NONBLOCK) < 0) {
+		perror("server_conn_proxy");
+		return;
+	}
+	if(_proxy_connect(c, up) < 0) {
+		/* unless it was closed first */
+		if(errno != ECANCELED)
+			perror("server_conn_proxy");
+		return;
+	}
+	up->_state = TCPC_STATE_ACTIVE;
+	TCPC_PROBE2(client_connect, up, up->_sock);
+	_tcpc_busy_poll_sock(up->_sock, c->busy_poll_us);
+
+	fds[0].fd = c->_sock;
+	fds[1].fd = up->_sock;
+	fds[2].fd = c->_txq.wakefd;
+	fds[2].events = POLLIN;
+
+	/* closing either end ends the proxying */
+	while(!c->_end_thread && !up->_end_thread) {
+		if(_splice_pump(&px->dir[0], c->_sock, up->_sock) < 0 ||
+				_splice_pump(&px->dir[1], up->_sock,
+					c->_sock) < 0) {
+			perror("server_conn_proxy");
+			break;
+		}
+		if(px->dir[0].shut && px->dir[1].shut)
+			break;
+
+		/* wait for what the pumps are held up on */
+		fds[0].events = _splice_wants_in(&px->dir[0]) |
+			_splice_wants_out(&px->dir[1]);
+		fds[1].events = _splice_wants_in(&px->dir[1]) |
+			_splice_wants_out(&px->dir[0]);
+		fds[0].revents = 0;
+		fds[1].revents = 0;
+		fds[2].revents = 0;
+		if(_tcpc_poll(fds, 3, c->poll_timeout_ms,
+				c->busy_poll_us) < 0) {
+			perror("server_conn_proxy");
+			continue;
+		}
+		if((fds[0].revents | fds[1].revents) & POLLERR)
+			break;
+		if((fds[0].revents | fds[1].revents) & POLLHUP) {
+			/* a side is gone both ways. what it sent last can
+			 * still be read, pass on what fits now
+			 */
+			_splice_pump(&px->dir[0], c->_sock, up->_sock);
+			_splice_pump(&px->dir[1], up->_sock, c->_sock);
+			break;
+		}
+		if(fds[2].revents & POLLIN)
+			_tcpc_wake_ack(fds[2].fd);
+		if(_server_conn_call(c, 0) < 0)
+			break;
+	}
+}
+
+/* serves the socket of a datagram server, calling conn_h with each
+ * datagram in rxbuf and its sender in conn_addr
+ */
+static void _server_conn_dgram(struct tcpc_server_conn *c)
+{
+	struct tcpc_dgram *d = c->_dgram;
+	uint8_t *buf;
+	size_t len, seg, off;
+	socklen_t alen;
+	int i, n, txblocked = 0;
+
+	c->_poll[0].fd = c->_sock;
+	c->_poll[1].fd = c->_txq.wakefd;
+	c->_poll[1].events = POLLIN;
+	_dgram_self = c;
+
+	while(!c->_end_thread) {
+		c->_poll[0].events = (_server_conn_can_read(c) ? POLLIN : 0) |
+			(txblocked ? POLLOUT : 0);
+		c->_poll[0].revents = 0;
+		c->_poll[1].revents = 0;
+		if(_tcpc_poll(c->_poll, 2, c->poll_timeout_ms,
+				c->busy_poll_us) < 0) {
+			/* error */
+			perror("server_conn_dgram");
+			continue;
+		}
+		if(c->_poll[1].revents & POLLIN)
+			_tcpc_wake_ack(c->_poll[1].fd);
+		n = 0;
+		if((c->_poll[0].revents & POLLIN) &&
+				(n = _dgram_recv(d, c->_sock)) < 0) {
+			perror("server_conn_dgram");
+			break;
+		}
+		for(i = 0; i < n; i++) {
+			alen = d->rx[i].msg_hdr.msg_namelen;
+			if(alen > c->_sockaddr_size)
+				alen = c->_sockaddr_size;
+			memcpy(c->conn_addr, &d->rxaddr[i], alen);
+			d->from = alen;
+			buf = (uint8_t *)d->rxiov[i].iov_base;
+			len = d->rx[i].msg_len;
+			seg = _dgram_seg(d, i);
+			TCPC_PROBE3(server_conn_rx, c, c->_sock, len);
+			for(off = 0; off < len; off += seg) {
+				c->rxbuf = buf + off;
+				if(_server_conn_call(c, (len - off < seg) ?
+						len - off : seg) < 0)
+					goto done;
+			}
+		}
+		c->rxbuf = NULL;
+		if(n == 0 && _server_conn_call(c, 0) < 0)
+			break;
+		/* send what's queued */
+		txblocked = _dgram_flush(d, &c->_txq, c->_sock);
+	}
+
+done:
+	c->rxbuf = NULL;
+	_dgram_self = NULL;
+}
+
+/* serves a connection on its own thread until it closes */
+static void _server_conn_serve(struct tcpc_server_conn *c)
+{
+	int txblocked = 0;
+
+	if(c->_proxy) {
+		_server_conn_proxy(c);
+		_server_conn_cleanup(c);
+		return;
+	}
+	if(c->_dgram) {
+		_server_conn_dgram(c);
+		_server_conn_cleanup(c);
+		return;
+	}
+
+	c->_poll[0].fd = c->_sock;
+	c->_poll[1].fd = c->_txq.wakefd;
+	c->_poll[1].events = POLLIN;
+
+	while(!c->_end_thread) {
+		/* check for data in the socket, room for queued data and
+		 * wakeups from other threads. a peer that's done sending
+		 * only matters once what it sent is read, so a paused
+		 * connection doesn't watch for it
+		 */
+		c->_poll[0].events =
+			(_server_conn_can_read(c) ? POLLIN | POLLRDHUP : 0) |
+			(txblocked ? POLLOUT : 0);
+		c->_poll[0].revents = 0;
+		c->_poll[1].revents = 0;
+		if(_tcpc_poll(c->_poll, 2, c->poll_timeout_ms,
+				c->busy_poll_us) < 0) {
+			/* error */
+			perror("server_conn_thread");
+			continue;
+		}
+		/* handle the revents. after POLLRDHUP the reads below get
+		 * the rest of the data, then the end of it
+		 */
+		if(c->_poll[0].revents & POLLHUP) {
+			/* connection has closed */
+			break;
+		}
+		if(c->_poll[1].revents & POLLIN)
+			_tcpc_wake_ack(c->_poll[1].fd);
+		if(c->_poll[0].revents & POLLIN) {
+			/* data available */
+			if(_server_conn_drain(c) < 0)
+				break;
+		} else if(_server_conn_call(c, 0) < 0) {
+			/* connection thread has ended */
+			break;
+		}
+		/* send what's queued */
+		if((txblocked = _tcpc_txq_flush(&c->_txq, c->_sock, c->tx_h,
+				NULL)) < 0) {
+			perror("server_conn_thread");
+			break;
+		}
+	}
+
+	/* clean up this connection */
+	_server_conn_cleanup(c);
+}
+
+/* connection thread functions */
+static void _deadline(struct timespec *ts, int ms)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += ms / 1000;
+	ts->tv_nsec += (long)(ms % 1000) * 1000000;
+	if(ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static void *conn_worker_routine(void *arg)
+{
+	struct tcpc_conn_worker *w = (struct tcpc_conn_worker *)arg;
+	struct tcpc_server *s = w->_server;
+	struct tcpc_server_conn *c;
+	struct timespec ts;
+	int e = 0;
+
+	pthread_mutex_lock(&s->_workers_mutex);
+	for(;;) {
+		/* wait for a connection. without an idle timeout, forever */
+		if(s->conn_thread_idle_ms > 0)
+			_deadline(&ts, s->conn_thread_idle_ms);
+		while(w->_conn == NULL && !s->_end_workers && e != ETIMEDOUT) {
+			if(s->conn_thread_idle_ms > 0)
+				e = pthread_cond_timedwait(&w->_cond,
+						&s->_workers_mutex, &ts);
+			else
+				pthread_cond_wait(&w->_cond,
+						&s->_workers_mutex);
+		}
+		if(w->_conn == NULL) {
+			if(s->_end_workers || s->_workers > s->conn_threads_min)
+				break;
+			/* one of the warm ones */
+			e = 0;
+			continue;
+		}
+		c = w->_conn;
+		pthread_mutex_unlock(&s->_workers_mutex);
+
+		_server_conn_serve(c);
+
+		/* back to the pool, at the front so its stack is reused
+		 * while still warm
+		 */
+		pthread_mutex_lock(&s->_workers_mutex);
+		w->_conn = NULL;
+		e = 0;
+		list_add(&w->_list, &s->_idle_workers);
+		pthread_cond_broadcast(&s->_workers_cond);
+	}
+
+	/* retire */
+	list_del(&w->_list);
+	s->_workers--;
+	pthread_cond_broadcast(&s->_workers_cond);
+	pthread_mutex_unlock(&s->_workers_mutex);
+	pthread_cond_destroy(&w->_cond);
+	free(w);
+
+	return NULL;
+}
+
+/* starts a connection thread serving c, or an idle one when c is NULL.
+ * call with _workers_mutex held
+ */
+static int _conn_worker_start(struct tcpc_server *s,
+		struct tcpc_server_conn *c)
+{
+	struct tcpc_conn_worker *w;
+	pthread_attr_t attr;
+	pthread_t t;
+	size_t stack_sz = s->conn_stack_size;
+	long stack_min = PTHREAD_STACK_MIN;
+	int e;
+
+	if((w = (struct tcpc_conn_worker *)malloc(
+			sizeof(struct tcpc_conn_worker))) == NULL)
+		return -1;
+	memset(w, 0, sizeof(struct tcpc_conn_worker));
+	w->_server = s;
+	w->_conn = c;
+	pthread_cond_init(&w->_cond, NULL);
+	INIT_LIST_HEAD(&w->_list);
+	if(c == NULL)
+		list_add_tail(&w->_list, &s->_idle_workers);
+	pthread_attr_init(&attr);
+	if(stack_sz) {
+		/* PTHREAD_STACK_MIN can be a sysconf(), -1 when unknown */
+		if(stack_min > 0 && stack_sz < (size_t)stack_min)
+			stack_sz = (size_t)stack_min;
+		pthread_attr_setstacksize(&attr, stack_sz);
+	}
+	e = pthread_create(&t, &attr, &conn_worker_routine, w);
+	pthread_attr_destroy(&attr);
+	if(e != 0) {
+		if(c == NULL)
+			list_del(&w->_list);
+		pthread_cond_destroy(&w->_cond);
+		free(w);
+		return -1;
+	}
+	pthread_detach(t);
+	s->_workers++;
+
+	return 0;
+}
+
+/* hands c to an idle connection thread, or starts a new one. waits while
+ * conn_threads_max are busy. returns -1 if c couldn't be given a thread
+ */
+static int _conn_worker_run(struct tcpc_server *s, struct tcpc_server_conn *c)
+{
+	struct tcpc_conn_worker *w;
+	struct timespec ts;
+	int max = s->conn_threads_max > 0 ? s->conn_threads_max :
+		s->max_connections;
+	int e = 0;
+
+	pthread_mutex_lock(&s->_workers_mutex);
+	while(list_empty(&s->_idle_workers) && s->_workers >= max) {
+		if(s->_end_thread) {
+			pthread_mutex_unlock(&s->_workers_mutex);
+			return -1;
+		}
+		_deadline(&ts, 100);
+		pthread_cond_timedwait(&s->_workers_cond, &s->_workers_mutex,
+				&ts);
+	}
+	if(!list_empty(&s->_idle_workers)) {
+		w = list_entry(s->_idle_workers.next, struct tcpc_conn_worker,
+				_list);
+		list_del(&w->_list);
+		w->_conn = c;
+		pthread_cond_signal(&w->_cond);
+	} else {
+		e = _conn_worker_start(s, c);
+	}
+	pthread_mutex_unlock(&s->_workers_mutex);
+
+	return e;
+}
+
+static int _conn_workers_start(struct tcpc_server *s)
+{
+	int e = 0;
+
+	pthread_mutex_lock(&s->_workers_mutex);
+	s->_end_workers = 0;
+	while(s->_workers < s->conn_threads_min && e == 0)
+		e = _conn_worker_start(s, NULL);
+	pthread_mutex_unlock(&s->_workers_mutex);
+
+	return e;
+}
+
+/* ends the connection threads once they're all idle */
+static void _conn_workers_stop(struct tcpc_server *s)
+{
+	struct tcpc_conn_worker *w;
+
+	pthread_mutex_lock(&s->_workers_mutex);
+	s->_end_workers = 1;
+	while(s->_workers) {
+		list_for_each_entry(w, &s->_idle_workers, _list)
+			pthread_cond_signal(&w->_cond);
+		pthread_cond_wait(&s->_workers_cond, &s->_workers_mutex);
+	}
+	pthread_mutex_unlock(&s->_workers_mutex);
+}
+
+/* I/O loop functions */
+static void _io_loop_watch(struct tcpc_io_loop *lp,
+		struct tcpc_server_conn *c, int op)
+{
+	struct epoll_event ev;
+
+	/* like EPOLLIN, EPOLLRDHUP waits out a pause */
+	ev.events = (c->_rxunwatched ? 0 : EPOLLIN | EPOLLRDHUP) |
+		(c->_txblocked ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if(epoll_ctl(lp->_epfd, op, c->_sock, &ev) < 0)
+		perror("io_loop");
+}
+
+/* takes the connections handed over by the listen thread */
+static void _io_loop_adopt(struct tcpc_io_loop *lp)
+{
+	struct tcpc_server_conn *c, *n;
+	uint8_t *b;
+	LIST_HEAD(adopted);
+
+	pthread_mutex_lock(&lp->_mutex);
+	list_splice_init(&lp->_new, &adopted);
+	pthread_mutex_unlock(&lp->_mutex);
+
+	list_for_each_entry_safe(c, n, &adopted, _loop_list) {
+		list_move_tail(&c->_loop_list, &lp->_conns);
+		/* move rxbuf to the loop's NUMA node. the first touch, from
+		 * this pinned thread, is what places it
+		 */
+		if(lp->_cpu >= 0 && c->rxbuf && !c->_rxpooled &&
+				(b = (uint8_t *)malloc(c->rxbuf_sz)) != NULL) {
+			memset(b, 0, c->rxbuf_sz);
+			free(c->rxbuf);
+			c->rxbuf = b;
+		}
+		if(c->poll_timeout_ms < lp->_timeout)
+			lp->_timeout = c->poll_timeout_ms;
+		_io_loop_watch(lp, c, EPOLL_CTL_ADD);
+	}
+}
+
+/* starts reading again from connections whose consumer released a buffer */
+static void _io_loop_rx_resume(struct tcpc_io_loop *lp)
+{
+	struct tcpc_server_conn *c;
+
+	list_for_each_entry(c, &lp->_conns, _loop_list) {
+		if(c->_rxunwatched && _server_conn_can_read(c)) {
+			c->_rxunwatched = 0;
+			_io_loop_watch(lp, c, EPOLL_CTL_MOD);
+		}
+	}
+}
+
+static void _io_loop_drop(struct tcpc_io_loop *lp, struct tcpc_server_conn *c)
+{
+	epoll_ctl(lp->_epfd, EPOLL_CTL_DEL, c->_sock, NULL);
+	list_del(&c->_loop_list);
+	list_del(&c->_active_list);
+	_server_conn_cleanup(c);
+}
+
+/* deficit round robin over the connections with something to send. each
+ * turn a connection may send up to tx_quantum * tx_weight bytes more
+ */
+static void _io_loop_tx(struct tcpc_io_loop *lp)
+{
+	struct tcpc_server_conn *c, *n;
+	size_t quantum = lp->_server->tx_quantum;
+	int round, r;
+
+	list_for_each_entry(c, &lp->_conns, _loop_list) {
+		if(!c->_txblocked && list_empty(&c->_active_list) &&
+				_tcpc_txq_pending(&c->_txq))
+			list_add_tail(&c->_active_list, &lp->_active);
+	}
+
+	for(round = 0; round < TCPC_LOOP_TX_ROUNDS; round++) {
+		if(list_empty(&lp->_active))
+			return;
+		list_for_each_entry_safe(c, n, &lp->_active, _active_list) {
+			c->_deficit += quantum * c->tx_weight;
+			__atomic_add_fetch(&c->_txq.stats.turns, 1,
+					__ATOMIC_RELAXED);
+			r = _tcpc_txq_flush(&c->_txq, c->_sock, c->tx_h,
+					&c->_deficit);
+			if(r == 2) {
+				/* used its turn, to the back of the line */
+				list_move_tail(&c->_active_list, &lp->_active);
+				continue;
+			}
+			list_del_init(&c->_active_list);
+			if(r == 0) {
+				/* nothing left, no credit saved up */
+				c->_deficit = 0;
+			} else if(r == 1) {
+				/* keep the deficit for when it's writable */
+				c->_txblocked = 1;
+				_io_loop_watch(lp, c, EPOLL_CTL_MOD);
+			} else {
+				perror("io_loop");
+				_io_loop_drop(lp, c);
+			}
+		}
 	}
+}
 
-	return nc;
+/* epoll_wait with the server's busy polling */
+static int _io_loop_wait(struct tcpc_io_loop *lp, struct epoll_event *ev,
+		int timeout_ms)
+{
+	int spin_us = lp->_server->busy_poll_us;
+	uint64_t start, spin_ns;
+	int e;
+
+	if(spin_us == 0 || timeout_ms == 0)
+		return epoll_wait(lp->_epfd, ev, TCPC_LOOP_EVENTS, timeout_ms);
+
+	spin_ns = _spin_ns(spin_us, timeout_ms);
+	start = _now_ns();
+	do {
+		if((e = epoll_wait(lp->_epfd, ev, TCPC_LOOP_EVENTS, 0)) != 0)
+			return e;
+	} while(_now_ns() - start < spin_ns);
+
+	return (spin_us < 0) ? 0 :
+		epoll_wait(lp->_epfd, ev, TCPC_LOOP_EVENTS, timeout_ms);
 }
 
-/* thread functions */
-static void *server_conn_thread_routine(void *arg)
+static void *io_loop_routine(void *arg)
 {
-	struct tcpc_server_conn *c = (struct tcpc_server_conn *)arg;
-	ssize_t l;
+	struct tcpc_io_loop *lp = (struct tcpc_io_loop *)arg;
+	struct epoll_event ev[TCPC_LOOP_EVENTS];
+	struct tcpc_server_conn *c, *n;
+	uint64_t now, tick = 0;
+	int e, i, woken;
 
-	c->_poll.fd = c->_sock;
-	c->_poll.events = POLLRDHUP | POLLIN;
+	while(!lp->_end_thread) {
+		_io_loop_adopt(lp);
+		woken = 0;
 
-	while(!c->_end_thread) {
-		l = 0; /* initialize length to 0 on each loop */
-		/* check for data in the socket */
-		c->_poll.revents = 0;
-		if(poll(&c->_poll, 1, c->poll_timeout_ms) < 0) {
-			/* error */
-			perror("server_conn_thread");
+		/* don't sleep while there's sending left over */
+		e = _io_loop_wait(lp, ev,
+				list_empty(&lp->_active) ? lp->_timeout : 0);
+		if(e < 0) {
+			if(errno != EINTR)
+				perror("io_loop");
 			continue;
 		}
-		/* handle the revents */
-		if(c->_poll.revents & POLLRDHUP) {
-			/* connection has closed */
-			break;
-		}
-		if(c->_poll.revents & POLLIN) {
-			/* data available */
-			if(pthread_mutex_trylock(&c->rxbuf_mutex) == 0) {
-				l=(c->rx_h)(c->_sock, c->rxbuf, c->rxbuf_sz);
-				pthread_mutex_unlock(&c->rxbuf_mutex);
-				if(l == 0) {
-					/* connection closed */
-					break;
-				} else if(l < 0) {
-					/* error */
-					perror("server_conn_thread");
+
+		for(i = 0; i < e; i++) {
+			if(ev[i].data.ptr == NULL) {
+				/* queued messages, _io_loop_tx will see them,
+				 * or released receive buffers
+				 */
+				_tcpc_wake_ack(lp->_wakefd);
+				woken = 1;
+				continue;
+			}
+			c = (struct tcpc_server_conn *)ev[i].data.ptr;
+			if(ev[i].events & (EPOLLHUP | EPOLLERR)) {
+				/* connection has closed */
+				_io_loop_drop(lp, c);
+				continue;
+			}
+			/* the peer is done sending. EPOLLIN comes with it,
+			 * and reading gets the rest, then the end
+			 */
+			if(ev[i].events & EPOLLRDHUP)
+				ev[i].events |= EPOLLIN;
+			if(ev[i].events & EPOLLOUT) {
+				c->_txblocked = 0;
+				_io_loop_watch(lp, c, EPOLL_CTL_MOD);
+			}
+			if(ev[i].events & EPOLLIN) {
+				if(!_server_conn_can_read(c)) {
+					/* until the consumer catches up */
+					c->_rxunwatched = 1;
+					_io_loop_watch(lp, c, EPOLL_CTL_MOD);
 					continue;
 				}
+				if(_server_conn_drain(c) < 0)
+					_io_loop_drop(lp, c);
 			}
 		}
-		/* call the connection protothread */
-		if(c->conn_h) {
-			if((c->conn_h)(c, (size_t)l) == PT_ENDED) {
-				/* connection thread has ended */
-				break;
+
+		/* call every connection protothread once per timeout */
+		now = _now_ns();
+		if(now - tick >= (uint64_t)lp->_timeout * 1000000) {
+			tick = now;
+			woken = 1;
+			list_for_each_entry_safe(c, n, &lp->_conns,
+					_loop_list) {
+				if(c->_end_thread || _server_conn_call(c, 0) < 0)
+					_io_loop_drop(lp, c);
 			}
 		}
-	}
 
-	/* clean up this connection */
-	/* call the close callback */
-	if(c->conn_close_h)
-		(c->conn_close_h)(c);
-	/* close the socket */
-	close(c->_sock);
-	/* remove from the linked list of connections */
-	_tcpc_server_remove_conn(c->_parent, c);
-	/* free the memory */
-	_free_tcpc_server_conn(c);
+		if(woken)
+			_io_loop_rx_resume(lp);
+		_io_loop_tx(lp);
+	}
 
+	/* the listen thread has closed all the connections */
 	return NULL;
 }
 
+static void _io_loops_stop(struct tcpc_server *s, int count)
+{
+	int i;
+
+	for(i = 0; i < count; i++) {
+		s->_loops[i]._end_thread = 1;
+		pthread_join(s->_loops[i]._thread, NULL);
+		close(s->_loops[i]._epfd);
+		close(s->_loops[i]._wakefd);
+		pthread_mutex_destroy(&s->_loops[i]._mutex);
+	}
+	free(s->_loops);
+	s->_loops = NULL;
+}
+
+static int _io_loops_start(struct tcpc_server *s)
+{
+	struct tcpc_io_loop *lp;
+	struct epoll_event ev;
+	cpu_set_t cpus;
+	int i;
+
+	s->_loops = (struct tcpc_io_loop *)calloc(s->io_threads,
+			sizeof(struct tcpc_io_loop));
+	if(s->_loops == NULL)
+		return -1;
+	for(i = 0; i < s->io_threads; i++) {
+		lp = &s->_loops[i];
+		lp->_server = s;
+		lp->_timeout = TCPC_DEFAULT_POLL_TO;
+		INIT_LIST_HEAD(&lp->_new);
+		INIT_LIST_HEAD(&lp->_conns);
+		INIT_LIST_HEAD(&lp->_active);
+		pthread_mutex_init(&lp->_mutex, NULL);
+		if((lp->_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+			pthread_mutex_destroy(&lp->_mutex);
+			_io_loops_stop(s, i);
+			return -1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if((lp->_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+				epoll_ctl(lp->_epfd, EPOLL_CTL_ADD,
+					lp->_wakefd, &ev) < 0) {
+			if(lp->_wakefd >= 0)
+				close(lp->_wakefd);
+			close(lp->_epfd);
+			pthread_mutex_destroy(&lp->_mutex);
+			_io_loops_stop(s, i);
+			return -1;
+		}
+		/* one CPU per loop */
+		lp->_cpu = s->loop_cpus ? _tcpc_nth_cpu(s->loop_cpus, i) : -1;
+		CPU_ZERO(&cpus);
+		if(lp->_cpu >= 0)
+			CPU_SET(lp->_cpu, &cpus);
+		if(_tcpc_thread_create(&lp->_thread,
+				lp->_cpu >= 0 ? &cpus : NULL,
+				&io_loop_routine, lp) != 0) {
+			close(lp->_wakefd);
+			close(lp->_epfd);
+			pthread_mutex_destroy(&lp->_mutex);
+			_io_loops_stop(s, i);
+			return -1;
+		}
+	}
+	s->_next_loop = 0;
+
+	return 0;
+}
+
+/* the loop on the CPU the connection's packets arrive on, when the loops
+ * are pinned, or else the next one
+ */
+static struct tcpc_io_loop *_io_loop_pick(struct tcpc_server *s,
+		struct tcpc_server_conn *c)
+{
+	struct tcpc_io_loop *lp;
+#ifdef SO_INCOMING_CPU
+	socklen_t len = sizeof(int);
+	int i, cpu;
+
+	if(s->loop_cpus && getsockopt(c->_sock, SOL_SOCKET, SO_INCOMING_CPU,
+			&cpu, &len) == 0) {
+		for(i = 0; i < s->io_threads; i++) {
+			if(s->_loops[i]._cpu == cpu)
+				return &s->_loops[i];
+		}
+	}
+#endif
+	lp = &s->_loops[s->_next_loop];
+	s->_next_loop = (s->_next_loop + 1) % s->io_threads;
+
+	return lp;
+}
+
+/* admission control */
+/* refills the accept_rate bucket. returns 0 when there's a token for an
+ * accept, or else the ms until there is one
+ */
+static int _accept_wait(struct tcpc_server *s)
+{
+	uint64_t now;
+	double burst;
+
+	if(s->accept_rate <= 0)
+		return 0;
+	burst = (s->accept_burst > 0) ? s->accept_burst : 1;
+	now = _now_ns();
+	s->_tokens += (double)(now - s->_tokens_ns) * s->accept_rate / 1e9;
+	s->_tokens_ns = now;
+	if(s->_tokens > burst)
+		s->_tokens = burst;
+	if(s->_tokens >= 1)
+		return 0;
+
+	return (int)((1 - s->_tokens) * 1000 / s->accept_rate) + 1;
+}
+
+/* accepts a connection only to turn it away with reject_msg and a reset */
+static void _listen_reject(struct tcpc_server *s)
+{
+	struct linger lg = { 1, 0 };
+	int sock;
+
+	if((sock = accept(s->_sock, NULL, NULL)) < 0) {
+		perror("listen_thread");
+		return;
+	}
+	if(s->reject_len)
+		send(sock, s->reject_msg, s->reject_len,
+				MSG_DONTWAIT | MSG_NOSIGNAL);
+	/* linger 0 makes the close a reset, no TIME_WAIT left behind */
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	close(sock);
+	__atomic_add_fetch(&s->_rejected, 1, __ATOMIC_RELAXED);
+	TCPC_PROBE2(server_conn_reject, sock, s->_rejected);
+}
+
+/* runs a new connection on a connection thread */
+static void _listen_conn_thread(struct tcpc_server *s,
+		struct tcpc_server_conn *nc)
+{
+	int e;
+
+	if((e = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		perror("listen_thread");
+	__atomic_store_n(&nc->_txq.wakefd, e, __ATOMIC_RELEASE);
+	if(_conn_worker_run(s, nc) < 0) {
+		perror("listen_thread");
+		if(nc->conn_close_h)
+			(nc->conn_close_h)(nc);
+		(nc->close_h)(nc->_sock);
+		_tcpc_server_remove_conn(nc->_parent, nc);
+		_free_tcpc_server_conn(nc);
+	}
+}
+
 static void *listen_thread_routine(void *arg)
 {
 	struct tcpc_server *s = (struct tcpc_server *)arg;
 	struct tcpc_server_conn *nc;
-	int e;
+	struct tcpc_io_loop *lp;
+	uint64_t one = 1;
+	int e, full, wait;
+
+	/* a datagram server has the one connection, for its socket. it runs
+	 * on a connection thread even with I/O loops
+	 */
+	if(s->sock_type == SOCK_DGRAM && (nc = _setup_server_conn(s)) != NULL)
+		_listen_conn_thread(s, nc);
 
 	while(!s->_end_thread) {
-		e = poll(&s->_poll, 1, 100);
+		/* stop watching the socket while full or out of tokens, so
+		 * waiting connections stay in the backlog
+		 */
+		full = s->_conn_count >= s->max_connections;
+		wait = _accept_wait(s);
+		s->_poll[0].fd = ((full && !s->overload_reject) || wait ||
+				s->sock_type == SOCK_DGRAM) ? -1 : s->_sock;
+		e = poll(s->_poll, 2, (wait && wait < 100) ? wait : 100);
 		if(e == 0) {
 			/* nothing to do */
 			continue;
@@ -226,23 +2163,35 @@ static void *listen_thread_routine(void *arg)
 			perror("listen_thread");
 			continue;
 		} else {
+			if(s->_poll[1].revents & POLLIN)
+				_tcpc_wake_ack(s->_poll[1].fd);
+			if(!(s->_poll[0].revents & POLLIN))
+				continue;
 			/* client is trying to connect */
-			if(s->_conn_count >= s->max_connections)
+			if(s->accept_rate > 0)
+				s->_tokens -= 1;
+			if(full) {
+				_listen_reject(s);
 				continue;
+			}
 			if((nc = _setup_server_conn(s)) == NULL)
 				continue;
-			/* start the connection thread */
-			if(pthread_create(&nc->_server_conn_thread, NULL, 
-					&server_conn_thread_routine, nc) != 0) {
-				perror("listen_thread");
-				if(nc->conn_close_h)
-					(nc->conn_close_h)(nc);
-				close(nc->_sock);
-				_tcpc_server_remove_conn(nc->_parent, nc);
-				_free_tcpc_server_conn(nc);
+			if(s->_loops && nc->_proxy == NULL) {
+				/* hand it to an I/O loop */
+				lp = _io_loop_pick(s, nc);
+				nc->_loop = lp;
+				__atomic_store_n(&nc->_txq.wakefd,
+						lp->_wakefd, __ATOMIC_RELEASE);
+				pthread_mutex_lock(&lp->_mutex);
+				list_add_tail(&nc->_loop_list, &lp->_new);
+				pthread_mutex_unlock(&lp->_mutex);
+				/* so it's adopted now, not on the timeout */
+				if(write(lp->_wakefd, &one, sizeof(one)) < 0)
+					perror("listen_thread");
 				continue;
 			}
-			pthread_detach(nc->_server_conn_thread);
+			/* hand it to a connection thread */
+			_listen_conn_thread(s, nc);
 		}
 	}
 
@@ -257,64 +2206,169 @@ static void *listen_thread_routine(void *arg)
 	}
 	pthread_mutex_unlock(&s->_conn_ll_mutex);
 
+	/* then the I/O loops and connection threads. proxied connections
+	 * and datagrams run on connection threads even with I/O loops
+	 */
+	if(s->_loops)
+		_io_loops_stop(s, s->io_threads);
+	_conn_workers_stop(s);
+	_rxpool_drain(s);
+
 	s->_state = TCPC_STATE_INACTIVE;
 
 	return NULL;
 }
 
+/* the client thread of a datagram client, calling conn_h with each
+ * datagram in rxbuf
+ */
+static void _client_dgram(struct tcpc_client *c)
+{
+	struct tcpc_dgram *d = c->_dgram;
+	uint8_t *rxbuf = c->rxbuf, *buf;
+	size_t len, seg, off;
+	int i, n, txblocked = 0;
+
+	while(!c->_end_thread) {
+		c->_poll[0].events = POLLIN | (txblocked ? POLLOUT : 0);
+		c->_poll[0].revents = 0;
+		c->_poll[1].revents = 0;
+		if(_tcpc_poll(c->_poll, 2, c->poll_timeout_ms,
+				c->busy_poll_us) < 0) {
+			/* error */
+			perror("client_dgram");
+			continue;
+		}
+		if(c->_poll[1].revents & POLLIN)
+			_tcpc_wake_ack(c->_poll[1].fd);
+		n = 0;
+		if((c->_poll[0].revents & POLLIN) &&
+				(n = _dgram_recv(d, c->_sock)) < 0) {
+			perror("client_dgram");
+			break;
+		}
+		for(i = 0; i < n; i++) {
+			len = d->rx[i].msg_len;
+			seg = _dgram_seg(d, i);
+			TCPC_PROBE3(client_rx, c, c->_sock, len);
+			buf = (uint8_t *)d->rxiov[i].iov_base;
+			for(off = 0; off < len; off += seg) {
+				c->rxbuf = buf + off;
+				if(c->conn_h && (c->conn_h)(c,
+						(len - off < seg) ? len - off :
+						seg) == PT_ENDED)
+					goto done;
+			}
+		}
+		c->rxbuf = rxbuf;
+		if(n == 0 && c->conn_h && (c->conn_h)(c, 0) == PT_ENDED)
+			break;
+		/* send what's queued */
+		txblocked = _dgram_flush(d, &c->_txq, c->_sock);
+	}
+
+done:
+	c->rxbuf = rxbuf;
+}
+
 static void *client_thread_routine(void *arg)
 {
 	struct tcpc_client *c = (struct tcpc_client *)arg;
+	struct tcpc_rxbuf *b;
 	ssize_t l;
+	int txblocked = 0;
+
+	c->_poll[1].fd = c->_txq.wakefd;
+	c->_poll[1].events = POLLIN;
 
-	c->_poll.events = POLLRDHUP | POLLIN;
+	if(c->_dgram) {
+		_client_dgram(c);
+		goto done;
+	}
 
 	while(!c->_end_thread) {
 		l = 0; /* initialize length to 0 on each loop */
-		/* check for data in the socket */
-		c->_poll.revents = 0;
-		if(poll(&c->_poll, 1, c->poll_timeout_ms) < 0) {
+		/* check for data in the socket, room for queued data and
+		 * wakeups from other threads. like a server connection, a
+		 * paused client doesn't watch for the peer being done
+		 */
+		c->_poll[0].events =
+			(_tcpc_rxq_can_read(&c->_rxq) ? POLLIN | POLLRDHUP : 0) |
+			(txblocked ? POLLOUT : 0);
+		c->_poll[0].revents = 0;
+		c->_poll[1].revents = 0;
+		if(_tcpc_poll(c->_poll, 2, c->poll_timeout_ms,
+				c->busy_poll_us) < 0) {
 			/* error */
 			perror("client_thread");
 			continue;
 		}
-		/* handle the revents */
-		if(c->_poll.revents & POLLRDHUP) {
+		/* handle the revents. after POLLRDHUP the reads below get
+		 * the rest of the data, then the end of it
+		 */
+		if(c->_poll[0].revents & POLLHUP) {
 			/* connection has closed */
 			break;
 		}
-		if(c->_poll.revents & POLLIN) {
+		if(c->_poll[1].revents & POLLIN)
+			_tcpc_wake_ack(c->_poll[1].fd);
+		if(c->_poll[0].revents & POLLIN) {
 			/* data available */
-			if(pthread_mutex_trylock(&c->rxbuf_mutex) == 0) {
-				l=(c->rx_h)(c->_sock, c->rxbuf, c->_rxbuf_sz);
-				pthread_mutex_unlock(&c->rxbuf_mutex);
-				if(l == 0) {
-					/* connection closed */
-					break;
-				} else if(l < 0) {
-					/* error */
+			b = c->_rxq.count ? _tcpc_rxq_get(&c->_rxq) : NULL;
+			l=(c->rx_h)(c->_sock, b ? b->data : c->rxbuf,
+					c->_rxbuf_sz);
+			if(b)
+				_tcpc_rxq_fill(&c->_rxq, b, l);
+			TCPC_PROBE3(client_rx, c, c->_sock, l);
+			if(l == 0) {
+				/* connection closed */
+				break;
+			} else if(l < 0) {
+				/* error. a wakeup with nothing to read goes
+				 * on to the sending
+				 */
+				if(errno != EAGAIN) {
 					perror("client_thread");
 					continue;
 				}
+				l = 0;
 			}
 		}
 		/* call the connection protothread */
 		if(c->conn_h) {
-			if((c->conn_h)(c, (size_t)l) == PT_ENDED) {
+			int r;
+			TCPC_PROBE2(client_h_entry, c, l);
+			r = (c->conn_h)(c, (size_t)l);
+			TCPC_PROBE2(client_h_return, c, r);
+			if(r == PT_ENDED) {
 				break;
 			}
 		}
+		/* send what's queued */
+		if((txblocked = _tcpc_txq_flush(&c->_txq, c->_sock, c->tx_h,
+				NULL)) < 0) {
+			perror("client_thread");
+			break;
+		}
 	}
 
+done:
 	/* clean up this connection */
+	TCPC_PROBE2(client_close, c, c->_sock);
+	_tcpc_txq_close(&c->_txq);
+	_dgram_free(c->_dgram);
+	c->_dgram = NULL;
+	close(c->_txq.wakefd);
+	c->_txq.wakefd = -1;
 	/* close the socket */
-	close(c->_sock);
+	(c->close_h)(c->_sock);
 	c->_sock = -1;
-	c->_poll.fd = -1;
+	c->_poll[0].fd = -1;
 
 	/* call the close callback */
 	if(c->conn_close_h)
 		(c->conn_close_h)(c);
+	_tcpc_rxq_free(&c->_rxq);
 
 	/* since everything is cleaned up, we can set our state to inactive */
 	c->_state = TCPC_STATE_INACTIVE;
@@ -324,6 +2378,76 @@ static void *client_thread_routine(void *arg)
 
 
 /* API FUNCTIONS */
+/* OUTBOUND QUEUE */
+struct tcpc_txmsg *tcpc_txmsg_alloc(size_t size)
+{
+	struct tcpc_txmsg *m;
+
+	if((m = (struct tcpc_txmsg *)malloc(sizeof(struct tcpc_txmsg)))
+			== NULL)
+		return NULL;
+	m->len = 0;
+	m->off = 0;
+	m->cap = size;
+	m->data = NULL;
+	m->_mem = NULL;
+	m->_charged = 0;
+	m->_to = NULL;
+	m->_tolen = 0;
+	if(size && (m->data = (uint8_t *)malloc(size)) == NULL) {
+		free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+ssize_t tcpc_txmsg_append(const void *buf, size_t len, void *msg)
+{
+	struct tcpc_txmsg *m = (struct tcpc_txmsg *)msg;
+	uint8_t *d;
+	size_t cap;
+
+	if(m->len + len > m->cap) {
+		cap = m->cap ? m->cap * 2 : 256;
+		while(cap < m->len + len)
+			cap *= 2;
+		if((d = (uint8_t *)realloc(m->data, cap)) == NULL)
+			return -1;
+		m->data = d;
+		m->cap = cap;
+	}
+	memcpy(m->data + m->len, buf, len);
+	m->len += len;
+
+	return (ssize_t)len;
+}
+
+int tcpc_txmsg_to(struct tcpc_txmsg *m, const struct sockaddr *addr,
+		socklen_t len)
+{
+	struct sockaddr *to;
+
+	if((to = (struct sockaddr *)malloc(len)) == NULL)
+		return -1;
+	memcpy(to, addr, len);
+	free(m->_to);
+	m->_to = to;
+	m->_tolen = len;
+
+	return 0;
+}
+
+void tcpc_txmsg_free(struct tcpc_txmsg *m)
+{
+	if(m == NULL)
+		return;
+	tcpc_mem_uncharge(m->_mem, m->_charged);
+	free(m->_to);
+	free(m->data);
+	free(m);
+}
+
 /* SERVER FRAMEWORK */
 int tcpc_init_server(struct tcpc_server *s, socklen_t sockaddr_size,
 		void (*new_conn_h)(struct tcpc_server_conn *))
@@ -345,15 +2469,48 @@ int tcpc_init_server(struct tcpc_server *s, socklen_t sockaddr_size,
 
 	/* init the mutexes */
 	pthread_mutex_init(&s->_conn_ll_mutex, NULL);
+	pthread_mutex_init(&s->_workers_mutex, NULL);
+	pthread_cond_init(&s->_workers_cond, NULL);
+	INIT_LIST_HEAD(&s->_idle_workers);
+	pthread_mutex_init(&s->_rxpool_mutex, NULL);
 
 	/* set the default configurations */
 	s->max_connections = 100;
 	s->listen_backlog = 10;
+	s->io_threads = 0;
+	s->tx_quantum = TCPC_DEFAULT_TX_QUANTUM;
+	s->busy_poll_us = 0;
+	s->overload_reject = 0;
+	s->reject_msg = NULL;
+	s->reject_len = 0;
+	s->accept_rate = 0;
+	s->accept_burst = 0;
+	s->listen_cpus = NULL;
+	s->loop_cpus = NULL;
+	s->conn_threads_min = 0;
+	s->conn_threads_max = 0;
+	s->conn_thread_idle_ms = TCPC_DEFAULT_THREAD_IDLE;
+	s->conn_stack_size = 0;
+	s->rxbuf_pooled = 0;
+	s->rxbuf_pool_max = TCPC_DEFAULT_RXBUF_POOL;
+	s->rx_budget = TCPC_DEFAULT_RX_BUDGET;
+	s->rxbuf_max = 0;
+	s->mem_limit = 0;
+	s->conn_mem_limit = 0;
+	s->mem_shed = 0;
+	s->sock_type = SOCK_STREAM;
+	s->dgram_batch = TCPC_DEFAULT_DGRAM_BATCH;
+	tcpc_mem_init(&s->_mem, NULL, 0);
+	s->_mem.over_h = &_server_mem_over;
+	s->_mem.priv = s;
 
 	/* setup the poll */
-	s->_poll.fd = -1;
-	s->_poll.events = POLLIN;
-	s->_poll.revents = 0;
+	s->_poll[0].fd = -1;
+	s->_poll[0].events = POLLIN;
+	s->_poll[0].revents = 0;
+	s->_poll[1].fd = -1;
+	s->_poll[1].events = POLLIN;
+	s->_poll[1].revents = 0;
 
 	/* set the callback */
 	s->new_conn_h = new_conn_h;
@@ -363,13 +2520,13 @@ int tcpc_init_server(struct tcpc_server *s, socklen_t sockaddr_size,
 
 int tcpc_open_server(struct tcpc_server *s)
 {
-	int sock = socket(s->serv_addr->sa_family, SOCK_STREAM, 0);
+	int sock = socket(s->serv_addr->sa_family, s->sock_type, 0);
 	if(sock < 0) {
 		perror("tcpc_open_server");
 		return -1;
 	}
 	s->_sock = sock;
-	s->_poll.fd = sock;
+	s->_poll[0].fd = sock;
 
 	return 0;
 }
@@ -387,17 +2544,46 @@ int tcpc_start_server(struct tcpc_server *s)
 		return -2;
 	}
 
-	/* set socket to listen for connections */
-	if(listen(s->_sock,s->listen_backlog) < 0) {
+	/* set socket to listen for connections. datagrams just arrive */
+	if(s->sock_type != SOCK_DGRAM &&
+			listen(s->_sock,s->listen_backlog) < 0) {
 		perror("tcpc_start_server");
 		return -3;
 	}
 
-	/* start the main listen thread */
+	/* start the I/O loops */
+	if(s->io_threads > 0 && _io_loops_start(s) < 0) {
+		perror("tcpc_start_server");
+		return -5;
+	}
+
+	/* or warm up the connection threads */
+	if(s->io_threads <= 0 && _conn_workers_start(s) < 0) {
+		perror("tcpc_start_server");
+		_conn_workers_stop(s);
+		return -6;
+	}
+
+	/* the budget is set by now */
+	s->_mem.limit = s->mem_limit;
+
+	/* start the main listen thread, full accept bucket */
+	s->_tokens = (s->accept_burst > 0) ? s->accept_burst : 1;
+	s->_tokens_ns = _now_ns();
 	s->_state = TCPC_STATE_ACTIVE;
-	if(pthread_create(&s->_listen_thread, NULL, &listen_thread_routine, s)
-			!= 0) {
+	if((s->_poll[1].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+			_tcpc_thread_create(&s->_listen_thread,
+				s->listen_cpus, &listen_thread_routine,
+				s) != 0) {
 		perror("tcpc_start_server");
+		if(s->_poll[1].fd >= 0)
+			close(s->_poll[1].fd);
+		s->_poll[1].fd = -1;
+		s->_state = TCPC_STATE_INACTIVE;
+		if(s->_loops)
+			_io_loops_stop(s, s->io_threads);
+		else
+			_conn_workers_stop(s);
 		return -4;
 	}
 
@@ -411,9 +2597,170 @@ void tcpc_close_server(struct tcpc_server *s)
 	 */
 	s->_end_thread = 1;
 	pthread_join(s->_listen_thread, NULL);
+	close(s->_poll[1].fd);
+	s->_poll[1].fd = -1;
 	close(s->_sock);
 	s->_sock = -1;
-	s->_poll.fd = -1;
+	s->_poll[0].fd = -1;
+}
+
+int tcpc_server_queue_msg(struct tcpc_server_conn *c, struct tcpc_txmsg *m,
+		int tx_class)
+{
+	/* a datagram answers the one being handled. other threads can't
+	 * tell which that is, they must say where it goes
+	 */
+	if(c->_dgram && m->_to == NULL) {
+		if(_dgram_self != c) {
+			tcpc_txmsg_free(m);
+			errno = EDESTADDRREQ;
+			return -1;
+		}
+		if(c->_dgram->from && tcpc_txmsg_to(m, c->conn_addr,
+				c->_dgram->from) < 0) {
+			tcpc_txmsg_free(m);
+			return -1;
+		}
+	}
+	return _tcpc_txq_put(&c->_txq, m, tx_class);
+}
+
+int tcpc_server_queue(struct tcpc_server_conn *c, const void *buf, size_t len,
+		int tx_class)
+{
+	struct tcpc_txmsg *m;
+
+	if((m = tcpc_txmsg_alloc(len)) == NULL)
+		return -1;
+	tcpc_txmsg_append(buf, len, m);
+	return tcpc_server_queue_msg(c, m, tx_class);
+}
+
+struct tcpc_rxbuf *tcpc_server_conn_rx_take(struct tcpc_server_conn *c)
+{
+	return (struct tcpc_rxbuf *)spsc_pop(&c->_rxq.filled);
+}
+
+void tcpc_server_conn_rx_release(struct tcpc_server_conn *c,
+		struct tcpc_rxbuf *b)
+{
+	size_t len = b->len;
+
+	_tcpc_rxq_release(&c->_rxq, b,
+			__atomic_load_n(&c->_txq.wakefd, __ATOMIC_ACQUIRE));
+	if(c->rx_high)
+		tcpc_server_conn_rx_consumed(c, len);
+}
+
+void tcpc_server_conn_rx_consumed(struct tcpc_server_conn *c, size_t len)
+{
+	uint64_t one = 1;
+	int fd;
+
+	/* wake a paused connection once it's down to rx_low */
+	if(__atomic_sub_fetch(&c->_rxheld, len, __ATOMIC_SEQ_CST) <=
+			c->rx_low &&
+			__atomic_load_n(&c->_rxpaused, __ATOMIC_SEQ_CST) &&
+			(fd = __atomic_load_n(&c->_txq.wakefd,
+				__ATOMIC_ACQUIRE)) >= 0 &&
+			write(fd, &one, sizeof(one)) < 0)
+		perror("tcpc_server_conn_rx_consumed");
+}
+
+int tcpc_conn_submit(struct tcpc_server_conn *c, const void *buf, size_t len)
+{
+	return tcpc_server_queue(c, buf, len, TCPC_TX_CLASS_DEFAULT);
+}
+
+int tcpc_server_conn_dispatch(struct tcpc_server_conn *c,
+		struct tcpc_work *w)
+{
+	if(c->_strand._pool == NULL)
+		return -1;
+
+	return tcpc_strand_post(&c->_strand, w);
+}
+
+int tcpc_server_conn_proxy(struct tcpc_server_conn *c, struct tcpc_client *up)
+{
+	struct tcpc_proxy *px;
+	int i, sz;
+
+	if(up->_sock < 0 || c->_proxy)
+		return -1;
+	if(tcpc_mem_charge(&c->_mem, sizeof(struct tcpc_proxy)) < 0)
+		return -1;
+	if((px = (struct tcpc_proxy *)calloc(1, sizeof(struct tcpc_proxy)))
+			== NULL) {
+		tcpc_mem_uncharge(&c->_mem, sizeof(struct tcpc_proxy));
+		perror("tcpc_server_conn_proxy");
+		return -1;
+	}
+	px->up = up;
+	for(i = 0; i < 2; i++)
+		px->dir[i].pipe[0] = px->dir[i].pipe[1] = -1;
+	for(i = 0; i < 2; i++) {
+		if(pipe2(px->dir[i].pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+			perror("tcpc_server_conn_proxy");
+			for(i = 0; i < 2; i++) {
+				if(px->dir[i].pipe[0] >= 0) {
+					close(px->dir[i].pipe[0]);
+					close(px->dir[i].pipe[1]);
+				}
+			}
+			free(px);
+			tcpc_mem_uncharge(&c->_mem,
+					sizeof(struct tcpc_proxy));
+			return -1;
+		}
+		/* the kernel may round it, or refuse */
+		sz = fcntl(px->dir[i].pipe[1], F_SETPIPE_SZ,
+				TCPC_PROXY_PIPE_SZ);
+		if(sz <= 0)
+			sz = fcntl(px->dir[i].pipe[1], F_GETPIPE_SZ);
+		px->dir[i].size = (sz > 0) ? (size_t)sz : TCPC_PROXY_PIPE_SZ;
+	}
+	c->_proxy = px;
+
+	return 0;
+}
+
+void tcpc_server_conn_tx_stats(struct tcpc_server_conn *c,
+		struct tcpc_tx_stats *st)
+{
+	/* only the connection thread writes them, but it may be at it */
+	st->msgs = __atomic_load_n(&c->_txq.stats.msgs, __ATOMIC_RELAXED);
+	st->bytes = __atomic_load_n(&c->_txq.stats.bytes, __ATOMIC_RELAXED);
+	st->delay_ns_total = __atomic_load_n(&c->_txq.stats.delay_ns_total,
+			__ATOMIC_RELAXED);
+	st->delay_ns_max = __atomic_load_n(&c->_txq.stats.delay_ns_max,
+			__ATOMIC_RELAXED);
+	st->turns = __atomic_load_n(&c->_txq.stats.turns, __ATOMIC_RELAXED);
+}
+
+double tcpc_server_tx_fairness(struct tcpc_server *s)
+{
+	struct tcpc_server_conn *c;
+	double x, sum = 0, sumsq = 0;
+	uint64_t bytes;
+	int n = 0;
+
+	pthread_mutex_lock(&s->_conn_ll_mutex);
+	for(c = s->_conns_ll; c; c = c->_next) {
+		/* the connection and I/O loop threads keep counting */
+		if((bytes = __atomic_load_n(&c->_txq.stats.bytes,
+				__ATOMIC_RELAXED)) == 0)
+			continue;
+		x = (double)bytes / (c->tx_weight ? c->tx_weight : 1);
+		sum += x;
+		sumsq += x * x;
+		n++;
+	}
+	pthread_mutex_unlock(&s->_conn_ll_mutex);
+
+	if(n == 0)
+		return 1.0;
+	return (sum * sum) / (n * sumsq);
 }
 
 /* CLIENT FRAMEWORK */
@@ -438,15 +2785,16 @@ int tcpc_init_client(struct tcpc_client *c, socklen_t sockaddr_size,
 	c->_sock = -1;
 
 	/* setup the poll */
-	c->_poll.fd = -1;
-	c->_poll.events = POLLIN;
-	c->_poll.revents = 0;
+	c->_poll[0].fd = -1;
+	c->_poll[0].events = POLLIN;
+	c->_poll[0].revents = 0;
 
 	/* set the default poll timeout */
 	c->poll_timeout_ms = TCPC_DEFAULT_POLL_TO;
 
-	/* init the rxbuf mutex */
-	pthread_mutex_init(&c->rxbuf_mutex, NULL);
+	/* setup the outbound queue. it opens with the connection */
+	_tcpc_txq_init(&c->_txq);
+	c->_txq.closed = 1;
 
 	/* allocate the receive buffer */
 	if((c->rxbuf = (uint8_t *)malloc(rxbuf_sz)) == NULL) {
@@ -460,6 +2808,11 @@ int tcpc_init_client(struct tcpc_client *c, socklen_t sockaddr_size,
 	c->rx_h = &_tcpc_rx_handler;
 	/* set the default tx handler */
 	c->tx_h = &_tcpc_tx_handler;
+	c->close_h = &_tcpc_close_handler;
+
+	/* a stream client by default */
+	c->sock_type = SOCK_STREAM;
+	c->dgram_batch = TCPC_DEFAULT_DGRAM_BATCH;
 
 	/* set the callbacks */
 	c->conn_h = conn_h;
@@ -470,13 +2823,13 @@ int tcpc_init_client(struct tcpc_client *c, socklen_t sockaddr_size,
 
 int tcpc_open_client(struct tcpc_client *c)
 {
-	int sock = socket(c->serv_addr->sa_family, SOCK_STREAM, 0);
+	int sock = socket(c->serv_addr->sa_family, c->sock_type, 0);
 	if(sock < 0) {
 		perror("tcpc_open_client");
 		return -1;
 	}
 	c->_sock = sock;
-	c->_poll.fd = sock;
+	c->_poll[0].fd = sock;
 
 	return 0;
 }
@@ -506,11 +2859,47 @@ int tcpc_start_client(struct tcpc_client *c)
 		return -2;
 	}
 
+	TCPC_PROBE2(client_connect, c, c->_sock);
+	_tcpc_busy_poll_sock(c->_sock, c->busy_poll_us);
+	if(c->connect_h && (c->connect_h)(c) < 0)
+		return -2;
+
+	/* hand off receive buffers, or read datagrams in batches */
+	if(c->sock_type == SOCK_DGRAM) {
+		if((c->_dgram = _dgram_alloc(c->_sock, c->dgram_batch,
+				c->_rxbuf_sz)) == NULL) {
+			perror("tcpc_start_client");
+			return -3;
+		}
+	} else if(c->rx_handoff > 0 && _tcpc_rxq_init(&c->_rxq,
+			c->rx_handoff, c->_rxbuf_sz) < 0) {
+		perror("tcpc_start_client");
+		return -3;
+	}
+
+	/* start taking outbound messages */
+	if((c->_txq.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("tcpc_start_client");
+		_tcpc_rxq_free(&c->_rxq);
+		_dgram_free(c->_dgram);
+		c->_dgram = NULL;
+		return -3;
+	}
+	c->_txq.wake = 0;
+	__atomic_store_n(&c->_txq.closed, 0, __ATOMIC_SEQ_CST);
+
 	/* start the client thread */
 	c->_state = TCPC_STATE_ACTIVE;
-	if(pthread_create(&c->_client_thread, NULL, &client_thread_routine, c)
-			!= 0) {
+	if(_tcpc_thread_create(&c->_client_thread, c->cpus,
+			&client_thread_routine, c) != 0) {
 		perror("tcpc_start_client");
+		c->_state = TCPC_STATE_INACTIVE;
+		_tcpc_txq_close(&c->_txq);
+		close(c->_txq.wakefd);
+		c->_txq.wakefd = -1;
+		_tcpc_rxq_free(&c->_rxq);
+		_dgram_free(c->_dgram);
+		c->_dgram = NULL;
 		return -3;
 	}
 	pthread_detach(c->_client_thread);
@@ -529,3 +2918,30 @@ void tcpc_close_client(struct tcpc_client *c)
 		while(c->_state == TCPC_STATE_ACTIVE);
 	}
 }
+
+int tcpc_client_queue_msg(struct tcpc_client *c, struct tcpc_txmsg *m,
+		int tx_class)
+{
+	return _tcpc_txq_put(&c->_txq, m, tx_class);
+}
+
+int tcpc_client_queue(struct tcpc_client *c, const void *buf, size_t len,
+		int tx_class)
+{
+	struct tcpc_txmsg *m;
+
+	if((m = tcpc_txmsg_alloc(len)) == NULL)
+		return -1;
+	tcpc_txmsg_append(buf, len, m);
+	return _tcpc_txq_put(&c->_txq, m, tx_class);
+}
+
+struct tcpc_rxbuf *tcpc_client_rx_take(struct tcpc_client *c)
+{
+	return (struct tcpc_rxbuf *)spsc_pop(&c->_rxq.filled);
+}
+
+void tcpc_client_rx_release(struct tcpc_client *c, struct tcpc_rxbuf *b)
+{
+	_tcpc_rxq_release(&c->_rxq, b, c->_txq.wakefd);
+}
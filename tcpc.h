@@ -21,24 +21,179 @@
 
 /****************************************************************************/
 
-#define _GNU_SOURCE
+#ifndef _GNU_SOURCE
+#error "build with -D_GNU_SOURCE, for cpu_set_t"
+#endif
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <pthread.h>
+#include <sched.h>
 #include <poll.h>
 #include <stdlib.h>
 #include "pt.h"
+#include "ll.h"
+#include "mpsc.h"
+#include "spsc.h"
+#include "tcpc_pool.h"
+#include "tcpc_mem.h"
+#include "tcpc_sdt.h"
 
 #ifndef I__TCPC_H__
 	#define I__TCPC_H__
 
 #define TCPC_DEFAULT_BUF_SZ	1024
+#define TCPC_CACHE_LINE		64
 #define TCPC_DEFAULT_POLL_TO	10
+#define TCPC_DEFAULT_TX_QUANTUM	16384
+#define TCPC_DEFAULT_THREAD_IDLE	10000
+#define TCPC_DEFAULT_RXBUF_POOL	64
+#define TCPC_RXBUF_MAX_BULK	65536	/* an rxbuf_max for bulk senders */
+#define TCPC_DEFAULT_RX_BUDGET	262144
+/* reads much smaller than rxbuf in a row before it's halved */
+#define TCPC_RXBUF_SHRINK_READS	16
+/* bytes in flight in each direction of a proxied connection */
+#define TCPC_PROXY_PIPE_SZ	65536
+/* datagrams moved per system call in datagram mode */
+#define TCPC_DEFAULT_DGRAM_BATCH	32
+/* datagrams to one peer sent as one with UDP GSO, and their total size */
+#define TCPC_DGRAM_GSO_SEGS	64
+#define TCPC_DGRAM_GSO_MAX	65000
 
 #define TCPC_STATE_ACTIVE	1
 #define TCPC_STATE_INACTIVE	0
 
+/* Outbound Priority Classes */
+#define TCPC_TX_CLASSES		4
+#define TCPC_TX_CLASS_CTRL	0	/* highest priority */
+#define TCPC_TX_CLASS_DEFAULT	2
+#define TCPC_TX_CLASS_BULK	3
+/* a queued class is served after being passed over this many times */
+#define TCPC_TX_STARVE_LIMIT	8
+
+/* OUTBOUND QUEUE */
+/****************************************************************************
+ * struct tcpc_txmsg
+ * 	DESCRIPTION: one outbound message. Messages are queued whole, and
+ * 	a message that has started going out is finished before any other, so
+ * 	classes only preempt each other at message boundaries.
+ */
+struct tcpc_txmsg {
+	mpsc_node_t node; /* on its way to the connection thread */
+	ll_t list; /* held by the connection thread */
+	uint8_t *data;
+	size_t len;
+	size_t cap;
+	size_t off; /* bytes already sent */
+	uint64_t queued_ns; /* when it was queued */
+
+	/* private members - don't modify directly */
+	struct tcpc_mem *_mem; /* charged to while queued */
+	size_t _charged;
+	struct sockaddr *_to; /* where a datagram goes, NULL for the peer */
+	socklen_t _tolen;
+};
+
+/****************************************************************************
+ * struct tcpc_tx_stats
+ * 	DESCRIPTION: outbound queue metrics of one connection. Delay is the
+ * 	time a message waits in the queue before it starts going out.
+ */
+struct tcpc_tx_stats {
+	uint64_t msgs;
+	uint64_t bytes;
+	uint64_t delay_ns_total;
+	uint64_t delay_ns_max;
+	uint64_t turns; /* round robin turns in an I/O loop */
+};
+
+/****************************************************************************
+ * struct tcpc_txq
+ * 	DESCRIPTION: per connection queue of outbound messages, one lock-free
+ * 	MPSC queue per priority class. Filled from any thread, which wakes the
+ * 	connection thread through wakefd. Everything but the MPSC queues
+ * 	belongs to the connection thread.
+ */
+struct tcpc_txq {
+	mpsc_t in[TCPC_TX_CLASSES];
+	ll_t q[TCPC_TX_CLASSES];
+	unsigned int skipped[TCPC_TX_CLASSES];
+	struct tcpc_txmsg *cur;
+	int closed;
+	int producers; /* pushes in progress */
+	int count; /* messages queued, not counting cur */
+	int wake; /* wakefd has been written */
+	int wakefd; /* eventfd, or -1 */
+	struct tcpc_mem *mem; /* queued messages are charged to it, or NULL */
+	struct tcpc_tx_stats stats;
+};
+
+/****************************************************************************
+ * struct tcpc_rxbuf
+ * 	DESCRIPTION: a filled receive buffer handed off to the application's
+ * 	consumer thread. See rx_handoff.
+ */
+struct tcpc_rxbuf {
+	size_t len;
+	uint8_t data[];
+};
+
+/****************************************************************************
+ * struct tcpc_rxq
+ * 	DESCRIPTION: receive buffers cycling between the connection thread and
+ * 	one consumer thread through two SPSC rings.
+ */
+struct tcpc_rxq {
+	spsc_t filled; /* connection thread -> consumer */
+	spsc_t free; /* consumer -> connection thread */
+	struct tcpc_rxbuf **bufs;
+	void **slots;
+	struct tcpc_rxbuf *spare; /* taken from free but not filled */
+	int count;
+	int stalled; /* out of free buffers, not reading */
+};
+
+/* tcpc_txmsg_alloc
+ * 	DESCRIPTION: allocates an empty message with room for size bytes.
+ *
+ * 	RETURN VALUES:
+ * 		pointer to the message on success
+ * 		NULL on failure
+ */
+struct tcpc_txmsg *tcpc_txmsg_alloc(size_t size);
+
+/* tcpc_txmsg_append
+ * 	DESCRIPTION: appends len bytes to the message msg. The arguments
+ * 	match a packit txf, so a packit can be sent into a message:
+ *
+ * 		m = tcpc_txmsg_alloc(0);
+ * 		packit_send(p, &tcpc_txmsg_append, m);
+ * 		tcpc_server_queue_msg(c, m, TCPC_TX_CLASS_CTRL);
+ *
+ * 	RETURN VALUES:
+ * 		len on success
+ * 		-1 on failure
+ */
+ssize_t tcpc_txmsg_append(const void *buf, size_t len, void *msg);
+
+/* tcpc_txmsg_to
+ * 	DESCRIPTION: sends the message, as one datagram, to the address addr
+ * 	of len bytes instead of the peer. Datagram mode only.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- out of memory
+ */
+int tcpc_txmsg_to(struct tcpc_txmsg *m, const struct sockaddr *addr,
+		socklen_t len);
+
+/* tcpc_txmsg_free
+ * 	DESCRIPTION: frees a message that wasn't queued
+ */
+void tcpc_txmsg_free(struct tcpc_txmsg *m);
+/****************************************************************************/
+
 /* SERVER FRAMEWORK */
 /****************************************************************************
  * struct tcpc_server_conn
@@ -46,47 +201,112 @@
  * 	structure that contains the information about a current connection to
  * 	the server. These are dynamically allocated by the TCPC server
  * 	listening thread, and freed when a connection is disconnected and 
- * 	removed from the list. rxbuf_sz can be set to a desired value during 
- * 	the new_conn_h callback.
+ * 	removed from the list. rxbuf_sz, rxbuf_max and rx_handoff can be set to
+ * 	a desired value during the new_conn_h callback.
  */
 struct tcpc_server_conn {
-	/* connection address information */
-	struct sockaddr *conn_addr;
-
+	/* HOT - touched on every wakeup. kept within two cache lines */
 	/* data buffers */
 	size_t rxbuf_sz;
 	uint8_t *rxbuf;
-	pthread_mutex_t rxbuf_mutex;
+	/* rxbuf grows from rxbuf_sz up to rxbuf_max for bulk senders, and
+	 * shrinks back for chatty ones. 0 keeps it at rxbuf_sz.
+	 */
+	size_t rxbuf_max;
 
 	/* private pointer. to be used by application */
 	void *priv;
 
 	/* configuration parameters */
 	int poll_timeout_ms;
+	/* spin this long for events before sleeping in poll, -1 to never
+	 * sleep. also sets SO_BUSY_POLL. connection threads only
+	 */
+	int busy_poll_us;
 	ssize_t (*rx_h)(int sock, void *buf, size_t len);
 	ssize_t (*tx_h)(int sock, const void *buf, size_t len, int flags);
 
 	/* callbacks */
-	/* conn_close_h is called whenever a client connection is closed.
-	 */
-	void (*conn_close_h)(struct tcpc_server_conn *);
 	/* conn_h is called consistently. When len is non-zero, there are len
-	 * new bytes in rxbuf.
+	 * new bytes in rxbuf. With rx_handoff, the len bytes are waiting for
+	 * the consumer instead.
 	 */
 	PT_THREAD((*conn_h)(struct tcpc_server_conn *, size_t len));
 	pt_t conn_h_pt;
 
 	/* private members - don't modify directly */
 	int _sock;
-	socklen_t _sockaddr_size;
-	volatile int _end_thread;
-	pthread_t _server_conn_thread;
-	struct pollfd _poll;
+	struct pollfd _poll[2]; /* socket and wakeup */
 	struct tcpc_server *_parent;
+	size_t _rxbuf_min;
+	int _rxsmall; /* reads in a row that used little of rxbuf */
+	int _rxpooled; /* rxbuf is borrowed from the server's pool */
+	int _txblocked;
+	int _rxunwatched;
+
+	/* COLD - set up once, or used by the I/O loops and on close */
+	/* connection address information */
+	struct sockaddr *conn_addr;
+
+	/* rx_handoff buffers of rxbuf_sz are handed to a consumer thread
+	 * instead of rxbuf. see tcpc_server_conn_rx_take.
+	 */
+	int rx_handoff;
+	/* share of the I/O loop's sending, in tx_quantum units per turn */
+	unsigned int tx_weight;
+	/* receive watermarks. with rx_high set, every byte read counts as
+	 * held until tcpc_server_conn_rx_consumed (or rx_release) says it's
+	 * done with. Reading stops at rx_high held bytes, and the socket
+	 * buffer pushes back on the peer, until it's down to rx_low.
+	 */
+	size_t rx_high;
+	size_t rx_low;
+	/* closes the socket. with rx_h and tx_h, the connection's transport.
+	 * an rx_h may fail with EAGAIN when woken with nothing to read
+	 */
+	int (*close_h)(int sock);
+
+	/* conn_close_h is called whenever a client connection is closed.
+	 */
+	void (*conn_close_h)(struct tcpc_server_conn *);
+
+	/* private members - don't modify directly */
+	socklen_t _sockaddr_size;
+	struct tcpc_io_loop *_loop; /* NULL when running its own thread */
+	ll_t _loop_list;
+	ll_t _active_list; /* waiting for a sending turn */
+	size_t _deficit;
+	struct tcpc_strand _strand; /* handler work, when the server has a pool */
+	struct tcpc_work _closing; /* the end of closing, after that work */
+	struct tcpc_proxy *_proxy; /* joined to an upstream client */
+	struct tcpc_dgram *_dgram; /* the socket of a datagram server */
 	struct tcpc_server_conn *_next;
 	struct tcpc_server_conn *_prev;
+	int _shed; /* ended to free memory */
+
+	/* written by other threads, on a line of their own */
+	char _pad0[TCPC_CACHE_LINE];
+	volatile int _end_thread;
+	int _rxpaused; /* over rx_high, not back to rx_low yet */
+	size_t _rxheld;
+	struct tcpc_mem _mem; /* under the server's */
+	char _pad1[TCPC_CACHE_LINE];
+
+	/* the queues lay out their own shared ends */
+	struct tcpc_txq _txq;
+	struct tcpc_rxq _rxq;
 };
 
+_Static_assert(offsetof(struct tcpc_server_conn, conn_addr) <=
+		2 * TCPC_CACHE_LINE,
+		"tcpc_server_conn hot part is over two cache lines");
+
+struct tcpc_io_loop;
+struct tcpc_pooled_buf;
+struct tcpc_proxy;
+struct tcpc_dgram;
+struct tcpc_client;
+
 /* tcpc_conn_server
  * 	DESCRIPTION: returns the server handling the connection
  */
@@ -102,6 +322,17 @@ static inline int tcpc_server_conn_socket(struct tcpc_server_conn *c)
 {
 	return c->_sock;
 }
+
+/* tcpc_server_conn_mem
+ * 	DESCRIPTION: returns the connection's memory account. Set it as the
+ * 	mem of the connection's packit session to charge its packits too;
+ * 	they must then be freed by the time conn_close_h returns.
+ */
+static inline struct tcpc_mem *tcpc_server_conn_mem(
+		struct tcpc_server_conn *c)
+{
+	return &c->_mem;
+}
 /****************************************************************************/
 
 /****************************************************************************
@@ -123,6 +354,87 @@ struct tcpc_server {
 	/* configuration parameters */
 	int max_connections;
 	int listen_backlog;
+	/* 0 runs a thread per connection. otherwise connections are spread
+	 * over io_threads I/O loops, which share their sending between
+	 * connections by deficit round robin, tx_quantum bytes per turn.
+	 */
+	int io_threads;
+	size_t tx_quantum;
+	/* admission control. at max_connections new connections wait in the
+	 * backlog, or with overload_reject they're accepted, sent the
+	 * reject_len bytes of reject_msg (an encoded packit, say) and reset.
+	 * accept_rate limits accepts to that many a second, in bursts of up
+	 * to accept_burst. 0 for no limit.
+	 */
+	int overload_reject;
+	const void *reject_msg;
+	size_t reject_len;
+	int accept_rate;
+	int accept_burst;
+	/* busy_poll_us for the I/O loops, and the connections' default */
+	int busy_poll_us;
+	/* CPU placement, NULL to leave it to the scheduler. Each I/O loop is
+	 * pinned to the next CPU of loop_cpus, and a new connection goes to
+	 * the loop on the CPU its packets arrive on (SO_INCOMING_CPU), so set
+	 * loop_cpus to match the NIC's receive queue IRQs.
+	 */
+	const cpu_set_t *listen_cpus;
+	const cpu_set_t *loop_cpus;
+	/* with a thread per connection, the threads are reused. at least
+	 * conn_threads_min are kept warm and at most conn_threads_max are run
+	 * (0 for max_connections). Idle threads above the minimum exit after
+	 * conn_thread_idle_ms. With conn_thread_idle_ms <= 0 they never do.
+	 */
+	int conn_threads_min;
+	int conn_threads_max;
+	int conn_thread_idle_ms;
+	/* stack size of the connection threads. 0 for the default */
+	size_t conn_stack_size;
+	/* rxbuf_pooled connections have no rxbuf of their own. One is
+	 * borrowed from a pool shared by the server while the socket is
+	 * read and conn_h runs, so conn_h must be done with rxbuf when it
+	 * returns. Up to rxbuf_pool_max free buffers are kept.
+	 */
+	int rxbuf_pooled;
+	int rxbuf_pool_max;
+	/* a readable connection is read until it's drained, or until
+	 * rx_budget bytes, calling conn_h with each read. rxbuf_max is the
+	 * default for the connections, 0 (off) unless set, e.g. to
+	 * TCPC_RXBUF_MAX_BULK.
+	 */
+	size_t rx_budget;
+	size_t rxbuf_max;
+	/* handler pool for tcpc_server_conn_dispatch. NULL for none. With
+	 * one, a closing connection's conn_close_h runs on the pool, after
+	 * the connection's work. It must outlive tcpc_close_server.
+	 */
+	struct tcpc_pool *pool;
+	/* memory budget, 0 for none. Connection structures, their buffers
+	 * and queued messages, and packits parsed for them (see
+	 * tcpc_server_conn_mem), are charged to the connection and the
+	 * server. A connection stops reading while its conn_mem_limit or the
+	 * server's mem_limit is used up, and queueing to it fails. With
+	 * mem_shed, running out of mem_limit also ends the connection using
+	 * the most, one at a time, until there's room again.
+	 */
+	size_t mem_limit;
+	size_t conn_mem_limit;
+	int mem_shed;
+	/* SOCK_STREAM, or SOCK_DGRAM for a datagram server. set it before
+	 * tcpc_open_server. A datagram server has one connection, for its
+	 * socket, on a connection thread. Its conn_h is called with each
+	 * datagram received (rxbuf_sz is the largest taken whole), with
+	 * conn_addr set to the sender. A message queued on it goes out as
+	 * one datagram, to the sender of the datagram being handled unless
+	 * tcpc_txmsg_to says otherwise. conn_addr changes with every
+	 * datagram, so a message queued from another thread (dispatched
+	 * work, say) needs tcpc_txmsg_to with a copy of it taken in conn_h.
+	 * Up to dgram_batch datagrams are moved per system call, and runs
+	 * of one size to one peer are sent with UDP GSO. With rxbuf_sz of
+	 * 64k or more, reads use UDP GRO.
+	 */
+	int sock_type;
+	int dgram_batch;
 
 	/* private members - don't modify directly */
 	int _sock; /* server socket */
@@ -137,7 +449,27 @@ struct tcpc_server {
 	volatile int _end_thread;
 	pthread_t _listen_thread;
 
-	struct pollfd _poll;
+	struct tcpc_io_loop *_loops;
+	int _next_loop;
+
+	pthread_mutex_t _workers_mutex;
+	pthread_cond_t _workers_cond; /* a connection thread idled or exited */
+	ll_t _idle_workers; /* most recently used first */
+	int _workers;
+	int _end_workers;
+
+	pthread_mutex_t _rxpool_mutex;
+	struct tcpc_pooled_buf *_rxpool; /* free buffers */
+	int _rxpool_free;
+
+	struct pollfd _poll[2]; /* socket and wakeup */
+	double _tokens; /* accept_rate bucket */
+	uint64_t _tokens_ns;
+	unsigned long _rejected;
+
+	struct tcpc_mem _mem;
+	int _shedding; /* shed connections not yet gone */
+	unsigned long _shed;
 };
 
 /* tcpc_server_socket
@@ -156,6 +488,32 @@ static inline int tcpc_server_conn_count(struct tcpc_server *s)
 	return s->_conn_count;
 }
 
+/* tcpc_server_rejected
+ * 	DESCRIPTION: returns the number of connections turned away by
+ * 	overload_reject, or for want of memory
+ */
+static inline unsigned long tcpc_server_rejected(struct tcpc_server *s)
+{
+	return __atomic_load_n(&s->_rejected, __ATOMIC_RELAXED);
+}
+
+/* tcpc_server_mem
+ * 	DESCRIPTION: returns the server's memory account, the total of its
+ * 	connections'. See struct tcpc_mem for the totals.
+ */
+static inline struct tcpc_mem *tcpc_server_mem(struct tcpc_server *s)
+{
+	return &s->_mem;
+}
+
+/* tcpc_server_shed
+ * 	DESCRIPTION: returns the number of connections ended by mem_shed
+ */
+static inline unsigned long tcpc_server_shed(struct tcpc_server *s)
+{
+	return __atomic_load_n(&s->_shed, __ATOMIC_RELAXED);
+}
+
 /* free_tcpc_server_members
  * 	DESCRIPTION: free's up all the malloced members of the structure
  */
@@ -203,8 +561,10 @@ int tcpc_open_server(struct tcpc_server *s);
  * 		-1	- no socket (no errno. you messed up)
  * 		errors: errno will be set with specific error information
  * 		-2	- error binding socket
- * 		-3	- error setting socket to listen
- * 		-4	- error creating listen thread
+ * 		-3	- error setting socket to listen (not for datagrams)
+ * 		-4	- error creating listen thread or its wakeup
+ * 		-5	- error creating the I/O loops
+ * 		-6	- error creating the connection threads
  */
 int tcpc_start_server(struct tcpc_server *s);
 
@@ -219,58 +579,232 @@ void tcpc_close_server(struct tcpc_server *s);
  * 	basically a direct interface to SEND(2). Return values are directly
  * 	from send(), and flags are sent directly to send(). The MSG_NOSIGNAL
  * 	flag is always passed to send(). You must check for the EPIPE return
- * 	value if the other end breaks the connection.
+ * 	value if the other end breaks the connection. Only call it from the
+ * 	connection's own thread (conn_h); other threads use tcpc_conn_submit.
+ * 	A datagram server's connection has no peer to send to, queue instead.
  */
 static inline ssize_t tcpc_server_send_to(struct tcpc_server_conn *c,
 		const void *buf, size_t len, int flags)
 {
-	return (c->tx_h)(c->_sock, buf, len, flags);
+	ssize_t r = (c->tx_h)(c->_sock, buf, len, flags);
+	TCPC_PROBE4(server_conn_tx, c, c->_sock, len, r);
+	return r;
+}
+
+/* tcpc_server_queue_msg
+ * 	DESCRIPTION: queues the message m on a server connection in priority
+ * 	class tx_class, and takes ownership of it. Safe from any thread, and
+ * 	lock-free: m is pushed on an MPSC queue and the connection thread is
+ * 	woken. The connection thread sends queued messages without blocking,
+ * 	in order within a class, higher classes first. A class that
+ * 	has been passed over TCPC_TX_STARVE_LIMIT times is served next, so
+ * 	lower classes are never starved. Bytes written with
+ * 	tcpc_server_send_to bypass the queue.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- the connection is closing, or out of memory budget,
+ * 			  or a datagram from another thread has no
+ * 			  tcpc_txmsg_to address (errno EDESTADDRREQ). m was
+ * 			  freed.
+ */
+int tcpc_server_queue_msg(struct tcpc_server_conn *c, struct tcpc_txmsg *m,
+		int tx_class);
+
+/* tcpc_server_queue
+ * 	DESCRIPTION: copies len bytes of buf into a new message and queues it
+ * 	with tcpc_server_queue_msg.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- error, or the connection is closing
+ */
+int tcpc_server_queue(struct tcpc_server_conn *c, const void *buf, size_t len,
+		int tx_class);
+
+/* tcpc_server_conn_rx_take
+ * 	DESCRIPTION: consumer side of rx_handoff. Takes the oldest filled
+ * 	buffer, in the order it was read, without blocking or locking. Only one
+ * 	thread may take and release buffers of a connection. Buffers still held
+ * 	when conn_close_h returns are freed with the connection.
+ *
+ * 	RETURN VALUES:
+ * 		pointer to the buffer, yours until released
+ * 		NULL when nothing is waiting
+ */
+struct tcpc_rxbuf *tcpc_server_conn_rx_take(struct tcpc_server_conn *c);
+
+/* tcpc_server_conn_rx_release
+ * 	DESCRIPTION: gives a taken buffer back to the connection thread. A
+ * 	connection that ran out of buffers stops reading (the socket buffer
+ * 	then pushes back on the peer) until one comes back.
+ */
+void tcpc_server_conn_rx_release(struct tcpc_server_conn *c,
+		struct tcpc_rxbuf *b);
+
+/* tcpc_server_conn_rx_consumed
+ * 	DESCRIPTION: tells the connection len bytes it read are done with, for
+ * 	the rx_high/rx_low watermarks. Safe from any thread. Released
+ * 	rx_handoff buffers are counted without it.
+ */
+void tcpc_server_conn_rx_consumed(struct tcpc_server_conn *c, size_t len);
+
+/* tcpc_server_conn_rx_held
+ * 	DESCRIPTION: returns the bytes read and not yet consumed
+ */
+static inline size_t tcpc_server_conn_rx_held(struct tcpc_server_conn *c)
+{
+	return __atomic_load_n(&c->_rxheld, __ATOMIC_RELAXED);
 }
 
+/* tcpc_conn_submit
+ * 	DESCRIPTION: sends len bytes of buf to a server connection from any
+ * 	thread. The bytes are copied into a message and queued in
+ * 	TCPC_TX_CLASS_DEFAULT, so submissions go out whole and in order,
+ * 	never interleaved with each other.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- error, or the connection is closing
+ */
+int tcpc_conn_submit(struct tcpc_server_conn *c, const void *buf, size_t len);
+
+/* tcpc_server_conn_dispatch
+ * 	DESCRIPTION: runs w on the server's handler pool, after all the work
+ * 	dispatched for the connection before it, so conn_h can hand slow work
+ * 	off without giving up message order. Replies go out through
+ * 	tcpc_conn_submit. The connection isn't freed until its work has run.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- the server has no pool, or queue_depth pieces of work
+ * 			  are already pending for the connection
+ */
+int tcpc_server_conn_dispatch(struct tcpc_server_conn *c,
+		struct tcpc_work *w);
+
+/* tcpc_server_conn_proxy
+ * 	DESCRIPTION: joins the connection to the upstream client up, which
+ * 	must be opened (tcpc_open_client) but not started. Call it from
+ * 	new_conn_h. The connection then gets a thread of its own, even with
+ * 	io_threads, which connects up and moves bytes both ways with
+ * 	splice(2) through a pipe per direction, so they never enter user
+ * 	space. A side is only read while its pipe has room, so a slow reader
+ * 	pushes back on the other peer. When one peer stops sending, the
+ * 	other is shut down for writing once the pipe is drained, and the
+ * 	connection closes when both directions are done or on an error.
+ *
+ * 	Neither rxbuf nor conn_h's len is used, conn_h is called with 0, and
+ * 	nothing queued on the connection is sent. tcpc_close_client(up)
+ * 	ends the proxying like closing the connection does. up's
+ * 	conn_close_h is called after the connection's, once its socket is
+ * 	closed, and may free it.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- error, up isn't open, or the connection is already
+ * 			  proxied
+ */
+int tcpc_server_conn_proxy(struct tcpc_server_conn *c, struct tcpc_client *up);
+
+/* tcpc_server_conn_tx_stats
+ * 	DESCRIPTION: copies the outbound queue metrics of a connection to st
+ */
+void tcpc_server_conn_tx_stats(struct tcpc_server_conn *c,
+		struct tcpc_tx_stats *st);
+
+/* tcpc_server_tx_fairness
+ * 	DESCRIPTION: returns Jain's fairness index of the queued bytes sent
+ * 	over the server's connections, each divided by its tx_weight. 1.0 is
+ * 	perfectly fair, 1/n is one connection getting everything. Connections
+ * 	that haven't sent anything are left out.
+ */
+double tcpc_server_tx_fairness(struct tcpc_server *s);
+
 /* CLIENT FRAMEWORK */
 /****************************************************************************
  * struct tcpc_client
  * 	DESCRIPTION: Main data structure describing a client TCP connection
  */
 struct tcpc_client {
-	/* server address information */
-	struct sockaddr *serv_addr;
+	/* HOT - touched on every wakeup. kept within two cache lines */
+	/* data buffers */
+	uint8_t *rxbuf;
 
 	/* private pointer. to be used by application */
 	void *priv;
 
 	/* configuration parameters */
 	int poll_timeout_ms;
+	/* spin this long for events before sleeping in poll, -1 to never
+	 * sleep. also sets SO_BUSY_POLL. set it before tcpc_start_client
+	 */
+	int busy_poll_us;
 	ssize_t (*rx_h)(int sock, void *buf, size_t len);
 	ssize_t (*tx_h)(int sock, const void *buf, size_t len, int flags);
 
 	/* callbacks */
-	/* conn_close_h is called whenever a server connection is closed.
-	 */
-	void (*conn_close_h)(struct tcpc_client *);
 	/* conn_h is called consistently. When len is non-zero, there are len
-	 * new bytes in rxbuf.
+	 * new bytes in rxbuf. With rx_handoff, the len bytes are waiting for
+	 * the consumer instead.
 	 */
 	PT_THREAD((*conn_h)(struct tcpc_client *, size_t len));
 	pt_t conn_h_pt;
 
-	/* data buffers */
-	uint8_t *rxbuf;
-	pthread_mutex_t rxbuf_mutex;
-
 	/* private members - don't modify directly */
 	int _sock; /* client socket */
+	struct pollfd _poll[2]; /* socket and wakeup */
+	size_t _rxbuf_sz;
 
-	volatile int _state;
-	volatile int _end_thread;
-	pthread_t _client_thread;
+	/* COLD - set up once, or used on close */
+	/* server address information */
+	struct sockaddr *serv_addr;
 
-	struct pollfd _poll;
+	/* rx_handoff buffers are handed to a consumer thread instead of
+	 * rxbuf. set it before tcpc_start_client. see tcpc_client_rx_take.
+	 */
+	int rx_handoff;
+	/* CPUs for the client thread, NULL to leave it to the scheduler */
+	const cpu_set_t *cpus;
+	/* closes the socket. with rx_h and tx_h, the client's transport.
+	 * an rx_h may fail with EAGAIN when woken with nothing to read
+	 */
+	int (*close_h)(int sock);
+
+	/* connect_h is called once connected, before the client thread
+	 * starts. tcpc_start_client fails if it returns < 0.
+	 */
+	int (*connect_h)(struct tcpc_client *);
+	/* SOCK_STREAM, or SOCK_DGRAM for a datagram client. set it before
+	 * tcpc_open_client. As with a datagram server, conn_h is called with
+	 * each datagram, each queued message goes out as one and dgram_batch
+	 * move per system call. rx_handoff isn't used.
+	 */
+	int sock_type;
+	int dgram_batch;
+	/* conn_close_h is called whenever a server connection is closed.
+	 */
+	void (*conn_close_h)(struct tcpc_client *);
 
+	/* private members - don't modify directly */
+	pthread_t _client_thread;
 	socklen_t _sockaddr_size;
-	size_t _rxbuf_sz;
+	struct tcpc_dgram *_dgram; /* batches of a datagram client */
+
+	/* written by other threads, on a line of their own */
+	char _pad0[TCPC_CACHE_LINE];
+	volatile int _state;
+	volatile int _end_thread;
+	char _pad1[TCPC_CACHE_LINE];
+
+	/* the queues lay out their own shared ends */
+	struct tcpc_txq _txq;
+	struct tcpc_rxq _rxq;
 };
 
+_Static_assert(offsetof(struct tcpc_client, serv_addr) <= 2 * TCPC_CACHE_LINE,
+		"tcpc_client hot part is over two cache lines");
+
 /* tcpc_init_client
  * 	DESCRIPTION: intializes a tcpc_client structure to default values and 
  * 	allocates the sockaddr structure.
@@ -326,8 +860,8 @@ int tcpc_open_client(struct tcpc_client *c);
  * 		0	- everything went as planned
  * 		-1	- no socket (no errno. you messed up)
  * 		errors: errno will be set with specific error information
- * 		-2	- error connecting socket
- * 		-3	- error creating client thread
+ * 		-2	- error connecting socket, or connect_h failed
+ * 		-3	- error creating client thread, or its buffers
  */
 int tcpc_start_client(struct tcpc_client *c);
 
@@ -347,7 +881,41 @@ void tcpc_close_client(struct tcpc_client *c);
 static inline ssize_t tcpc_client_send_to(struct tcpc_client *c,
 		const void *buf, size_t len, int flags)
 {
-	return (c->tx_h)(c->_sock, buf, len, flags);
+	ssize_t r = (c->tx_h)(c->_sock, buf, len, flags);
+	TCPC_PROBE4(client_tx, c, c->_sock, len, r);
+	return r;
 }
 
+/* tcpc_client_rx_take
+ * 	DESCRIPTION: consumer side of rx_handoff. See tcpc_server_conn_rx_take.
+ */
+struct tcpc_rxbuf *tcpc_client_rx_take(struct tcpc_client *c);
+
+/* tcpc_client_rx_release
+ * 	DESCRIPTION: gives a taken buffer back to the client thread
+ */
+void tcpc_client_rx_release(struct tcpc_client *c, struct tcpc_rxbuf *b);
+
+/* tcpc_client_queue_msg
+ * 	DESCRIPTION: queues the message m to the server in priority class
+ * 	tx_class, and takes ownership of it. See tcpc_server_queue_msg.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- the client isn't running. m was freed.
+ */
+int tcpc_client_queue_msg(struct tcpc_client *c, struct tcpc_txmsg *m,
+		int tx_class);
+
+/* tcpc_client_queue
+ * 	DESCRIPTION: copies len bytes of buf into a new message and queues it
+ * 	with tcpc_client_queue_msg.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- error, or the client isn't running
+ */
+int tcpc_client_queue(struct tcpc_client *c, const void *buf, size_t len,
+		int tx_class);
+
 #endif /* I__TCPC_H__ */
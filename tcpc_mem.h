@@ -0,0 +1,148 @@
+/*
+ * tcpc_mem.h - Memory accounting for the TCPC framework.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+/* DESCRIPTION: Accounts of bytes in use, arranged in a tree. Every
+ * connection has an account whose parent is its server's, so a charge to a
+ * connection counts against both. A charge that would take any account
+ * over its limit fails as a whole and nothing is counted.
+ *
+ * The counts are atomic, so buffers can be charged and uncharged from any
+ * thread. An allocation is charged before it's made, and uncharged with
+ * the same size when it's freed.
+ */
+
+#include <stddef.h>
+
+#ifndef I__TCPC_MEM_H__
+	#define I__TCPC_MEM_H__
+
+/****************************************************************************
+ * struct tcpc_mem
+ * 	DESCRIPTION: one account. Use tcpc_mem_init() to initialize one.
+ */
+struct tcpc_mem {
+	struct tcpc_mem *parent;
+	/* bytes this account may hold, 0 for no limit */
+	size_t limit;
+	/* called with the account and the size of a charge that would have
+	 * taken it over limit
+	 */
+	void (*over_h)(struct tcpc_mem *, size_t);
+	void *priv;
+
+	/* private members - don't modify directly */
+	size_t _used;
+	size_t _peak;
+};
+
+/* tcpc_mem_init
+ * 	DESCRIPTION: initializes an empty account under parent (NULL for a
+ * 	root account)
+ */
+static inline void tcpc_mem_init(struct tcpc_mem *m, struct tcpc_mem *parent,
+		size_t limit)
+{
+	m->parent = parent;
+	m->limit = limit;
+	m->over_h = NULL;
+	m->priv = NULL;
+	m->_used = 0;
+	m->_peak = 0;
+}
+
+/* tcpc_mem_uncharge
+ * 	DESCRIPTION: gives n bytes back to m and its parents. NULL does nothing.
+ */
+static inline void tcpc_mem_uncharge(struct tcpc_mem *m, size_t n)
+{
+	for(; m; m = m->parent)
+		__atomic_sub_fetch(&m->_used, n, __ATOMIC_RELAXED);
+}
+
+/* tcpc_mem_charge
+ * 	DESCRIPTION: counts n bytes against m and its parents. NULL always
+ * 	succeeds.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- an account would go over its limit. nothing was
+ * 			  charged, and that account's over_h was called.
+ */
+static inline int tcpc_mem_charge(struct tcpc_mem *m, size_t n)
+{
+	struct tcpc_mem *a, *b;
+	size_t used, peak;
+
+	for(a = m; a; a = a->parent) {
+		used = __atomic_add_fetch(&a->_used, n, __ATOMIC_RELAXED);
+		if(a->limit && used > a->limit) {
+			/* back out of this one and the ones below it */
+			for(b = m; b != a->parent; b = b->parent)
+				__atomic_sub_fetch(&b->_used, n,
+						__ATOMIC_RELAXED);
+			if(a->over_h)
+				(a->over_h)(a, n);
+			return -1;
+		}
+		peak = __atomic_load_n(&a->_peak, __ATOMIC_RELAXED);
+		while(used > peak && !__atomic_compare_exchange_n(&a->_peak,
+				&peak, used, 1, __ATOMIC_RELAXED,
+				__ATOMIC_RELAXED))
+			;
+	}
+
+	return 0;
+}
+
+/* tcpc_mem_over
+ * 	DESCRIPTION: returns the first of m and its parents without room for n
+ * 	more bytes, or NULL when they all have room
+ */
+static inline struct tcpc_mem *tcpc_mem_over(struct tcpc_mem *m, size_t n)
+{
+	for(; m; m = m->parent) {
+		if(m->limit && __atomic_load_n(&m->_used, __ATOMIC_RELAXED) +
+				n > m->limit)
+			return m;
+	}
+	return NULL;
+}
+
+/* tcpc_mem_used
+ * 	DESCRIPTION: returns the bytes charged to the account and not given
+ * 	back
+ */
+static inline size_t tcpc_mem_used(struct tcpc_mem *m)
+{
+	return __atomic_load_n(&m->_used, __ATOMIC_RELAXED);
+}
+
+/* tcpc_mem_peak
+ * 	DESCRIPTION: returns the most the account has held
+ */
+static inline size_t tcpc_mem_peak(struct tcpc_mem *m)
+{
+	return __atomic_load_n(&m->_peak, __ATOMIC_RELAXED);
+}
+
+#endif /* I__TCPC_MEM_H__ */
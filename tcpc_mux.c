@@ -0,0 +1,439 @@
+/*
+ * tcpc_mux.c - Multiplexed logical streams over one TCPC connection.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+#include "tcpc_mux.h"
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+
+/* queued stream data */
+struct tcpc_mux_buf {
+	ll_t list;
+	size_t len;
+	size_t off;
+	uint8_t data[];
+};
+
+/* local helper functions */
+static inline int _prio(int priority)
+{
+	if(priority < 0)
+		return 0;
+	if(priority >= TCPC_MUX_PRIOS)
+		return TCPC_MUX_PRIOS - 1;
+	return priority;
+}
+
+static int _mux_send_frame(struct tcpc_mux *m, uint8_t type, uint32_t id,
+		const void *payload, uint32_t len)
+{
+	uint32_t v;
+
+	m->_txbuf[0] = type;
+	m->_txbuf[1] = 0;
+	m->_txbuf[2] = 0;
+	m->_txbuf[3] = 0;
+	v = htonl(id);
+	memcpy(&m->_txbuf[4], &v, 4);
+	v = htonl(len);
+	memcpy(&m->_txbuf[8], &v, 4);
+	if(len)
+		memcpy(&m->_txbuf[TCPC_MUX_HDR_SZ], payload, len);
+
+	if((m->_txf)(m->_txbuf, TCPC_MUX_HDR_SZ + len, m->_txarg) <= 0) {
+		m->_error = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct tcpc_stream *_mux_find(struct tcpc_mux *m, uint32_t id)
+{
+	struct tcpc_stream *st;
+	hl_node_t *n;
+
+	hlist_for_each_entry(st, n, &m->_hash_head[id % TCPC_MUX_HASH_SIZE],
+			_hash_list) {
+		if(st->_id == id)
+			return st;
+	}
+
+	return NULL;
+}
+
+static struct tcpc_stream *_mux_new_stream(struct tcpc_mux *m, uint32_t id)
+{
+	struct tcpc_stream *st;
+
+	if((st = (struct tcpc_stream *)calloc(1, sizeof(struct tcpc_stream)))
+			== NULL)
+		return NULL;
+	st->_id = id;
+	st->_mux = m;
+	st->priority = TCPC_MUX_DEFAULT_PRIO;
+	st->_tx_credit = TCPC_MUX_WINDOW;
+	st->_rx_window = TCPC_MUX_WINDOW;
+	INIT_LIST_HEAD(&st->_txq);
+	INIT_LIST_HEAD(&st->_ready_list);
+	hlist_add_head(&st->_hash_list,
+			&m->_hash_head[id % TCPC_MUX_HASH_SIZE]);
+	list_add_tail(&st->_full_list, &m->_streams);
+
+	return st;
+}
+
+static void _mux_free_stream(struct tcpc_stream *st)
+{
+	struct tcpc_mux_buf *b, *n;
+
+	if(st->_mux->_rx_stream == st)
+		st->_mux->_rx_stream = NULL;
+	if(st->close_h)
+		(st->close_h)(st);
+	hlist_del(&st->_hash_list);
+	list_del(&st->_full_list);
+	list_del(&st->_ready_list);
+	list_for_each_entry_safe(b, n, &st->_txq, list) {
+		list_del(&b->list);
+		free(b);
+	}
+	free(st);
+}
+
+/* a stream is ready when it has data and credit, or a close to send */
+static void _st_update_ready(struct tcpc_stream *st)
+{
+	int ready = (st->_tx_pending && st->_tx_credit) ||
+		(!st->_tx_pending && (st->_flags & (TCPC_STREAM_LOCAL_CLOSED |
+			TCPC_STREAM_CLOSE_SENT)) == TCPC_STREAM_LOCAL_CLOSED);
+
+	if(ready && list_empty(&st->_ready_list))
+		list_add_tail(&st->_ready_list,
+				&st->_mux->_ready[_prio(st->priority)]);
+	else if(!ready && !list_empty(&st->_ready_list))
+		list_del_init(&st->_ready_list);
+}
+
+/* runs the stream protothread, then gives consumed data back as credit */
+static void _st_call(struct tcpc_stream *st, const uint8_t *buf, size_t len)
+{
+	st->rxbuf = buf;
+	if(st->stream_h && !(st->_flags & TCPC_STREAM_ENDED)) {
+		if((st->stream_h)(st, len) == PT_ENDED) {
+			st->_flags |= TCPC_STREAM_ENDED;
+			tcpc_stream_close(st);
+		}
+	}
+	st->rxbuf = NULL;
+
+	if(len == 0 || (st->_flags & TCPC_STREAM_REMOTE_CLOSED))
+		return;
+	/* batch the credit updates */
+	st->_rx_consumed += (uint32_t)len;
+	if(st->_rx_consumed >= TCPC_MUX_WINDOW / 2) {
+		uint32_t v = htonl(st->_rx_consumed);
+		if(_mux_send_frame(st->_mux, TCPC_MUX_CREDIT, st->_id, &v, 4)
+				== 0) {
+			st->_rx_window += st->_rx_consumed;
+			st->_rx_consumed = 0;
+		}
+	}
+}
+
+/* sends queued frames, highest priority first and round robin between
+ * streams of the same priority
+ */
+static int _mux_flush(struct tcpc_mux *m)
+{
+	struct tcpc_stream *st;
+	struct tcpc_mux_buf *b;
+	uint32_t n;
+	int p;
+
+	while(!m->_error) {
+		st = NULL;
+		for(p = 0; p < TCPC_MUX_PRIOS; p++) {
+			if(!list_empty(&m->_ready[p])) {
+				st = list_first_entry(&m->_ready[p],
+						struct tcpc_stream, _ready_list);
+				break;
+			}
+		}
+		if(st == NULL)
+			return 0;
+
+		if(st->_tx_pending) {
+			b = list_first_entry(&st->_txq, struct tcpc_mux_buf,
+					list);
+			n = TCPC_MUX_FRAME_MAX;
+			if(n > st->_tx_credit)
+				n = st->_tx_credit;
+			if(n > b->len - b->off)
+				n = (uint32_t)(b->len - b->off);
+			if(_mux_send_frame(m, TCPC_MUX_DATA, st->_id,
+					b->data + b->off, n) < 0)
+				return -1;
+			b->off += n;
+			st->_tx_pending -= n;
+			st->_tx_credit -= n;
+			if(b->off == b->len) {
+				list_del(&b->list);
+				free(b);
+			}
+		} else {
+			if(_mux_send_frame(m, TCPC_MUX_CLOSE, st->_id, NULL, 0)
+					< 0)
+				return -1;
+			st->_flags |= TCPC_STREAM_CLOSE_SENT;
+		}
+
+		/* to the back of the line */
+		list_del_init(&st->_ready_list);
+		_st_update_ready(st);
+		if((st->_flags & (TCPC_STREAM_CLOSE_SENT |
+				TCPC_STREAM_REMOTE_CLOSED)) ==
+				(TCPC_STREAM_CLOSE_SENT |
+				 TCPC_STREAM_REMOTE_CLOSED))
+			_mux_free_stream(st);
+	}
+
+	return -1;
+}
+
+/* called once a whole frame header is in */
+static int _mux_frame_start(struct tcpc_mux *m)
+{
+	struct tcpc_stream *st;
+	uint32_t id, len;
+	uint8_t type = m->_hdr[0];
+
+	memcpy(&id, &m->_hdr[4], 4);
+	id = ntohl(id);
+	memcpy(&len, &m->_hdr[8], 4);
+	len = ntohl(len);
+
+	m->_payload_left = len;
+	m->_rx_stream = st = _mux_find(m, id);
+
+	switch(type) {
+	case TCPC_MUX_DATA:
+		if(st == NULL || (st->_flags & TCPC_STREAM_REMOTE_CLOSED) ||
+				len > st->_rx_window)
+			return -1;
+		st->_rx_window -= len;
+		break;
+	case TCPC_MUX_OPEN:
+		/* peer streams have the other parity */
+		if(len || st || id == 0 || (id & 1) == (m->_next_id & 1))
+			return -1;
+		if((st = _mux_new_stream(m, id)) == NULL)
+			return -1;
+		if(m->new_stream_h)
+			(m->new_stream_h)(st);
+		break;
+	case TCPC_MUX_CREDIT:
+		/* credit can still arrive for a stream we're done with */
+		if(len != 4)
+			return -1;
+		m->_credit_have = 0;
+		break;
+	case TCPC_MUX_CLOSE:
+		if(len || st == NULL ||
+				(st->_flags & TCPC_STREAM_REMOTE_CLOSED))
+			return -1;
+		st->_flags |= TCPC_STREAM_REMOTE_CLOSED;
+		if(st->_flags & TCPC_STREAM_CLOSE_SENT)
+			_mux_free_stream(st);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int _mux_credit(struct tcpc_mux *m)
+{
+	struct tcpc_stream *st = m->_rx_stream;
+	uint32_t v;
+
+	memcpy(&v, m->_credit, 4);
+	v = ntohl(v);
+	if(st == NULL)
+		return 0;
+	if(st->_tx_credit + v < st->_tx_credit)
+		return -1;
+	st->_tx_credit += v;
+	_st_update_ready(st);
+
+	return 0;
+}
+
+
+/* API FUNCTIONS */
+void tcpc_mux_init(struct tcpc_mux *m, int initiator,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg, void (*new_stream_h)(struct tcpc_stream *))
+{
+	int i;
+
+	/* clear the structure */
+	memset(m, 0, sizeof(struct tcpc_mux));
+
+	for(i = 0; i < TCPC_MUX_HASH_SIZE; i++) {
+		INIT_HLIST_HEAD(&m->_hash_head[i]);
+	}
+	INIT_LIST_HEAD(&m->_streams);
+	for(i = 0; i < TCPC_MUX_PRIOS; i++) {
+		INIT_LIST_HEAD(&m->_ready[i]);
+	}
+
+	/* initiator streams are odd, the others even */
+	m->_next_id = initiator ? 1 : 2;
+	m->_txf = txf;
+	m->_txarg = arg;
+	m->new_stream_h = new_stream_h;
+}
+
+void tcpc_mux_free(struct tcpc_mux *m)
+{
+	while(!list_empty(&m->_streams)) {
+		_mux_free_stream(list_first_entry(&m->_streams,
+					struct tcpc_stream, _full_list));
+	}
+}
+
+int tcpc_mux_input(struct tcpc_mux *m, const void *buf, size_t len)
+{
+	const uint8_t *b = (const uint8_t *)buf;
+	const uint8_t *end = b + len;
+	size_t n;
+
+	while(b < end) {
+		if(m->_hdr_have < TCPC_MUX_HDR_SZ) {
+			n = TCPC_MUX_HDR_SZ - m->_hdr_have;
+			if(n > (size_t)(end - b))
+				n = (size_t)(end - b);
+			memcpy(m->_hdr + m->_hdr_have, b, n);
+			m->_hdr_have += n;
+			b += n;
+			if(m->_hdr_have < TCPC_MUX_HDR_SZ)
+				break;
+			if(_mux_frame_start(m) < 0)
+				goto error;
+		} else {
+			n = m->_payload_left;
+			if(n > (size_t)(end - b))
+				n = (size_t)(end - b);
+			if(m->_hdr[0] == TCPC_MUX_DATA) {
+				/* straight from the input buffer */
+				if(m->_rx_stream)
+					_st_call(m->_rx_stream, b, n);
+			} else {
+				memcpy(m->_credit + m->_credit_have, b, n);
+				m->_credit_have += n;
+			}
+			m->_payload_left -= (uint32_t)n;
+			b += n;
+			if(m->_payload_left == 0 &&
+					m->_hdr[0] == TCPC_MUX_CREDIT &&
+					_mux_credit(m) < 0)
+				goto error;
+		}
+		/* frame done */
+		if(m->_payload_left == 0)
+			m->_hdr_have = 0;
+	}
+
+	return 0;
+
+error:
+	m->_error = 1;
+	return -1;
+}
+
+int tcpc_mux_run(struct tcpc_mux *m)
+{
+	struct tcpc_stream *st, *n;
+
+	if(m->_error)
+		return -1;
+
+	list_for_each_entry_safe(st, n, &m->_streams, _full_list) {
+		_st_call(st, NULL, 0);
+	}
+
+	return _mux_flush(m);
+}
+
+struct tcpc_stream *tcpc_mux_open(struct tcpc_mux *m, int priority,
+		PT_THREAD((*stream_h)(struct tcpc_stream *, size_t len)),
+		void (*close_h)(struct tcpc_stream *))
+{
+	struct tcpc_stream *st;
+
+	if((st = _mux_new_stream(m, m->_next_id)) == NULL)
+		return NULL;
+	st->priority = priority;
+	st->stream_h = stream_h;
+	st->close_h = close_h;
+
+	if(_mux_send_frame(m, TCPC_MUX_OPEN, st->_id, NULL, 0) < 0) {
+		st->close_h = NULL;
+		_mux_free_stream(st);
+		return NULL;
+	}
+	m->_next_id += 2;
+
+	return st;
+}
+
+int tcpc_stream_send(struct tcpc_stream *st, const void *buf, size_t len)
+{
+	struct tcpc_mux_buf *b;
+
+	if(st->_flags & TCPC_STREAM_LOCAL_CLOSED)
+		return -1;
+	if(len == 0)
+		return 0;
+
+	if((b = (struct tcpc_mux_buf *)malloc(sizeof(struct tcpc_mux_buf) +
+			len)) == NULL)
+		return -1;
+	b->len = len;
+	b->off = 0;
+	memcpy(b->data, buf, len);
+	list_add_tail(&b->list, &st->_txq);
+	st->_tx_pending += len;
+	_st_update_ready(st);
+
+	return 0;
+}
+
+void tcpc_stream_close(struct tcpc_stream *st)
+{
+	st->_flags |= TCPC_STREAM_LOCAL_CLOSED;
+	_st_update_ready(st);
+}
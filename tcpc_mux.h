@@ -0,0 +1,235 @@
+/*
+ * tcpc_mux.h - Multiplexed logical streams over one TCPC connection.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+/* DESCRIPTION: Frames carry a 12 byte header: type, flags, two reserved
+ * bytes, stream id and payload length (both 32 bit, network order). Each
+ * stream has its own protothread and send queue. A stream may only send as
+ * much as the peer has granted it in credit, so a bulk stream can't starve
+ * the others. Queued frames go out highest priority first, round robin
+ * between streams of equal priority, at most TCPC_MUX_FRAME_MAX bytes at a
+ * time.
+ *
+ * A mux belongs to the thread running the connection's conn_h: feed it the
+ * received bytes and run it from there.
+ *
+ * 	if(len && tcpc_mux_input(m, c->rxbuf, len) < 0)
+ * 		PT_EXIT(c->conn_h_pt);
+ * 	tcpc_mux_run(m);
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "pt.h"
+#include "ll.h"
+
+#ifndef I__TCPC_MUX_H__
+	#define I__TCPC_MUX_H__
+
+#define TCPC_MUX_HDR_SZ		12
+#define TCPC_MUX_FRAME_MAX	16384
+#define TCPC_MUX_WINDOW		65536	/* initial credit of every stream */
+#define TCPC_MUX_PRIOS		8	/* 0 is the highest priority */
+#define TCPC_MUX_DEFAULT_PRIO	4
+#define TCPC_MUX_HASH_SIZE	64
+
+/* Frame Types */
+#define TCPC_MUX_DATA		0
+#define TCPC_MUX_OPEN		1
+#define TCPC_MUX_CREDIT		2	/* payload: 32 bit credit increment */
+#define TCPC_MUX_CLOSE		3	/* sender is done with the stream */
+
+/* Stream State Flags */
+#define TCPC_STREAM_LOCAL_CLOSED	0x01	/* tcpc_stream_close called */
+#define TCPC_STREAM_CLOSE_SENT		0x02
+#define TCPC_STREAM_REMOTE_CLOSED	0x04
+#define TCPC_STREAM_ENDED		0x08	/* stream_h has ended */
+
+struct tcpc_mux;
+
+/****************************************************************************
+ * struct tcpc_stream
+ * 	DESCRIPTION: one logical stream. Streams opened by the peer are handed
+ * 	to the mux's new_stream_h, which fills in the callbacks.
+ */
+struct tcpc_stream {
+	/* private pointer. to be used by application */
+	void *priv;
+
+	/* configuration parameters */
+	int priority;
+
+	/* callbacks */
+	/* close_h is called once both ends have closed the stream, right
+	 * before it is freed.
+	 */
+	void (*close_h)(struct tcpc_stream *);
+	/* stream_h is called on every tcpc_mux_run, and for received data.
+	 * When len is non-zero, there are len new bytes at rxbuf. Ending the
+	 * protothread closes this end of the stream.
+	 */
+	PT_THREAD((*stream_h)(struct tcpc_stream *, size_t len));
+	pt_t stream_h_pt;
+	const uint8_t *rxbuf;
+
+	/* private members - don't modify directly */
+	uint32_t _id;
+	int _flags;
+	struct tcpc_mux *_mux;
+	hl_node_t _hash_list;
+	ll_t _full_list;
+	ll_t _ready_list;	/* on the mux ready list for its priority */
+	ll_t _txq;		/* queued struct tcpc_mux_buf */
+	size_t _tx_pending;
+	uint32_t _tx_credit;	/* bytes the peer will still take */
+	uint32_t _rx_window;	/* bytes the peer may still send */
+	uint32_t _rx_consumed;	/* bytes to give back as credit */
+};
+
+/****************************************************************************
+ * struct tcpc_mux
+ * 	DESCRIPTION: stream multiplexer for one connection. Use tcpc_mux_init()
+ * 	to initialize one.
+ */
+struct tcpc_mux {
+	/* private pointer. to be used by application */
+	void *priv;
+
+	/* callbacks */
+	/* new_stream_h is called for every stream opened by the peer */
+	void (*new_stream_h)(struct tcpc_stream *);
+
+	/* private members - don't modify directly */
+	ssize_t (*_txf)(const void *buf, size_t len, void *arg);
+	void *_txarg;
+	uint32_t _next_id;
+	hl_head_t _hash_head[TCPC_MUX_HASH_SIZE];
+	ll_t _streams;
+	ll_t _ready[TCPC_MUX_PRIOS];
+	int _error;
+
+	/* frame being received */
+	uint8_t _hdr[TCPC_MUX_HDR_SZ];
+	size_t _hdr_have;
+	uint32_t _payload_left;
+	uint8_t _credit[4];
+	size_t _credit_have;
+	struct tcpc_stream *_rx_stream;
+
+	uint8_t _txbuf[TCPC_MUX_HDR_SZ + TCPC_MUX_FRAME_MAX];
+};
+
+/* tcpc_mux_init
+ * 	DESCRIPTION: initializes a mux sending through txf. Exactly one end of
+ * 	the connection must be the initiator, so the two ends pick different
+ * 	stream ids.
+ */
+void tcpc_mux_init(struct tcpc_mux *m, int initiator,
+		ssize_t (*txf)(const void *buf, size_t len, void *arg),
+		void *arg, void (*new_stream_h)(struct tcpc_stream *));
+
+/* tcpc_mux_free
+ * 	DESCRIPTION: frees every stream, calling their close_h.
+ */
+void tcpc_mux_free(struct tcpc_mux *m);
+
+/* tcpc_mux_input
+ * 	DESCRIPTION: feeds received bytes to the mux, calling stream_h of the
+ * 	streams they carry data for.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- protocol error or peer overran its credit. drop the
+ * 			  connection.
+ */
+int tcpc_mux_input(struct tcpc_mux *m, const void *buf, size_t len);
+
+/* tcpc_mux_run
+ * 	DESCRIPTION: runs every stream's protothread, then sends queued frames
+ * 	as far as credit allows.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- error sending
+ */
+int tcpc_mux_run(struct tcpc_mux *m);
+
+/* tcpc_mux_open
+ * 	DESCRIPTION: opens a new stream.
+ *
+ * 	RETURN VALUES:
+ * 		pointer to the new stream on success
+ * 		NULL on failure
+ */
+struct tcpc_stream *tcpc_mux_open(struct tcpc_mux *m, int priority,
+		PT_THREAD((*stream_h)(struct tcpc_stream *, size_t len)),
+		void (*close_h)(struct tcpc_stream *));
+
+/* tcpc_stream_send
+ * 	DESCRIPTION: queues len bytes on the stream. They are sent from
+ * 	tcpc_mux_run as credit allows.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- stream closed, or error
+ */
+int tcpc_stream_send(struct tcpc_stream *st, const void *buf, size_t len);
+
+/* tcpc_stream_close
+ * 	DESCRIPTION: closes this end of the stream once its queue is sent.
+ */
+void tcpc_stream_close(struct tcpc_stream *st);
+
+/* tcpc_stream_tx_pending
+ * 	DESCRIPTION: returns the number of bytes queued on the stream
+ */
+static inline size_t tcpc_stream_tx_pending(struct tcpc_stream *st)
+{
+	return st->_tx_pending;
+}
+
+/* tcpc_stream_remote_closed
+ * 	DESCRIPTION: returns non-zero once the peer has closed its end
+ */
+static inline int tcpc_stream_remote_closed(struct tcpc_stream *st)
+{
+	return st->_flags & TCPC_STREAM_REMOTE_CLOSED;
+}
+
+/* tcpc_stream_id
+ * 	DESCRIPTION: returns the id of the stream
+ */
+static inline uint32_t tcpc_stream_id(struct tcpc_stream *st)
+{
+	return st->_id;
+}
+
+/* tcpc_stream_mux
+ * 	DESCRIPTION: returns the mux carrying the stream
+ */
+static inline struct tcpc_mux *tcpc_stream_mux(struct tcpc_stream *st)
+{
+	return st->_mux;
+}
+
+#endif /* I__TCPC_MUX_H__ */
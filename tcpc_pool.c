@@ -0,0 +1,391 @@
+/*
+ * tcpc_pool.c - Handler thread pool for the TCPC framework.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "tcpc_pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+
+/* a worker and its deque. bottom is the newest end, top the oldest */
+struct tcpc_pool_worker {
+	struct tcpc_pool *pool;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	struct tcpc_work **ring;
+	unsigned int mask;
+	unsigned int top;
+	unsigned int bottom;
+	int index;
+};
+
+/* the worker running on this thread, if any */
+static __thread struct tcpc_pool_worker *_self;
+
+/* local helper functions */
+static int _worker_push(struct tcpc_pool_worker *wk, struct tcpc_work *w)
+{
+	pthread_mutex_lock(&wk->mutex);
+	if(wk->bottom - wk->top > wk->mask) {
+		pthread_mutex_unlock(&wk->mutex);
+		return -1;
+	}
+	wk->ring[wk->bottom++ & wk->mask] = w;
+	pthread_mutex_unlock(&wk->mutex);
+
+	return 0;
+}
+
+static struct tcpc_work *_worker_pop(struct tcpc_pool_worker *wk)
+{
+	struct tcpc_work *w = NULL;
+
+	pthread_mutex_lock(&wk->mutex);
+	if(wk->bottom != wk->top)
+		w = wk->ring[--wk->bottom & wk->mask];
+	pthread_mutex_unlock(&wk->mutex);
+
+	return w;
+}
+
+static struct tcpc_work *_worker_steal(struct tcpc_pool_worker *wk)
+{
+	struct tcpc_work *w = NULL;
+
+	pthread_mutex_lock(&wk->mutex);
+	if(wk->bottom != wk->top)
+		w = wk->ring[wk->top++ & wk->mask];
+	pthread_mutex_unlock(&wk->mutex);
+
+	return w;
+}
+
+static struct tcpc_work *_pool_overflow_pop(struct tcpc_pool *p)
+{
+	mpsc_node_t *n;
+
+	if(!__atomic_load_n(&p->_overflowed, __ATOMIC_SEQ_CST))
+		return NULL;
+	pthread_mutex_lock(&p->_mutex);
+	n = mpsc_pop(&p->_overflow);
+	pthread_mutex_unlock(&p->_mutex);
+	if(n == NULL)
+		return NULL;
+	__atomic_sub_fetch(&p->_overflowed, 1, __ATOMIC_SEQ_CST);
+
+	return mpsc_entry(n, struct tcpc_work, _node);
+}
+
+/* own work first, newest first. then the oldest of someone else's, then
+ * the overflow
+ */
+static struct tcpc_work *_worker_take(struct tcpc_pool_worker *wk)
+{
+	struct tcpc_pool *p = wk->pool;
+	struct tcpc_work *w;
+	int i;
+
+	if((w = _worker_pop(wk)) != NULL)
+		return w;
+	for(i = 1; i < p->threads; i++) {
+		if((w = _worker_steal(&p->_workers[(wk->index + i) %
+				p->threads])) != NULL)
+			return w;
+	}
+
+	return _pool_overflow_pop(p);
+}
+
+/* counts newly queued work and wakes a sleeping worker for it */
+static void _pool_queued(struct tcpc_pool *p)
+{
+	__atomic_add_fetch(&p->_queued, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&p->_sleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&p->_mutex);
+		pthread_cond_signal(&p->_cond);
+		pthread_mutex_unlock(&p->_mutex);
+	}
+}
+
+/* queues a strand's task even when every worker is full. a strand has only
+ * the one task, so the overflow is bounded by the number of strands
+ */
+static void _strand_schedule(struct tcpc_strand *s)
+{
+	struct tcpc_pool *p = s->_pool;
+
+	if(tcpc_pool_submit(p, &s->_task) == 0)
+		return;
+	mpsc_push(&p->_overflow, &s->_task._node);
+	__atomic_add_fetch(&p->_overflowed, 1, __ATOMIC_SEQ_CST);
+	_pool_queued(p);
+}
+
+static void *pool_thread_routine(void *arg)
+{
+	struct tcpc_pool_worker *wk = (struct tcpc_pool_worker *)arg;
+	struct tcpc_pool *p = wk->pool;
+	struct tcpc_work *w;
+
+	_self = wk;
+
+	for(;;) {
+		if((w = _worker_take(wk)) != NULL) {
+			__atomic_sub_fetch(&p->_queued, 1, __ATOMIC_SEQ_CST);
+			(w->fn)(w);
+			continue;
+		}
+
+		/* sleep until there's work */
+		pthread_mutex_lock(&p->_mutex);
+		__atomic_add_fetch(&p->_sleepers, 1, __ATOMIC_SEQ_CST);
+		while(!__atomic_load_n(&p->_queued, __ATOMIC_SEQ_CST) &&
+				!p->_end_thread)
+			pthread_cond_wait(&p->_cond, &p->_mutex);
+		__atomic_sub_fetch(&p->_sleepers, 1, __ATOMIC_SEQ_CST);
+		if(p->_end_thread &&
+				!__atomic_load_n(&p->_queued, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_unlock(&p->_mutex);
+			break;
+		}
+		pthread_mutex_unlock(&p->_mutex);
+	}
+
+	return NULL;
+}
+
+/* runs a batch of a strand's work, then gives the worker back */
+static void _strand_run(struct tcpc_work *t)
+{
+	struct tcpc_strand *s = container_of(t, struct tcpc_strand, _task);
+	struct tcpc_work *w;
+	mpsc_node_t *n;
+	int i;
+
+	__atomic_add_fetch(&s->_busy, 1, __ATOMIC_SEQ_CST);
+
+	for(i = 0; i < TCPC_STRAND_BATCH; i++) {
+		if((n = mpsc_pop(&s->_q)) == NULL)
+			break;
+		w = mpsc_entry(n, struct tcpc_work, _node);
+		if(w == __atomic_load_n(&s->_final, __ATOMIC_ACQUIRE)) {
+			/* the strand is done, and w may free it */
+			(w->fn)(w);
+			return;
+		}
+		(w->fn)(w);
+		__atomic_sub_fetch(&s->_count, 1, __ATOMIC_SEQ_CST);
+	}
+
+	/* come back later if there's more, else unschedule. a post racing
+	 * the unschedule either sees it and schedules, or is seen here.
+	 */
+	if(__atomic_load_n(&s->_count, __ATOMIC_SEQ_CST)) {
+		_strand_schedule(s);
+	} else {
+		__atomic_store_n(&s->_scheduled, 0, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&s->_count, __ATOMIC_SEQ_CST) &&
+				!__atomic_exchange_n(&s->_scheduled, 1,
+					__ATOMIC_SEQ_CST))
+			_strand_schedule(s);
+	}
+
+	/* last touch of the strand */
+	__atomic_sub_fetch(&s->_busy, 1, __ATOMIC_SEQ_CST);
+}
+
+/* stops the first started workers and frees everything */
+static void _pool_destroy(struct tcpc_pool *p, int started)
+{
+	int i;
+
+	pthread_mutex_lock(&p->_mutex);
+	p->_end_thread = 1;
+	pthread_cond_broadcast(&p->_cond);
+	pthread_mutex_unlock(&p->_mutex);
+
+	for(i = 0; i < started; i++)
+		pthread_join(p->_workers[i].thread, NULL);
+	if(p->_workers) {
+		for(i = 0; i < p->threads; i++) {
+			pthread_mutex_destroy(&p->_workers[i].mutex);
+			free(p->_workers[i].ring);
+		}
+		free(p->_workers);
+		p->_workers = NULL;
+	}
+
+	pthread_cond_destroy(&p->_cond);
+	pthread_mutex_destroy(&p->_mutex);
+}
+
+/* API FUNCTIONS */
+int tcpc_pool_init(struct tcpc_pool *p, int threads, unsigned int queue_depth)
+{
+	struct tcpc_pool_worker *wk;
+	unsigned int size = 1;
+	int i;
+
+	/* clear the structure */
+	memset(p, 0, sizeof(struct tcpc_pool));
+
+	/* set the configurations */
+	p->threads = threads > 0 ? threads : 1;
+	p->queue_depth = queue_depth ? queue_depth : TCPC_POOL_DEFAULT_DEPTH;
+	while(size < p->queue_depth)
+		size <<= 1;
+
+	/* init the mutexes */
+	pthread_mutex_init(&p->_mutex, NULL);
+	pthread_cond_init(&p->_cond, NULL);
+	mpsc_init(&p->_overflow);
+
+	if((p->_workers = (struct tcpc_pool_worker *)calloc(p->threads,
+			sizeof(struct tcpc_pool_worker))) == NULL) {
+		perror("tcpc_pool_init");
+		_pool_destroy(p, 0);
+		return -1;
+	}
+	for(i = 0; i < p->threads; i++) {
+		wk = &p->_workers[i];
+		wk->pool = p;
+		wk->index = i;
+		wk->mask = size - 1;
+		pthread_mutex_init(&wk->mutex, NULL);
+		if((wk->ring = (struct tcpc_work **)calloc(size,
+				sizeof(struct tcpc_work *))) == NULL) {
+			perror("tcpc_pool_init");
+			_pool_destroy(p, 0);
+			return -1;
+		}
+	}
+
+	/* start the workers once they can all be stolen from */
+	for(i = 0; i < p->threads; i++) {
+		if(pthread_create(&p->_workers[i].thread, NULL,
+				&pool_thread_routine, &p->_workers[i]) != 0) {
+			perror("tcpc_pool_init");
+			_pool_destroy(p, i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void tcpc_pool_free(struct tcpc_pool *p)
+{
+	_pool_destroy(p, p->threads);
+}
+
+int tcpc_pool_pin(struct tcpc_pool *p, const cpu_set_t *cpus)
+{
+	cpu_set_t one;
+	int i, cpu = -1;
+
+	if(CPU_COUNT(cpus) == 0)
+		return -1;
+	for(i = 0; i < p->threads; i++) {
+		/* the next CPU in the set, wrapping around */
+		do {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		} while(!CPU_ISSET(cpu, cpus));
+		CPU_ZERO(&one);
+		CPU_SET(cpu, &one);
+		if(pthread_setaffinity_np(p->_workers[i].thread,
+				sizeof(cpu_set_t), &one) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int tcpc_pool_submit(struct tcpc_pool *p, struct tcpc_work *w)
+{
+	unsigned int n;
+	int i;
+
+	/* a worker keeps what it submits, it's likely warm in its cache */
+	if(_self && _self->pool == p && _worker_push(_self, w) == 0)
+		goto queued;
+	for(i = 0; i < p->threads; i++) {
+		n = __atomic_fetch_add(&p->_next, 1, __ATOMIC_RELAXED);
+		if(_worker_push(&p->_workers[n % p->threads], w) == 0)
+			goto queued;
+	}
+
+	return -1;
+
+queued:
+	_pool_queued(p);
+	return 0;
+}
+
+void tcpc_strand_init(struct tcpc_strand *s, struct tcpc_pool *p)
+{
+	memset(s, 0, sizeof(struct tcpc_strand));
+	s->_pool = p;
+	mpsc_init(&s->_q);
+	s->_task.fn = &_strand_run;
+}
+
+int tcpc_strand_post(struct tcpc_strand *s, struct tcpc_work *w)
+{
+	if(__atomic_add_fetch(&s->_count, 1, __ATOMIC_SEQ_CST) >
+			(int)s->_pool->queue_depth) {
+		__atomic_sub_fetch(&s->_count, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	mpsc_push(&s->_q, &w->_node);
+
+	/* schedule the strand unless it's already going */
+	if(!__atomic_exchange_n(&s->_scheduled, 1, __ATOMIC_SEQ_CST))
+		_strand_schedule(s);
+
+	return 0;
+}
+
+void tcpc_strand_close(struct tcpc_strand *s, struct tcpc_work *w)
+{
+	__atomic_add_fetch(&s->_count, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&s->_final, w, __ATOMIC_RELEASE);
+	mpsc_push(&s->_q, &w->_node);
+
+	if(!__atomic_exchange_n(&s->_scheduled, 1, __ATOMIC_SEQ_CST))
+		_strand_schedule(s);
+}
+
+void tcpc_strand_drain(struct tcpc_strand *s)
+{
+	/* busy is checked last. a run that unscheduled the strand before
+	 * the other checks is still counted in it
+	 */
+	while(__atomic_load_n(&s->_count, __ATOMIC_SEQ_CST) ||
+			__atomic_load_n(&s->_scheduled, __ATOMIC_SEQ_CST) ||
+			__atomic_load_n(&s->_busy, __ATOMIC_SEQ_CST))
+		sched_yield();
+}
@@ -0,0 +1,182 @@
+/*
+ * tcpc_pool.h - Handler thread pool for the TCPC framework.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+/* DESCRIPTION: A work-stealing pool of handler threads, so slow work doesn't
+ * run on the I/O threads. Every worker has its own deque of work. It takes
+ * the newest work from its own deque, and steals the oldest from the others
+ * when it runs dry.
+ *
+ * Work that must run in order, like the messages of one connection, is
+ * posted to a strand. A strand runs its work one at a time, in posting
+ * order, on whichever worker picks it up. Different strands run in
+ * parallel.
+ *
+ * 	struct msg_work { struct tcpc_work work; struct packit *p; };
+ *
+ * 	w->work.fn = &handle_msg;
+ * 	tcpc_server_conn_dispatch(c, &w->work);
+ */
+
+#ifndef _GNU_SOURCE
+#error "build with -D_GNU_SOURCE, for cpu_set_t"
+#endif
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include "mpsc.h"
+
+#ifndef I__TCPC_POOL_H__
+	#define I__TCPC_POOL_H__
+
+#define TCPC_POOL_DEFAULT_DEPTH	1024
+#define TCPC_STRAND_BATCH	32	/* work run per strand turn */
+
+struct tcpc_pool;
+struct tcpc_pool_worker;
+
+/****************************************************************************
+ * struct tcpc_work
+ * 	DESCRIPTION: one piece of work. Embed it in your own structure; fn is
+ * 	called with it on a pool thread and owns it from then on.
+ */
+struct tcpc_work {
+	void (*fn)(struct tcpc_work *);
+
+	/* private members - don't modify directly */
+	mpsc_node_t _node;
+};
+
+/****************************************************************************
+ * struct tcpc_strand
+ * 	DESCRIPTION: serializes the work posted to it. Use tcpc_strand_init()
+ * 	to initialize one.
+ */
+struct tcpc_strand {
+	/* private members - don't modify directly */
+	struct tcpc_pool *_pool;
+	mpsc_t _q;
+	int _count; /* posted and not yet run */
+	int _scheduled; /* _task is in the pool or running */
+	int _busy; /* workers still touching the strand */
+	struct tcpc_work *_final; /* from tcpc_strand_close */
+	struct tcpc_work _task;
+};
+
+/****************************************************************************
+ * struct tcpc_pool
+ * 	DESCRIPTION: handler thread pool. Use tcpc_pool_init() to initialize
+ * 	one.
+ */
+struct tcpc_pool {
+	/* configuration parameters */
+	int threads;
+	/* work each worker can hold, and a strand can have pending */
+	unsigned int queue_depth;
+
+	/* private members - don't modify directly */
+	struct tcpc_pool_worker *_workers;
+	unsigned int _next; /* worker for outside submissions */
+	mpsc_t _overflow; /* strands that found every worker full */
+	int _overflowed;
+	int _queued;
+	int _sleepers;
+	volatile int _end_thread;
+	pthread_mutex_t _mutex;
+	pthread_cond_t _cond;
+};
+
+/* tcpc_pool_init
+ * 	DESCRIPTION: initializes a pool of threads workers, each holding up to
+ * 	queue_depth pieces of work (0 for TCPC_POOL_DEFAULT_DEPTH), and starts
+ * 	the threads.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- error
+ */
+int tcpc_pool_init(struct tcpc_pool *p, int threads, unsigned int queue_depth);
+
+/* tcpc_pool_free
+ * 	DESCRIPTION: runs the work left, then stops and frees the threads.
+ * 	Nothing may be submitted once this is called.
+ */
+void tcpc_pool_free(struct tcpc_pool *p);
+
+/* tcpc_pool_pin
+ * 	DESCRIPTION: pins each worker to one CPU of cpus in turn
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- error, cpus is empty or a worker couldn't be pinned
+ */
+int tcpc_pool_pin(struct tcpc_pool *p, const cpu_set_t *cpus);
+
+/* tcpc_pool_submit
+ * 	DESCRIPTION: runs w on some pool thread, in no particular order. Safe
+ * 	from any thread.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- every worker is full
+ */
+int tcpc_pool_submit(struct tcpc_pool *p, struct tcpc_work *w);
+
+/* tcpc_strand_init
+ * 	DESCRIPTION: initializes a strand running its work on pool p
+ */
+void tcpc_strand_init(struct tcpc_strand *s, struct tcpc_pool *p);
+
+/* tcpc_strand_post
+ * 	DESCRIPTION: runs w on the pool after everything posted to the strand
+ * 	before it. Safe from any thread.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		-1	- queue_depth pieces of work are already pending
+ */
+int tcpc_strand_post(struct tcpc_strand *s, struct tcpc_work *w);
+
+/* tcpc_strand_close
+ * 	DESCRIPTION: posts w as the strand's last work, even past
+ * 	queue_depth. w runs after everything posted before it, and nothing
+ * 	touches the strand once w starts, so w may free it. Nothing may be
+ * 	posted after it. Safe from any thread, and doesn't wait.
+ */
+void tcpc_strand_close(struct tcpc_strand *s, struct tcpc_work *w);
+
+/* tcpc_strand_drain
+ * 	DESCRIPTION: waits until everything posted to the strand has run.
+ * 	Don't call it from the strand's own work.
+ */
+void tcpc_strand_drain(struct tcpc_strand *s);
+
+/* tcpc_strand_pending
+ * 	DESCRIPTION: returns the number of pieces of work posted and not yet
+ * 	run
+ */
+static inline int tcpc_strand_pending(struct tcpc_strand *s)
+{
+	return __atomic_load_n(&s->_count, __ATOMIC_ACQUIRE);
+}
+
+#endif /* I__TCPC_POOL_H__ */
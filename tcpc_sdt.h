@@ -0,0 +1,77 @@
+/*
+ * tcpc_sdt.h - Static tracepoints for the TCPC framework.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+/* DESCRIPTION: USDT (SystemTap/DTrace style) probe points. Build with
+ * -DTCPC_USDT and the <sys/sdt.h> header (systemtap-sdt-dev) to get the
+ * probes compiled in. Without TCPC_USDT every probe compiles to nothing.
+ *
+ * All probes live in the "tcpc" provider:
+ *
+ * 	server_conn_accept(conn, sock, conn_count)
+ * 	server_conn_reject(sock, rejected)
+ * 	server_conn_rx(conn, sock, len)
+ * 	server_conn_h_entry(conn, len)
+ * 	server_conn_h_return(conn, ret)
+ * 	server_conn_tx(conn, sock, len, ret)
+ * 	server_conn_close(conn, sock)
+ * 	server_conn_shed(conn, mem_used)
+ *
+ * 	client_connect(client, sock)
+ * 	client_rx(client, sock, len)
+ * 	client_h_entry(client, len)
+ * 	client_h_return(client, ret)
+ * 	client_tx(client, sock, len, ret)
+ * 	client_close(client, sock)
+ *
+ * e.g. conn_h latency per connection with bpftrace:
+ * 	usdt:./server_test:tcpc:server_conn_h_entry { @s[arg0] = nsecs; }
+ * 	usdt:./server_test:tcpc:server_conn_h_return /@s[arg0]/ {
+ * 		@ns = hist(nsecs - @s[arg0]); delete(@s[arg0]); }
+ */
+
+#ifndef I__TCPC_SDT_H__
+	#define I__TCPC_SDT_H__
+
+#ifdef TCPC_USDT
+
+#include <sys/sdt.h>
+
+#define TCPC_PROBE1(name, a1) \
+	DTRACE_PROBE1(tcpc, name, a1)
+#define TCPC_PROBE2(name, a1, a2) \
+	DTRACE_PROBE2(tcpc, name, a1, a2)
+#define TCPC_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(tcpc, name, a1, a2, a3)
+#define TCPC_PROBE4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(tcpc, name, a1, a2, a3, a4)
+
+#else /* TCPC_USDT */
+
+#define TCPC_PROBE1(name, a1)			do { } while(0)
+#define TCPC_PROBE2(name, a1, a2)		do { } while(0)
+#define TCPC_PROBE3(name, a1, a2, a3)		do { } while(0)
+#define TCPC_PROBE4(name, a1, a2, a3, a4)	do { } while(0)
+
+#endif /* TCPC_USDT */
+
+#endif /* I__TCPC_SDT_H__ */
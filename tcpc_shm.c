@@ -0,0 +1,630 @@
+/*
+ * tcpc_shm.c - Shared memory transport for the TCPC framework.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "tcpc_shm.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define TCPC_SHM_MAGIC		0x54435302	/* "TCS" and the version */
+#define TCPC_SHM_TX_WAIT_MS	10	/* checks for the peer going away */
+
+/* the start of the shared memory */
+struct tcpc_shm_hdr {
+	uint32_t magic;
+	uint32_t ring_sz;
+	char _pad[TCPC_CACHE_LINE - 8];
+};
+
+/* one direction. ring_sz bytes of data follow it */
+struct tcpc_shm_ring {
+	/* written by the producer */
+	uint64_t head;
+	int closed; /* the producer is gone */
+	int tx_wait; /* the producer is waiting for room */
+	char _pad0[TCPC_CACHE_LINE - 16];
+	/* written by the consumer */
+	uint64_t tail;
+	int rx_wait; /* the consumer is waiting for data */
+	uint32_t room; /* bumped when tx_wait is answered, a futex */
+	char _pad1[TCPC_CACHE_LINE - 16];
+};
+
+/* one end of a connection, in this process */
+struct tcpc_shm {
+	int us; /* the Unix socket, for the peer going away */
+	int bell; /* rung by the peer */
+	int peer_bell;
+	uint8_t *map;
+	size_t map_sz;
+	struct tcpc_shm_ring *rx;
+	struct tcpc_shm_ring *tx;
+	uint32_t mask;
+	struct tcpc_mem *mem; /* charged for the mapping, if any */
+	pthread_mutex_t txlock; /* any thread may send */
+	int refs; /* the table's, and each hook call's */
+	int dead; /* closed, senders give up */
+	int broken; /* the peer broke the ring, rx only */
+};
+
+/* the ends by descriptor number, since the hooks only get that. a stripe
+ * lock covers looking one up and taking a reference
+ */
+#define TCPC_SHM_STRIPES	64
+static struct tcpc_shm *_shm_fds[TCPC_SHM_MAX_FD];
+static char _shm_stripes[TCPC_SHM_STRIPES];
+
+/* local helper functions */
+static size_t _shm_map_size(uint32_t ring_sz)
+{
+	return sizeof(struct tcpc_shm_hdr) +
+		2 * (sizeof(struct tcpc_shm_ring) + ring_sz);
+}
+
+static struct tcpc_shm_ring *_shm_ring(uint8_t *map, uint32_t ring_sz,
+		int i)
+{
+	return (struct tcpc_shm_ring *)(map + sizeof(struct tcpc_shm_hdr) +
+			i * (sizeof(struct tcpc_shm_ring) + ring_sz));
+}
+
+static void _shm_stripe_lock(int sock)
+{
+	while(__atomic_test_and_set(&_shm_stripes[sock % TCPC_SHM_STRIPES],
+			__ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void _shm_stripe_unlock(int sock)
+{
+	__atomic_clear(&_shm_stripes[sock % TCPC_SHM_STRIPES],
+			__ATOMIC_RELEASE);
+}
+
+/* the end on sock with a reference taken, or NULL */
+static struct tcpc_shm *_shm_get(int sock)
+{
+	struct tcpc_shm *sh;
+
+	if(sock < 0 || sock >= TCPC_SHM_MAX_FD)
+		return NULL;
+	_shm_stripe_lock(sock);
+	if((sh = _shm_fds[sock]) != NULL)
+		__atomic_add_fetch(&sh->refs, 1, __ATOMIC_SEQ_CST);
+	_shm_stripe_unlock(sock);
+
+	return sh;
+}
+
+static void _shm_ring_bell(int fd)
+{
+	uint64_t one = 1;
+
+	if(write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("tcpc_shm");
+}
+
+/* wakes a sender sleeping in _shm_tx_end on r, in either process */
+static void _shm_wake_tx(struct tcpc_shm_ring *r)
+{
+	__atomic_add_fetch(&r->room, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &r->room, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* the peer closed its socket without saying so, it likely died */
+static int _shm_hup(struct tcpc_shm *sh)
+{
+	struct pollfd p = { sh->us, POLLRDHUP, 0 };
+
+	return poll(&p, 1, 0) > 0 &&
+		(p.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+static void _shm_free(struct tcpc_shm *sh)
+{
+	if(sh->map)
+		munmap(sh->map, sh->map_sz);
+	if(sh->us >= 0)
+		close(sh->us);
+	if(sh->bell >= 0)
+		close(sh->bell);
+	if(sh->peer_bell >= 0)
+		close(sh->peer_bell);
+	pthread_mutex_destroy(&sh->txlock);
+	tcpc_mem_uncharge(sh->mem, sh->map_sz + sizeof(struct tcpc_shm));
+	free(sh);
+}
+
+static void _shm_put(struct tcpc_shm *sh)
+{
+	if(__atomic_sub_fetch(&sh->refs, 1, __ATOMIC_SEQ_CST) == 0)
+		_shm_free(sh);
+}
+
+static ssize_t _shm_rx_end(struct tcpc_shm *sh, void *buf, size_t len)
+{
+	struct tcpc_shm_ring *r = sh->rx;
+	uint64_t head, tail = r->tail, v;
+	size_t n, off, first;
+	int closed;
+
+	if(sh->broken)
+		return 0;
+
+	/* take the doorbell. whatever it rang for is read below */
+	if(read(sh->bell, &v, sizeof(v)) < 0 && errno != EAGAIN)
+		perror("tcpc_shm");
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	if(head == tail) {
+		/* ask to be rung, then look again. closed is read before
+		 * head, so nothing sent before it is missed
+		 */
+		__atomic_store_n(&r->rx_wait, 1, __ATOMIC_SEQ_CST);
+		closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+		if(head == tail) {
+			if(closed || _shm_hup(sh))
+				return 0;
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	if(head - tail > sh->mask + 1) {
+		/* more than fits. hang up, the next read ends it */
+		sh->broken = 1;
+		shutdown(sh->us, SHUT_RDWR);
+		errno = EPROTO;
+		return -1;
+	}
+
+	n = (head - tail < len) ? (size_t)(head - tail) : len;
+	off = tail & sh->mask;
+	first = (n < sh->mask + 1 - off) ? n : sh->mask + 1 - off;
+	memcpy(buf, (uint8_t *)(r + 1) + off, first);
+	memcpy((uint8_t *)buf + first, r + 1, n - first);
+	__atomic_store_n(&r->tail, tail + n, __ATOMIC_SEQ_CST);
+
+	/* there's room for a waiting sender now, whether it's blocked in a
+	 * send or waiting to flush its queue
+	 */
+	if(__atomic_load_n(&r->tx_wait, __ATOMIC_SEQ_CST) &&
+			__atomic_exchange_n(&r->tx_wait, 0, __ATOMIC_SEQ_CST)) {
+		_shm_wake_tx(r);
+		_shm_ring_bell(sh->peer_bell);
+	}
+
+	/* the sender rings for anything after this. anything already there
+	 * still needs a wakeup
+	 */
+	__atomic_store_n(&r->rx_wait, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) != tail + n)
+		_shm_ring_bell(sh->bell);
+
+	return (ssize_t)n;
+}
+
+static ssize_t _shm_rx(int sock, void *buf, size_t len)
+{
+	struct tcpc_shm *sh = _shm_get(sock);
+	ssize_t l;
+
+	if(sh == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	l = _shm_rx_end(sh, buf, len);
+	_shm_put(sh);
+
+	return l;
+}
+
+static ssize_t _shm_tx_end(struct tcpc_shm *sh, const void *buf, size_t len,
+		int flags)
+{
+	struct tcpc_shm_ring *r = sh->tx;
+	struct timespec ts = { 0, TCPC_SHM_TX_WAIT_MS * 1000000L };
+	uint64_t head, room;
+	uint32_t seq;
+	size_t n, off, first;
+
+	pthread_mutex_lock(&sh->txlock);
+	head = r->head;
+	for(;;) {
+		if(__atomic_load_n(&sh->dead, __ATOMIC_ACQUIRE) ||
+				__atomic_load_n(&sh->rx->closed,
+					__ATOMIC_ACQUIRE)) {
+			pthread_mutex_unlock(&sh->txlock);
+			errno = EPIPE;
+			return -1;
+		}
+		room = sh->mask + 1 - (head - __atomic_load_n(&r->tail,
+				__ATOMIC_ACQUIRE));
+		if(room || len == 0)
+			break;
+		/* full. ask the receiver to wake us when it makes room */
+		seq = __atomic_load_n(&r->room, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&r->tx_wait, 1, __ATOMIC_SEQ_CST);
+		if(head - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) <=
+				sh->mask)
+			continue;
+		if(flags & MSG_DONTWAIT) {
+			pthread_mutex_unlock(&sh->txlock);
+			errno = EAGAIN;
+			return -1;
+		}
+		/* sleep until then, or until either end closes. a peer
+		 * that dies can't wake us, so look for it now and then
+		 */
+		if(_shm_hup(sh)) {
+			pthread_mutex_unlock(&sh->txlock);
+			errno = EPIPE;
+			return -1;
+		}
+		syscall(SYS_futex, &r->room, FUTEX_WAIT, seq, &ts, NULL, 0);
+	}
+
+	n = (room < len) ? (size_t)room : len;
+	off = head & sh->mask;
+	first = (n < sh->mask + 1 - off) ? n : sh->mask + 1 - off;
+	memcpy((uint8_t *)(r + 1) + off, buf, first);
+	memcpy(r + 1, (const uint8_t *)buf + first, n - first);
+	__atomic_store_n(&r->head, head + n, __ATOMIC_SEQ_CST);
+
+	/* wake the receiver if it's waiting */
+	if(__atomic_load_n(&r->rx_wait, __ATOMIC_SEQ_CST) &&
+			__atomic_exchange_n(&r->rx_wait, 0, __ATOMIC_SEQ_CST))
+		_shm_ring_bell(sh->peer_bell);
+	pthread_mutex_unlock(&sh->txlock);
+
+	return (ssize_t)n;
+}
+
+static ssize_t _shm_tx(int sock, const void *buf, size_t len, int flags)
+{
+	struct tcpc_shm *sh = _shm_get(sock);
+	ssize_t l;
+
+	if(sh == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	l = _shm_tx_end(sh, buf, len, flags);
+	_shm_put(sh);
+
+	return l;
+}
+
+static int _shm_close(int sock)
+{
+	struct tcpc_shm *sh = NULL;
+
+	if(sock >= 0 && sock < TCPC_SHM_MAX_FD) {
+		_shm_stripe_lock(sock);
+		sh = _shm_fds[sock];
+		_shm_fds[sock] = NULL;
+		_shm_stripe_unlock(sock);
+	}
+	if(sh) {
+		/* a blocked sender gives up, and one in the middle of a send
+		 * finishes before the peer sees the close. everything sent
+		 * is still read before then
+		 */
+		__atomic_store_n(&sh->dead, 1, __ATOMIC_SEQ_CST);
+		_shm_wake_tx(sh->tx);
+		pthread_mutex_lock(&sh->txlock);
+		__atomic_store_n(&sh->tx->closed, 1, __ATOMIC_SEQ_CST);
+		_shm_ring_bell(sh->peer_bell);
+		/* and the peer's sender gives up too */
+		_shm_wake_tx(sh->rx);
+		pthread_mutex_unlock(&sh->txlock);
+		/* the charge goes with the connection. the last call still
+		 * in a hook frees the rest
+		 */
+		tcpc_mem_uncharge(sh->mem, sh->map_sz +
+				sizeof(struct tcpc_shm));
+		sh->mem = NULL;
+		_shm_put(sh);
+	}
+
+	return close(sock);
+}
+
+/* maps the rings and takes over sock. the descriptors given are the
+ * end's from then on, or closed on failure
+ */
+static int _shm_attach(int sock, int memfd, int bell, int peer_bell,
+		uint32_t ring_sz, int server, struct tcpc_mem *mem)
+{
+	struct tcpc_shm *sh;
+	struct epoll_event ev;
+	int ep = -1;
+
+	if((sh = (struct tcpc_shm *)calloc(1, sizeof(struct tcpc_shm)))
+			== NULL) {
+		close(memfd);
+		close(bell);
+		close(peer_bell);
+		return -1;
+	}
+	pthread_mutex_init(&sh->txlock, NULL);
+	sh->refs = 1;
+	sh->us = -1;
+	sh->bell = bell;
+	sh->peer_bell = peer_bell;
+	sh->mem = mem;
+	sh->mask = ring_sz - 1;
+	sh->map_sz = _shm_map_size(ring_sz);
+	sh->map = (uint8_t *)mmap(NULL, sh->map_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED, memfd, 0);
+	close(memfd);
+	if(sh->map == MAP_FAILED) {
+		sh->map = NULL;
+		goto fail;
+	}
+	/* the server sends on the first ring */
+	sh->tx = _shm_ring(sh->map, ring_sz, server ? 0 : 1);
+	sh->rx = _shm_ring(sh->map, ring_sz, server ? 1 : 0);
+
+	/* what's polled from now on is the doorbell, and the socket going
+	 * away, under the socket's number
+	 */
+	if((sh->us = fcntl(sock, F_DUPFD_CLOEXEC, 0)) < 0 ||
+			(ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		goto fail;
+	ev.events = EPOLLIN;
+	ev.data.fd = bell;
+	if(epoll_ctl(ep, EPOLL_CTL_ADD, bell, &ev) < 0)
+		goto fail;
+	ev.events = EPOLLRDHUP;
+	ev.data.fd = sh->us;
+	if(epoll_ctl(ep, EPOLL_CTL_ADD, sh->us, &ev) < 0)
+		goto fail;
+	if(dup3(ep, sock, O_CLOEXEC) < 0)
+		goto fail;
+	close(ep);
+
+	_shm_stripe_lock(sock);
+	_shm_fds[sock] = sh;
+	_shm_stripe_unlock(sock);
+
+	return 0;
+
+fail:
+	if(ep >= 0)
+		close(ep);
+	/* the caller gives back the charge */
+	sh->mem = NULL;
+	_shm_free(sh);
+	return -1;
+}
+
+static int _shm_connect(struct tcpc_client *c)
+{
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct pollfd p;
+	struct tcpc_shm_hdr *h;
+	struct stat st;
+	uint32_t ring_sz = 0;
+	int fds[3], n, i;
+	char b;
+
+	if(c->serv_addr->sa_family != AF_UNIX || c->_sock >= TCPC_SHM_MAX_FD) {
+		errno = EINVAL;
+		perror("tcpc_shm_connect");
+		return -1;
+	}
+
+	/* the server sends the memory and the doorbells right away */
+	p.fd = c->_sock;
+	p.events = POLLIN;
+	p.revents = 0;
+	if(poll(&p, 1, TCPC_SHM_HANDSHAKE_MS) <= 0) {
+		errno = ETIMEDOUT;
+		perror("tcpc_shm_connect");
+		return -1;
+	}
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &b;
+	iov.iov_len = 1;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	if(recvmsg(c->_sock, &mh, MSG_CMSG_CLOEXEC) != 1) {
+		perror("tcpc_shm_connect");
+		return -1;
+	}
+	cm = CMSG_FIRSTHDR(&mh);
+	if(cm == NULL || cm->cmsg_level != SOL_SOCKET ||
+			cm->cmsg_type != SCM_RIGHTS) {
+		errno = EPROTO;
+		perror("tcpc_shm_connect");
+		return -1;
+	}
+	n = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+	memcpy(fds, CMSG_DATA(cm), (n < 3 ? n : 3) * sizeof(int));
+	if(n != 3) {
+		/* close whatever came */
+		for(i = 0; i < n && i < 3; i++)
+			close(fds[i]);
+		errno = EPROTO;
+		perror("tcpc_shm_connect");
+		return -1;
+	}
+
+	/* check what the server made */
+	if(fstat(fds[0], &st) == 0 && (size_t)st.st_size >=
+			sizeof(struct tcpc_shm_hdr) && (h = (struct tcpc_shm_hdr *)
+			mmap(NULL, sizeof(struct tcpc_shm_hdr), PROT_READ,
+			MAP_SHARED, fds[0], 0)) != MAP_FAILED) {
+		if(h->magic == TCPC_SHM_MAGIC && h->ring_sz &&
+				!(h->ring_sz & (h->ring_sz - 1)) &&
+				(size_t)st.st_size == _shm_map_size(h->ring_sz))
+			ring_sz = h->ring_sz;
+		munmap(h, sizeof(struct tcpc_shm_hdr));
+	}
+	if(ring_sz == 0) {
+		close(fds[0]);
+		close(fds[1]);
+		close(fds[2]);
+		errno = EPROTO;
+		perror("tcpc_shm_connect");
+		return -1;
+	}
+
+	if(_shm_attach(c->_sock, fds[0], fds[1], fds[2], ring_sz, 0,
+			NULL) < 0) {
+		perror("tcpc_shm_connect");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* API FUNCTIONS */
+int tcpc_shm_server_conn(struct tcpc_server_conn *c, size_t ring_sz)
+{
+	struct tcpc_mem *mem = tcpc_server_conn_mem(c);
+	struct tcpc_shm_hdr *h;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	union {
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	int sock = tcpc_server_conn_socket(c);
+	int fds[3] = { -1, -1, -1 }; /* memory, client bell, server bell */
+	size_t map_sz, sz = 64;
+	char b = 0;
+	int i;
+
+	if(tcpc_conn_server(c)->io_threads > 0 ||
+			c->conn_addr->sa_family != AF_UNIX ||
+			sock >= TCPC_SHM_MAX_FD ||
+			__atomic_load_n(&_shm_fds[sock], __ATOMIC_ACQUIRE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(ring_sz == 0)
+		ring_sz = TCPC_SHM_RING_SZ;
+	while(sz < ring_sz)
+		sz <<= 1;
+	if(sz > UINT32_MAX / 4) {
+		errno = EINVAL;
+		return -1;
+	}
+	map_sz = _shm_map_size((uint32_t)sz);
+	if(tcpc_mem_charge(mem, map_sz + sizeof(struct tcpc_shm)) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* the memory, zeroed, and a doorbell for each side */
+	if((fds[0] = memfd_create("tcpc_shm", MFD_CLOEXEC)) < 0 ||
+			ftruncate(fds[0], (off_t)map_sz) < 0 ||
+			(fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+			(fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		goto fail;
+	if((h = (struct tcpc_shm_hdr *)mmap(NULL, map_sz, PROT_WRITE,
+			MAP_SHARED, fds[0], 0)) == MAP_FAILED)
+		goto fail;
+	h->ring_sz = (uint32_t)sz;
+	h->magic = TCPC_SHM_MAGIC;
+	/* both sides start out waiting, so the first bytes ring */
+	for(i = 0; i < 2; i++)
+		_shm_ring((uint8_t *)h, (uint32_t)sz, i)->rx_wait = 1;
+	munmap(h, map_sz);
+
+	/* hand them over */
+	memset(&mh, 0, sizeof(mh));
+	memset(&ctl, 0, sizeof(ctl));
+	iov.iov_base = &b;
+	iov.iov_len = 1;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof(ctl.buf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if(sendmsg(sock, &mh, MSG_NOSIGNAL) != 1)
+		goto fail;
+
+	/* the server is rung on the second doorbell and rings the first.
+	 * the client has moved over already, so without the rings the
+	 * connection is of no use to either side
+	 */
+	if(_shm_attach(sock, fds[0], fds[2], fds[1], (uint32_t)sz, 1,
+			mem) < 0) {
+		perror("tcpc_shm_server_conn");
+		shutdown(sock, SHUT_RDWR);
+		tcpc_mem_uncharge(mem, map_sz + sizeof(struct tcpc_shm));
+		return -1;
+	}
+
+	c->rx_h = &_shm_rx;
+	c->tx_h = &_shm_tx;
+	c->close_h = &_shm_close;
+
+	return 0;
+
+fail:
+	perror("tcpc_shm_server_conn");
+	for(i = 0; i < 3; i++) {
+		if(fds[i] >= 0)
+			close(fds[i]);
+	}
+	tcpc_mem_uncharge(mem, map_sz + sizeof(struct tcpc_shm));
+	return -1;
+}
+
+void tcpc_shm_client(struct tcpc_client *c)
+{
+	c->connect_h = &_shm_connect;
+	c->rx_h = &_shm_rx;
+	c->tx_h = &_shm_tx;
+	c->close_h = &_shm_close;
+}
@@ -0,0 +1,74 @@
+/*
+ * tcpc_shm.h - Shared memory transport for the TCPC framework.
+ *
+ * This file is part of TCPC.
+ *
+ * Copyright (C) 2008 Robert C. Curtis
+ *
+ * TCPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * TCPC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with TCPC.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/****************************************************************************/
+
+/* DESCRIPTION: Moves the bytes of a connection to a peer on the same host
+ * through shared memory instead of a socket. The server listens on a Unix
+ * socket as usual. When a connection comes in, it sends the client a memfd
+ * holding one byte ring each way, and an eventfd doorbell for each side.
+ * From then on the socket only tells when the peer goes away.
+ *
+ * The transport is installed as the connection's rx_h, tx_h and close_h,
+ * and the connection keeps its socket descriptor number, so conn_h,
+ * tcpc_server_send_to, the outbound queue and the rest work unchanged.
+ * The descriptor polled becomes an epoll of the doorbell and the socket,
+ * which can't report POLLOUT. A queue waiting on a full ring is flushed
+ * when the doorbell rings for the room, and a blocking send sleeps on a
+ * futex in the shared memory until the receiver makes room.
+ *
+ * 	server:	in new_conn_h, tcpc_shm_server_conn(c, 0);
+ * 	client:	tcpc_shm_client(&cl); before tcpc_start_client(&cl);
+ */
+
+#include <stddef.h>
+#include "tcpc.h"
+
+#ifndef I__TCPC_SHM_H__
+	#define I__TCPC_SHM_H__
+
+#define TCPC_SHM_RING_SZ	(1 << 20)	/* default bytes each way */
+#define TCPC_SHM_MAX_FD		65536	/* descriptors that can use it */
+#define TCPC_SHM_HANDSHAKE_MS	1000	/* client wait for the server */
+
+/* tcpc_shm_server_conn
+ * 	DESCRIPTION: moves a new connection to shared memory with rings of
+ * 	ring_sz bytes (rounded up to a power of two, 0 for TCPC_SHM_RING_SZ).
+ * 	Call it from new_conn_h of a server on a Unix socket, without
+ * 	io_threads. The memory is charged to the connection.
+ *
+ * 	RETURN VALUES:
+ * 		0	- everything went as planned
+ * 		errors: errno will be set with specific error information
+ * 		-1	- error, the connection stays on its socket. If the
+ * 			  client was already sent the rings, the socket is
+ * 			  shut down instead and the connection ends.
+ */
+int tcpc_shm_server_conn(struct tcpc_server_conn *c, size_t ring_sz);
+
+/* tcpc_shm_client
+ * 	DESCRIPTION: sets up a client of a tcpc_shm_server_conn server to move
+ * 	to shared memory once it's connected. Call it before
+ * 	tcpc_start_client, which fails with -2 if the move does.
+ */
+void tcpc_shm_client(struct tcpc_client *c);
+
+#endif /* I__TCPC_SHM_H__ */